@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+static void die(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+/* Batches are built BATCH_TILE_SAMPLES samples at a time; raw pixels in tiles of BATCH_TILE_PIXELS. */
+#define BATCH_TILE_SAMPLES 32
+#define BATCH_TILE_PIXELS 56
+
+/* store_columns() transposes blocks of TRANSPOSE_BLOCK samples x TRANSPOSE_BLOCK features. */
+#define TRANSPOSE_BLOCK 8
+
+/**
+ * Write the n <= BATCH_TILE_SAMPLES samples img[] into columns [col0, col0 + n) of the
+ * feature-major input batch X (features x batch).
+ *
+ * A straight copy would scatter each sample down a column. Instead 8 samples x 8 features at a
+ * time are transposed through a block small enough to stay in registers, and each block row is
+ * stored into X as one contiguous run. The wide nn_real samples make a larger tile (as the raw
+ * path uses) spill to L1 on both the transpose and the copy-out.
+ */
+static void store_columns(matrix* x, uint32_t col0, const nn_real* const* img, uint32_t n) {
+  uint64_t bs = x->column_size;
+  uint32_t features = (uint32_t)x->row_size;
+  uint32_t c0 = 0;
+
+  for (; c0 + TRANSPOSE_BLOCK <= n; c0 += TRANSPOSE_BLOCK) {
+    uint32_t p0 = 0;
+    for (; p0 + TRANSPOSE_BLOCK <= features; p0 += TRANSPOSE_BLOCK) {
+      nn_real block[TRANSPOSE_BLOCK][TRANSPOSE_BLOCK];
+      for (uint32_t c = 0; c < TRANSPOSE_BLOCK; c++)
+        for (uint32_t p = 0; p < TRANSPOSE_BLOCK; p++) block[p][c] = img[c0 + c][p0 + p];
+      for (uint32_t p = 0; p < TRANSPOSE_BLOCK; p++) {
+        memcpy(x->array + (uint64_t)(p0 + p) * bs + col0 + c0, block[p], sizeof(block[p]));
+      }
+    }
+    for (; p0 < features; p0++) {
+      for (uint32_t c = 0; c < TRANSPOSE_BLOCK; c++) x->array[(uint64_t)p0 * bs + col0 + c0 + c] = img[c0 + c][p0];
+    }
+  }
+
+  /* Fewer than TRANSPOSE_BLOCK samples left: scatter them. */
+  for (; c0 < n; c0++) {
+    for (uint32_t p = 0; p < features; p++) x->array[(uint64_t)p * bs + col0 + c0] = img[c0][p];
+  }
+}
+
+/**
+ * store_columns() for raw pixels. The bytes are transposed through a uint8_t tile (an eighth of
+ * the nn_real one), and each tile row is then widened to nn_real and scaled by 1/255 as it is
+ * written out. That loop has unit stride on both sides, so the compiler turns it into SIMD
+ * widening conversions.
+ */
+static void store_columns_u8(matrix* x, uint32_t col0, const uint8_t* const* img, uint32_t n) {
+  uint8_t tile[BATCH_TILE_PIXELS][BATCH_TILE_SAMPLES];
+  uint64_t bs = x->column_size;
+  uint32_t features = (uint32_t)x->row_size;
+  const nn_real scale = (nn_real)(1.0 / 255.0);
+
+  for (uint32_t p0 = 0; p0 < features; p0 += BATCH_TILE_PIXELS) {
+    uint32_t pn = (features - p0 < BATCH_TILE_PIXELS) ? features - p0 : BATCH_TILE_PIXELS;
+
+    for (uint32_t c = 0; c < n; c++) {
+      const uint8_t* src = img[c] + p0;
+      for (uint32_t p = 0; p < pn; p++) tile[p][c] = src[p];
+    }
+
+    for (uint32_t p = 0; p < pn; p++) {
+      nn_real* dst = x->array + (uint64_t)(p0 + p) * bs + col0;
+      const uint8_t* src = tile[p];
+      for (uint32_t c = 0; c < n; c++) dst[c] = (nn_real)src[c] * scale;
+    }
+  }
+}
+
+/**
+ * Mark label y in column col of a zeroed one-hot matrix.
+ */
+static void set_one_hot(matrix* y_onehot, uint32_t col, uint8_t y) {
+  if (y >= y_onehot->row_size) die("Invalid label");
+  y_onehot->array[(uint64_t)y * y_onehot->column_size + col] = 1.0;
+}
+
+/**
+ * Fill an input batch matrix X and one-hot label matrix Y from a pre-normalized dataset.
+ * X has shape (features x bs), Y has shape (classes x bs). Every element of X is
+ * written, so X is not cleared first. A NULL idx reads samples in dataset order and a NULL
+ * y_onehot skips the labels.
+ */
+void build_batch_inputs(
+  matrix* x,
+  const dataset_cache* data,
+  const uint32_t* idx,
+  uint32_t start,
+  uint32_t bs,
+  matrix* y_onehot
+) {
+  const nn_real* img[BATCH_TILE_SAMPLES];
+
+  if (y_onehot) memset(y_onehot->array, 0, y_onehot->row_size * y_onehot->column_size * sizeof(nn_real));
+
+  for (uint32_t col0 = 0; col0 < bs; col0 += BATCH_TILE_SAMPLES) {
+    uint32_t n = (bs - col0 < BATCH_TILE_SAMPLES) ? bs - col0 : BATCH_TILE_SAMPLES;
+
+    for (uint32_t c = 0; c < n; c++) {
+      uint32_t k = idx ? idx[start + col0 + c] : start + col0 + c;
+      img[c] = data->samples + (uint64_t)k * data->stride;
+      if (y_onehot) set_one_hot(y_onehot, col0 + c, data->labels[k]);
+    }
+    store_columns(x, col0, img, n);
+  }
+}
+
+/**
+ * Same as build_batch_inputs(), from bs raw samples stored back to back in 'pixels'.
+ */
+void build_batch_inputs_u8(matrix* x, const uint8_t* pixels, const uint8_t* labels, uint32_t bs, matrix* y_onehot) {
+  const uint8_t* img[BATCH_TILE_SAMPLES];
+
+  if (y_onehot) memset(y_onehot->array, 0, y_onehot->row_size * y_onehot->column_size * sizeof(nn_real));
+
+  for (uint32_t col0 = 0; col0 < bs; col0 += BATCH_TILE_SAMPLES) {
+    uint32_t n = (bs - col0 < BATCH_TILE_SAMPLES) ? bs - col0 : BATCH_TILE_SAMPLES;
+
+    for (uint32_t c = 0; c < n; c++) {
+      img[c] = pixels + (uint64_t)(col0 + c) * x->row_size;
+      if (y_onehot) set_one_hot(y_onehot, col0 + c, labels[col0 + c]);
+    }
+    store_columns_u8(x, col0, img, n);
+  }
+}
+
+/**
+ * View the first bs columns of a (rows x batch_size) batch buffer as a packed (rows x bs) matrix.
+ */
+matrix batch_view(const matrix* buffer, uint32_t bs) {
+  matrix m = {.row_size = buffer->row_size, .column_size = bs, .array = buffer->array};
+  return m;
+}
+
+/**
+ * batch_builder over a dataset cache: gather and one-hot batch 'step' of the epoch.
+ */
+void build_cached_batch(void* context, uint64_t step, matrix* x, matrix* y) {
+  const cached_batches* cb = (const cached_batches*)context;
+  uint32_t start = (uint32_t)step * cb->batch_size;
+  uint32_t bs = cb->batch_size;
+  if (start + bs > cb->data->count) bs = cb->data->count - start;
+
+  *x = batch_view(x, bs);
+  *y = batch_view(y, bs);
+  build_batch_inputs(x, cb->data, cb->idx, start, bs, y);
+}
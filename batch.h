@@ -0,0 +1,38 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+#include "dataset_cache.h"
+
+/*
+  Batch assembly: samples are gathered into a feature-major input batch X (features x batch) and
+  a one-hot label batch Y (classes x batch), the layout forward_pass() consumes. The feature and
+  class counts are taken from the matrices' row sizes.
+*/
+
+/*
+  Fill X and Y with samples idx[start], ..., idx[start + bs - 1] of a pre-normalized dataset.
+  Every element of X is written, so X is not cleared first. A NULL idx takes samples start,
+  ..., start + bs - 1 in dataset order; a NULL y_onehot skips the labels (inference only).
+*/
+void build_batch_inputs(matrix* x, const dataset_cache* data, const uint32_t* idx, uint32_t start, uint32_t bs, matrix* y_onehot);
+
+/* Same as build_batch_inputs(), from bs raw samples stored back to back in 'pixels', scaled to [0, 1]. Labels may be NULL when y_onehot is. */
+void build_batch_inputs_u8(matrix* x, const uint8_t* pixels, const uint8_t* labels, uint32_t bs, matrix* y_onehot);
+
+/* View the first bs columns of a (rows x batch_size) batch buffer as a packed (rows x bs) matrix. */
+matrix batch_view(const matrix* buffer, uint32_t bs);
+
+/* Batches drawn from a dataset cache in the order given by idx. */
+typedef struct {
+  const dataset_cache* data;
+  const uint32_t* idx;
+  uint32_t batch_size;
+} cached_batches;
+
+/* batch_builder (pipeline.h) over a cached_batches context: gather and one-hot batch 'step' of the epoch. */
+void build_cached_batch(void* context, uint64_t step, matrix* x, matrix* y);
+
+#endif
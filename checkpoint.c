@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+
+/* Every blob starts on a cache line, so mapped weights are as aligned as heap ones. */
+#define CHECKPOINT_ALIGN 64
+
+/* Indexed by optimizer_kind. */
+static char* const optimizer_names[] = {"sgd", "momentum", "nesterov", "adam", "adamw"};
+
+static uint64_t align_up(uint64_t n, uint64_t a) {
+  return (n + a - 1) / a * a;
+}
+
+static uint32_t activation_id(const layer* l) {
+  if(l->a == relu_into) return CHECKPOINT_ACTIVATION_RELU;
+  if(l->a == softmax_into) return CHECKPOINT_ACTIVATION_SOFTMAX;
+  return 0;
+}
+
+static char* activation_name(uint32_t id) {
+  if(id == CHECKPOINT_ACTIVATION_RELU) return "relu";
+  if(id == CHECKPOINT_ACTIVATION_SOFTMAX) return "softmax";
+  return NULL;
+}
+
+static uint32_t optimizer_buffers(const optimizer* opt) {
+  if(!opt) return 0;
+  if(opt->kind == OPTIMIZER_MOMENTUM || opt->kind == OPTIMIZER_NESTEROV) return 1;
+  if(opt->kind == OPTIMIZER_ADAM || opt->kind == OPTIMIZER_ADAMW) return 2;
+  return 0;
+}
+
+/* Write 'bytes' from 'data' at file offset 'offset' >= *pos, zero-filling the gap. */
+static int write_at(FILE* f, uint64_t* pos, uint64_t offset, const void* data, uint64_t bytes) {
+  static const uint8_t zeros[CHECKPOINT_ALIGN];
+  while(*pos < offset) {
+    uint64_t n = offset - *pos;
+    if(n > sizeof(zeros)) n = sizeof(zeros);
+    if(fwrite(zeros, 1, (size_t)n, f) != (size_t)n) return 1;
+    *pos += n;
+  }
+  if(bytes && fwrite(data, 1, (size_t)bytes, f) != (size_t)bytes) return 1;
+  *pos += bytes;
+  return 0;
+}
+
+/* fsync the directory holding 'path', so a rename into it is on disk. */
+static int sync_directory(const char* path) {
+  char dir[4096];
+  const char* slash = strrchr(path, '/');
+  if(!slash) {
+    strcpy(dir, ".");
+  } else if(slash == path) {
+    strcpy(dir, "/");
+  } else {
+    size_t n = (size_t)(slash - path);
+    if(n >= sizeof(dir)) return 1;
+    memcpy(dir, path, n);
+    dir[n] = '\0';
+  }
+
+  int fd = open(dir, O_RDONLY);
+  if(fd < 0) return 1;
+  int failed = fsync(fd) != 0;
+  close(fd);
+  return failed;
+}
+
+int checkpoint_save(const char* path, const neural_network* network, const optimizer* opt, uint64_t epoch) {
+  uint32_t n = network->number_of_layers;
+  checkpoint_layer* records = calloc(n ? n : 1, sizeof(checkpoint_layer));
+  if(!records) return 1;
+
+  checkpoint_header h;
+  memset(&h, 0, sizeof(h));
+  h.magic = CHECKPOINT_MAGIC;
+  h.version = CHECKPOINT_VERSION;
+  h.element_size = sizeof(nn_real);
+  h.layers = n;
+  h.epoch = epoch;
+  h.learning_rate = network->learning_rate;
+
+  /* The parameter block goes in whole; each layer's offsets are its views' positions in it. */
+  uint64_t parameters_offset = align_up(sizeof(h) + n * sizeof(checkpoint_layer), CHECKPOINT_ALIGN);
+  uint64_t parameters = network->parameters.used;
+  const nn_real* block = network->parameters.base;
+  for(uint32_t i = 0; i < n; i++) {
+    const layer* l = &network->layers[i];
+    checkpoint_layer* r = &records[i];
+    r->inputs = l->weights.column_size;
+    r->neurons = l->neurons;
+    r->activation = activation_id(l);
+    if(!r->activation) {
+      free(records);
+      return 2;
+    }
+    r->weights_offset = parameters_offset + (uint64_t)(l->weights.array - block) * sizeof(nn_real);
+    r->biases_offset = parameters_offset + (uint64_t)(l->biases.array - block) * sizeof(nn_real);
+  }
+  uint64_t offset = align_up(parameters_offset + parameters * sizeof(nn_real), CHECKPOINT_ALIGN);
+
+  if(opt) {
+    h.optimizer_kind = opt->kind;
+    h.optimizer_buffers = optimizer_buffers(opt);
+    h.optimizer_step = opt->step;
+    h.momentum = opt->momentum;
+    h.beta1 = opt->beta1;
+    h.beta2 = opt->beta2;
+    h.epsilon = opt->epsilon;
+    h.weight_decay = opt->weight_decay;
+    if(opt->parameters != parameters) {
+      free(records);
+      return 3;
+    }
+  }
+  uint64_t state_bytes = align_up(parameters * sizeof(nn_real), CHECKPOINT_ALIGN);
+  if(h.optimizer_buffers) {
+    h.optimizer_offset = offset;
+    offset += h.optimizer_buffers * state_bytes;
+  }
+  h.file_size = offset;
+
+  /*
+    Write to a temporary name, fsync it, and rename, so the previous checkpoint survives a crash
+    or power loss mid-save: the rename only happens once the new contents are on disk.
+  */
+  char tmp[4096];
+  if(snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid()) >= (int)sizeof(tmp)) {
+    free(records);
+    return 4;
+  }
+  FILE* f = fopen(tmp, "wb");
+  if(!f) {
+    free(records);
+    return 5;
+  }
+
+  uint64_t pos = 0;
+  int failed = write_at(f, &pos, 0, &h, sizeof(h));
+  failed |= write_at(f, &pos, sizeof(h), records, n * sizeof(checkpoint_layer));
+  failed |= write_at(f, &pos, parameters_offset, block, parameters * sizeof(nn_real));
+  if(h.optimizer_buffers >= 1) failed |= write_at(f, &pos, h.optimizer_offset, opt->m, parameters * sizeof(nn_real));
+  if(h.optimizer_buffers == 2) failed |= write_at(f, &pos, h.optimizer_offset + state_bytes, opt->v, parameters * sizeof(nn_real));
+  failed |= write_at(f, &pos, h.file_size, NULL, 0);
+  failed |= fflush(f) != 0 || fsync(fileno(f)) != 0;
+  free(records);
+
+  if(fclose(f) != 0 || failed || rename(tmp, path) != 0) {
+    remove(tmp);
+    return 6;
+  }
+  /* The new checkpoint is complete either way; this makes the rename itself durable. */
+  if(sync_directory(path) != 0) return 7;
+  return 0;
+}
+
+const char* checkpoint_error(int status) {
+  switch(status) {
+    case CHECKPOINT_OK: return "no error";
+    case CHECKPOINT_NOT_FOUND: return "no such file";
+    case CHECKPOINT_IO_ERROR: return "could not be read";
+    case CHECKPOINT_CORRUPT: return "not a valid checkpoint (corrupt or truncated)";
+    case CHECKPOINT_VERSION_MISMATCH: return "written in another checkpoint format version (older checkpoints cannot be loaded)";
+    case CHECKPOINT_ELEMENT_MISMATCH: return "written by a build with a different element type (float vs double)";
+    case CHECKPOINT_OPTIMIZER_ERROR: return "optimizer state does not match";
+    default: return "unknown error";
+  }
+}
+
+/* Map 'path' read-only. Returns a checkpoint_status; on CHECKPOINT_IO_ERROR errno is the cause. */
+static int map_file(const char* path, checkpoint* ckpt) {
+  memset(ckpt, 0, sizeof(*ckpt));
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return errno == ENOENT ? CHECKPOINT_NOT_FOUND : CHECKPOINT_IO_ERROR;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return CHECKPOINT_IO_ERROR;
+  }
+  if((uint64_t)st.st_size < sizeof(checkpoint_header)) {
+    close(fd);
+    return CHECKPOINT_CORRUPT;
+  }
+
+  void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  int saved = errno;
+  close(fd);
+  if(base == MAP_FAILED) {
+    errno = saved;
+    return CHECKPOINT_IO_ERROR;
+  }
+
+  ckpt->mapping = base;
+  ckpt->mapping_size = (uint64_t)st.st_size;
+  return CHECKPOINT_OK;
+}
+
+/* Is [offset, offset + bytes) an aligned range inside the file? */
+static int in_file(const checkpoint_header* h, uint64_t offset, uint64_t bytes) {
+  return offset % CHECKPOINT_ALIGN == 0 && offset <= h->file_size && bytes <= h->file_size - offset;
+}
+
+/*
+  Validate a mapped checkpoint and rebuild its network. With copy set the network owns a copy of
+  the parameter block; otherwise it borrows the block from the mapping. Returns a checkpoint_status.
+*/
+static int build_network(const checkpoint* ckpt, neural_network* network, int copy) {
+  const uint8_t* base = (const uint8_t*)ckpt->mapping;
+  const checkpoint_header* h = (const checkpoint_header*)base;
+
+  if(h->magic != CHECKPOINT_MAGIC) return CHECKPOINT_CORRUPT;
+  if(h->version != CHECKPOINT_VERSION) return CHECKPOINT_VERSION_MISMATCH;
+  if(h->element_size != sizeof(nn_real)) return CHECKPOINT_ELEMENT_MISMATCH;
+  /* number_of_layers is a uint16_t. */
+  if(h->file_size > ckpt->mapping_size || h->layers == 0 || h->layers > UINT16_MAX ||
+     !in_file(h, 0, sizeof(*h) + (uint64_t)h->layers * sizeof(checkpoint_layer))) {
+    return CHECKPOINT_CORRUPT;
+  }
+
+  /*
+    Shapes are bounded by the file before anything is multiplied or allocated: each layer's
+    weights, and then the whole padded parameter block, must fit in the file.
+  */
+  const checkpoint_layer* records = (const checkpoint_layer*)(base + sizeof(*h));
+  uint64_t max_elements = h->file_size / sizeof(nn_real);
+  uint64_t parameters = 0;
+  for(uint32_t i = 0; i < h->layers; i++) {
+    const checkpoint_layer* r = &records[i];
+    if(!activation_name(r->activation) || r->inputs == 0 || r->neurons == 0 || r->neurons > max_elements / r->inputs ||
+       (i > 0 && r->inputs != records[i - 1].neurons) ||
+       !in_file(h, r->weights_offset, r->neurons * r->inputs * sizeof(nn_real)) ||
+       !in_file(h, r->biases_offset, r->neurons * sizeof(nn_real))) {
+      return CHECKPOINT_CORRUPT;
+    }
+    parameters += arena_matrix_size(r->neurons, r->inputs) + arena_matrix_size(r->neurons, 1);
+  }
+  if(parameters > max_elements || !in_file(h, records[0].weights_offset, parameters * sizeof(nn_real))) {
+    return CHECKPOINT_CORRUPT;
+  }
+
+  /*
+    The layers are placed by shape alone: a copy gets a zeroed block that the file is then copied
+    into, a mapping borrows the file's block. Nothing is initialised only to be overwritten.
+  */
+  uint64_t parameters_offset = records[0].weights_offset;
+  *network = create_network();
+  network->learning_rate = h->learning_rate;
+  if(!copy) network_borrow_parameters(network, (nn_real*)(base + parameters_offset));
+  for(uint32_t i = 0; i < h->layers; i++) {
+    const checkpoint_layer* r = &records[i];
+    add_layer(network, linear_shape(r->inputs, r->neurons, activation_name(r->activation)));
+  }
+
+  /* The stored blobs must sit exactly where the views sit in the network's parameter block. */
+  const nn_real* block = network->parameters.base;
+  int matches = in_file(h, parameters_offset, network->parameters.used * sizeof(nn_real));
+  for(uint32_t i = 0; i < h->layers && matches; i++) {
+    const layer* l = &network->layers[i];
+    matches = records[i].weights_offset == parameters_offset + (uint64_t)(l->weights.array - block) * sizeof(nn_real) &&
+              records[i].biases_offset == parameters_offset + (uint64_t)(l->biases.array - block) * sizeof(nn_real);
+  }
+  if(!matches) {
+    free_network_memory(network);
+    return CHECKPOINT_CORRUPT;
+  }
+
+  if(copy) memcpy(network->parameters.base, base + parameters_offset, network->parameters.used * sizeof(nn_real));
+  return CHECKPOINT_OK;
+}
+
+/* Set up 'opt' as the saved optimizer, including its state. */
+static int restore_optimizer(const checkpoint* ckpt, neural_network* network, optimizer* opt) {
+  const uint8_t* base = (const uint8_t*)ckpt->mapping;
+  const checkpoint_header* h = (const checkpoint_header*)base;
+
+  if(h->optimizer_kind >= sizeof(optimizer_names) / sizeof(optimizer_names[0])) return 1;
+  if(optimizer_init(opt, optimizer_names[h->optimizer_kind], network) != 0) return 2;
+
+  opt->step = h->optimizer_step;
+  opt->momentum = h->momentum;
+  opt->beta1 = h->beta1;
+  opt->beta2 = h->beta2;
+  opt->epsilon = h->epsilon;
+  opt->weight_decay = h->weight_decay;
+
+  uint32_t buffers = optimizer_buffers(opt);
+  uint64_t bytes = opt->parameters * sizeof(nn_real);
+  uint64_t state_bytes = align_up(bytes, CHECKPOINT_ALIGN);
+  if(h->optimizer_buffers != buffers || (buffers && !in_file(h, h->optimizer_offset, buffers * state_bytes))) {
+    optimizer_free(opt);
+    return 3;
+  }
+  if(buffers >= 1) memcpy(opt->m, base + h->optimizer_offset, bytes);
+  if(buffers == 2) memcpy(opt->v, base + h->optimizer_offset + state_bytes, bytes);
+  return 0;
+}
+
+int checkpoint_load(const char* path, neural_network* network, optimizer* opt, uint64_t* epoch) {
+  checkpoint ckpt;
+  int rc = map_file(path, &ckpt);
+  if(rc != CHECKPOINT_OK) return rc;
+
+  rc = build_network(&ckpt, network, 1);
+  if(!rc && opt && restore_optimizer(&ckpt, network, opt) != 0) {
+    free_network_memory(network);
+    rc = CHECKPOINT_OPTIMIZER_ERROR;
+  }
+  if(!rc && epoch) *epoch = ((const checkpoint_header*)ckpt.mapping)->epoch;
+
+  munmap(ckpt.mapping, (size_t)ckpt.mapping_size);
+  return rc;
+}
+
+int checkpoint_map(const char* path, checkpoint* ckpt, neural_network* network) {
+  int rc = map_file(path, ckpt);
+  if(rc != CHECKPOINT_OK) return rc;
+
+  rc = build_network(ckpt, network, 0);
+  if(rc != CHECKPOINT_OK) {
+    munmap(ckpt->mapping, (size_t)ckpt->mapping_size);
+    memset(ckpt, 0, sizeof(*ckpt));
+  }
+  return rc;
+}
+
+void checkpoint_unmap(checkpoint* ckpt, neural_network* network) {
+  /* The parameters are borrowed from the mapping, so free_network_memory() leaves them alone. */
+  free_network_memory(network);
+
+  if(ckpt->mapping) munmap(ckpt->mapping, (size_t)ckpt->mapping_size);
+  memset(ckpt, 0, sizeof(*ckpt));
+}
@@ -0,0 +1,112 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+#include "optimizer.h"
+
+/*
+  Model checkpoint: the layer shapes and activations, the raw weights and, optionally, the
+  optimizer state, so a run can resume where it stopped or serve inference without retraining.
+
+  On-disk layout (native endianness, like the dataset cache; every blob starts on a 64-byte boundary):
+    [0, 128)            checkpoint_header
+    [128, ...)          'layers' checkpoint_layer records
+    weights_offset      (neurons x inputs) nn_real, row-major, per layer
+    biases_offset       neurons nn_real, per layer
+    optimizer_offset    optimizer_buffers blocks of 'parameters' nn_real (velocity, or m then v)
+
+  The weights and biases, with their zero padding, are the network's parameter block byte for
+  byte, so they are written, loaded and mapped as one block. The optimizer blocks share that
+  layout, padding included ('parameters' counts it). Version 1 stored them unpadded. Version 1
+  files are incompatible: loading one fails with CHECKPOINT_VERSION_MISMATCH, and --resume stops
+  rather than overwrite it.
+*/
+typedef struct {
+  uint32_t magic;              /* CHECKPOINT_MAGIC */
+  uint32_t version;            /* CHECKPOINT_VERSION */
+  uint32_t element_size;       /* sizeof(nn_real) of the stored weights */
+  uint32_t layers;
+  uint64_t epoch;              /* training epochs completed when saved */
+  double learning_rate;
+
+  uint32_t optimizer_kind;     /* optimizer_kind */
+  uint32_t optimizer_buffers;  /* state blocks stored: 0, 1 or 2 */
+  uint64_t optimizer_step;
+  double momentum;
+  double beta1;
+  double beta2;
+  double epsilon;
+  double weight_decay;
+  uint64_t optimizer_offset;   /* 0 when optimizer_buffers is 0 */
+
+  uint64_t file_size;
+  uint8_t reserved[24];
+} checkpoint_header;
+
+typedef struct {
+  uint64_t inputs;
+  uint64_t neurons;
+  uint32_t activation;         /* CHECKPOINT_ACTIVATION_* */
+  uint32_t reserved;
+  uint64_t weights_offset;
+  uint64_t biases_offset;
+} checkpoint_layer;
+
+#define CHECKPOINT_MAGIC 0x4b434e4e /* "NNCK" */
+#define CHECKPOINT_VERSION 2
+
+#define CHECKPOINT_ACTIVATION_RELU 1
+#define CHECKPOINT_ACTIVATION_SOFTMAX 2
+
+/*
+  checkpoint_load() and checkpoint_map() results. Only CHECKPOINT_NOT_FOUND means there is no
+  checkpoint; the others mean there is one that cannot be used as it stands.
+*/
+enum checkpoint_status {
+  CHECKPOINT_OK = 0,
+  CHECKPOINT_NOT_FOUND,         /* the file does not exist (ENOENT) */
+  CHECKPOINT_IO_ERROR,          /* open, stat or mmap failed; errno says why */
+  CHECKPOINT_CORRUPT,           /* not a checkpoint, truncated, or inconsistent */
+  CHECKPOINT_VERSION_MISMATCH,  /* written in another CHECKPOINT_VERSION */
+  CHECKPOINT_ELEMENT_MISMATCH,  /* written by a float build and read by a double one, or vice versa */
+  CHECKPOINT_OPTIMIZER_ERROR    /* the saved optimizer state is unknown or does not fit */
+};
+
+/* A short description of a checkpoint_status. */
+const char* checkpoint_error(int status);
+
+/* A mapped checkpoint; the network built by checkpoint_map() points into it. */
+typedef struct {
+  void* mapping;
+  uint64_t mapping_size;
+} checkpoint;
+
+/*
+  Write 'network' (and the state of 'opt', if not NULL) to 'path'. The file is written under a
+  temporary name, fsynced and renamed, and the directory is fsynced, so a crash or power loss
+  mid-save leaves either the previous checkpoint or the new one, complete.
+  Returns 0 on success, nonzero on failure.
+*/
+int checkpoint_save(const char* path, const neural_network* network, const optimizer* opt, uint64_t epoch);
+
+/*
+  Rebuild a network from 'path' with its own copy of the weights, ready to train. If opt is not
+  NULL it is initialised to the saved optimizer, state included (plain SGD if none was saved).
+  epoch, if not NULL, receives the saved epoch count. Returns a checkpoint_status.
+*/
+int checkpoint_load(const char* path, neural_network* network, optimizer* opt, uint64_t* epoch);
+
+/*
+  Zero-copy load for inference: map 'path' read-only and build a network whose weights and
+  biases point into the mapping. The weights must not be updated. Release with checkpoint_unmap().
+  Returns a checkpoint_status.
+*/
+int checkpoint_map(const char* path, checkpoint* ckpt, neural_network* network);
+
+/* Free a network built by checkpoint_map() and unmap its weights. */
+void checkpoint_unmap(checkpoint* ckpt, neural_network* network);
+
+#endif
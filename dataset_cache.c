@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataset_cache.h"
+
+/* Row stride and section offsets are rounded to whole cache lines. */
+#define CACHE_ALIGN 64
+
+static uint64_t align_up(uint64_t n, uint64_t a) {
+  return (n + a - 1) / a * a;
+}
+
+/* Fill in the layout fields of a header for 'count' samples of 'features' elements. */
+static void layout(dataset_cache_header* h, uint32_t count, uint32_t features) {
+  memset(h, 0, sizeof(*h));
+  h->magic = DATASET_CACHE_MAGIC;
+  h->version = DATASET_CACHE_VERSION;
+  h->element_size = sizeof(nn_real);
+  h->count = count;
+  h->features = features;
+  h->stride = (uint32_t)(align_up((uint64_t)features * sizeof(nn_real), CACHE_ALIGN) / sizeof(nn_real));
+  h->samples_offset = align_up(sizeof(dataset_cache_header), CACHE_ALIGN);
+  h->labels_offset = h->samples_offset + (uint64_t)count * h->stride * sizeof(nn_real);
+}
+
+int dataset_cache_build(const idx_u8_images* images, const idx_u8_labels* labels, dataset_cache* out) {
+  memset(out, 0, sizeof(*out));
+  if (images->count != labels->count) return 1;
+
+  dataset_cache_header h;
+  layout(&h, images->count, images->rows * images->cols);
+
+  /* Same layout as the file, header included, so dataset_cache_write is a single fwrite. */
+  uint64_t size = align_up(h.labels_offset + h.count, CACHE_ALIGN);
+  uint8_t* buffer = aligned_alloc(CACHE_ALIGN, (size_t)size);
+  if (!buffer) return 2;
+  memset(buffer, 0, (size_t)size);
+  memcpy(buffer, &h, sizeof(h));
+
+  nn_real* samples = (nn_real*)(buffer + h.samples_offset);
+  const nn_real scale = (nn_real)(1.0 / 255.0);
+  for (uint64_t i = 0; i < h.count; i++) {
+    const uint8_t* src = images->data + i * h.features;
+    nn_real* dst = samples + i * h.stride;
+    for (uint32_t p = 0; p < h.features; p++) dst[p] = (nn_real)src[p] * scale;
+  }
+  memcpy(buffer + h.labels_offset, labels->data, h.count);
+
+  out->samples = samples;
+  out->labels = buffer + h.labels_offset;
+  out->count = h.count;
+  out->features = h.features;
+  out->stride = h.stride;
+  out->buffer = buffer;
+  return 0;
+}
+
+/* Size and modification time of 'path'. Returns 0 on success, nonzero on failure. */
+static int source_stat(const char* path, dataset_source* out) {
+  struct stat st;
+  if (stat(path, &st) != 0) return 1;
+  memset(out, 0, sizeof(*out));
+  out->size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+  out->mtime_sec = (int64_t)st.st_mtimespec.tv_sec;
+  out->mtime_nsec = (int64_t)st.st_mtimespec.tv_nsec;
+#else
+  out->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+  out->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+#endif
+  return 0;
+}
+
+static int same_source(const dataset_source* a, const dataset_source* b) {
+  return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/* Bytes from the start of the file/buffer to the end of the labels. */
+static uint64_t cache_size(const dataset_cache* cache) {
+  const uint8_t* base = cache->mapping ? (const uint8_t*)cache->mapping : (const uint8_t*)cache->buffer;
+  return (uint64_t)(cache->labels - base) + cache->count;
+}
+
+int dataset_cache_write(const char* path, const dataset_cache* cache) {
+  const void* base = cache->mapping ? cache->mapping : cache->buffer;
+  if (!base) return 1;
+
+  /* Write to a temporary name and rename, so a concurrent reader never maps a partial file. */
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid()) >= (int)sizeof(tmp)) return 2;
+
+  FILE* f = fopen(tmp, "wb");
+  if (!f) return 3;
+
+  uint64_t size = cache_size(cache);
+  if (fwrite(base, 1, (size_t)size, f) != (size_t)size) {
+    fclose(f);
+    remove(tmp);
+    return 4;
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    remove(tmp);
+    return 5;
+  }
+  return 0;
+}
+
+int dataset_cache_map(const char* path, dataset_cache* out) {
+  memset(out, 0, sizeof(*out));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(dataset_cache_header)) {
+    close(fd);
+    return 2;
+  }
+
+  void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return 3;
+
+  dataset_cache_header h;
+  memcpy(&h, base, sizeof(h));
+  dataset_cache_header expected;
+  layout(&expected, h.count, h.features);
+
+  if (h.magic != DATASET_CACHE_MAGIC || h.version != DATASET_CACHE_VERSION || h.element_size != sizeof(nn_real) ||
+      h.stride != expected.stride || h.samples_offset != expected.samples_offset ||
+      h.labels_offset != expected.labels_offset || (uint64_t)st.st_size < h.labels_offset + h.count) {
+    munmap(base, (size_t)st.st_size);
+    return 4;
+  }
+
+  out->samples = (const nn_real*)((const uint8_t*)base + h.samples_offset);
+  out->labels = (const uint8_t*)base + h.labels_offset;
+  out->count = h.count;
+  out->features = h.features;
+  out->stride = h.stride;
+  out->mapping = base;
+  out->mapping_size = (uint64_t)st.st_size;
+  return 0;
+}
+
+int dataset_cache_open(const char* cache_path, const char* images_path, const char* labels_path, dataset_cache* out) {
+  /* Without the IDX files there is nothing to compare against or rebuild from, so any valid cache will do. */
+  dataset_source images_source = {0}, labels_source = {0};
+  int have_sources = source_stat(images_path, &images_source) == 0 && source_stat(labels_path, &labels_source) == 0;
+
+  if (dataset_cache_map(cache_path, out) == 0) {
+    const dataset_cache_header* h = (const dataset_cache_header*)out->mapping;
+    if (!have_sources || (same_source(&h->images, &images_source) && same_source(&h->labels, &labels_source))) return 0;
+    fprintf(stderr, "Dataset cache %s does not match its IDX files; rebuilding\n", cache_path);
+    dataset_cache_free(out);
+  }
+
+  idx_u8_images images;
+  idx_u8_labels labels;
+  if (idx_map_u8_images(images_path, &images) != 0) return 1;
+  if (idx_map_u8_labels(labels_path, &labels) != 0) {
+    idx_release_images(&images);
+    return 2;
+  }
+
+  int rc = dataset_cache_build(&images, &labels, out);
+  idx_release_images(&images);
+  idx_release_labels(&labels);
+  if (rc != 0) return 3;
+
+  /* The buffer starts with the header; stamp it with the sources it was built from. */
+  dataset_cache_header* h = (dataset_cache_header*)out->buffer;
+  h->images = images_source;
+  h->labels = labels_source;
+
+  if (dataset_cache_write(cache_path, out) != 0) {
+    fprintf(stderr, "Could not write dataset cache %s; continuing from memory\n", cache_path);
+    return 0;
+  }
+
+  /* Switch to the mapped file so the pages are shared with other processes using it. */
+  dataset_cache built = *out;
+  if (dataset_cache_map(cache_path, out) == 0) {
+    dataset_cache_free(&built);
+  } else {
+    *out = built;
+  }
+  return 0;
+}
+
+void dataset_cache_free(dataset_cache* cache) {
+  if (cache->mapping) munmap(cache->mapping, (size_t)cache->mapping_size);
+  free(cache->buffer);
+  memset(cache, 0, sizeof(*cache));
+}
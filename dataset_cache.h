@@ -0,0 +1,86 @@
+#ifndef DATASET_CACHE_H_
+#define DATASET_CACHE_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+#include "idx_loader.h"
+
+/*
+  Pre-normalized dataset: every sample is stored as the network's input vector, i.e. its
+  pixels already converted to nn_real and scaled to [0, 1], one 64-byte-aligned row per
+  sample, followed by the raw labels. Training reads it directly, so the uint8 conversion is
+  paid once rather than every epoch.
+
+  On-disk layout (native endianness; a cache is a local artifact, not an interchange format):
+    [0, 128)         dataset_cache_header
+    [128, ...)       count rows of 'stride' nn_real elements (features used, rest zero)
+    labels_offset    count uint8 labels
+
+  A cache written by dataset_cache_open() records the size and modification time of the IDX
+  files it was built from, and is rebuilt when either file changes.
+*/
+
+/* Identifies the version of a source file a cache was built from. */
+typedef struct {
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} dataset_source;
+
+typedef struct {
+  uint32_t magic;         /* DATASET_CACHE_MAGIC */
+  uint32_t version;       /* DATASET_CACHE_VERSION */
+  uint32_t element_size;  /* sizeof(nn_real) the cache was built for */
+  uint32_t count;
+  uint32_t features;
+  uint32_t stride;        /* elements per row */
+  uint64_t samples_offset;
+  uint64_t labels_offset;
+  dataset_source images;  /* all zero when the cache was not built from files */
+  dataset_source labels;
+  uint8_t reserved[40];
+} dataset_cache_header;
+
+#define DATASET_CACHE_MAGIC 0x53444e4e /* "NNDS" */
+#define DATASET_CACHE_VERSION 2
+
+typedef struct {
+  const nn_real* samples; /* row i (stride elements) holds sample i's features */
+  const uint8_t* labels;
+  uint32_t count;
+  uint32_t features;
+  uint32_t stride;
+
+  /* Exactly one of these backs the cache. */
+  void* mapping;          /* read-only mmap of a cache file */
+  uint64_t mapping_size;
+  void* buffer;           /* heap copy from dataset_cache_build */
+} dataset_cache;
+
+/*
+  Convert raw IDX images/labels into an in-memory cache. Returns 0 on success, nonzero on failure.
+*/
+int dataset_cache_build(const idx_u8_images* images, const idx_u8_labels* labels, dataset_cache* out);
+
+/* Write a cache to 'path' so later runs can map it. Returns 0 on success, nonzero on failure. */
+int dataset_cache_write(const char* path, const dataset_cache* cache);
+
+/*
+  Map a cache file read-only (zero-copy; pages are shared between processes). Fails if the file
+  is missing, from another format version, or built for a different nn_real.
+  Returns 0 on success, nonzero on failure.
+*/
+int dataset_cache_map(const char* path, dataset_cache* out);
+
+/*
+  Map 'cache_path' if it is usable and was built from the IDX files as they are now (same size
+  and modification time); otherwise build the cache from the IDX files and try to write it to
+  'cache_path' for next time (a failed write only costs the next run a rebuild).
+  Returns 0 on success, nonzero on failure.
+*/
+int dataset_cache_open(const char* cache_path, const char* images_path, const char* labels_path, dataset_cache* out);
+
+void dataset_cache_free(dataset_cache* cache);
+
+#endif
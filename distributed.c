@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __linux__
+  #include <sys/prctl.h>
+#endif
+
+#include "distributed.h"
+
+/* Slots start on their own cache line, away from the barrier. */
+#define SLOT_OFFSET 128
+
+/* How often a rank waiting at the barrier checks that its peers are still alive. */
+#define PEER_CHECK_NS 100000000L
+
+static int barrier_init(dist_barrier* b, uint32_t count) {
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t cond_attr;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_condattr_init(&cond_attr);
+  int failed = pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED) != 0 ||
+               pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST) != 0 ||
+               pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED) != 0 ||
+               pthread_mutex_init(&b->mutex, &mutex_attr) != 0 ||
+               pthread_cond_init(&b->cond, &cond_attr) != 0;
+  pthread_mutexattr_destroy(&mutex_attr);
+  pthread_condattr_destroy(&cond_attr);
+  b->count = count;
+  b->waiting = 0;
+  b->phase = 0;
+  b->aborted = 0;
+  return failed;
+}
+
+/* A lock or wait result of EOWNERDEAD means a rank died holding the mutex: take it over and abort. */
+static void owner_check(dist_barrier* b, int rc) {
+  if(rc == EOWNERDEAD) {
+    pthread_mutex_consistent(&b->mutex);
+    b->aborted = 1;
+  }
+}
+
+/* Has a peer gone? Rank 0 reaps its children without blocking; the others watch for rank 0. */
+static int peer_lost(dist_trainer* t) {
+  if(t->rank != 0) return getppid() != t->parent;
+  for(uint32_t r = 1; r < t->world; r++) {
+    int status;
+    if(t->children[r] > 0 && waitpid(t->children[r], &status, WNOHANG) != 0) {
+      t->children[r] = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Called with the mutex held once the group is aborted: wake everyone, stop the other ranks, exit. */
+static void abort_group(dist_trainer* t) {
+  dist_barrier* b = t->barrier;
+  b->aborted = 1;
+  pthread_cond_broadcast(&b->cond);
+  pthread_mutex_unlock(&b->mutex);
+  printf("Rank %u: a training process died; stopping\n", t->rank);
+  if(t->rank == 0) {
+    for(uint32_t r = 1; r < t->world; r++) {
+      if(t->children[r] > 0) kill(t->children[r], SIGTERM);
+    }
+  }
+  exit(EXIT_FAILURE);
+}
+
+static void barrier_wait(dist_trainer* t) {
+  dist_barrier* b = t->barrier;
+  owner_check(b, pthread_mutex_lock(&b->mutex));
+  if(b->aborted) abort_group(t);
+
+  uint64_t phase = b->phase;
+  if(++b->waiting == b->count) {
+    b->waiting = 0;
+    b->phase++;
+    pthread_cond_broadcast(&b->cond);
+  } else {
+    while(phase == b->phase) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += PEER_CHECK_NS;
+      if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      owner_check(b, pthread_cond_timedwait(&b->cond, &b->mutex, &deadline));
+      if(b->aborted || (phase == b->phase && peer_lost(t))) abort_group(t);
+    }
+  }
+  pthread_mutex_unlock(&b->mutex);
+}
+
+int dist_launch(dist_trainer* trainer, neural_network* network, uint32_t world) {
+  memset(trainer, 0, sizeof(*trainer));
+  if(world == 0) return -1;
+
+  trainer->world = world;
+  trainer->network = network;
+  trainer->size = network->parameters.used;
+  trainer->chunk = (trainer->size + world - 1) / world;
+
+  trainer->shared_size = SLOT_OFFSET + 2 * (size_t)world * trainer->chunk * sizeof(nn_real);
+  trainer->shared = mmap(NULL, trainer->shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(trainer->shared == MAP_FAILED) {
+    trainer->shared = NULL;
+    return -1;
+  }
+  trainer->barrier = (dist_barrier*)trainer->shared;
+  trainer->slots = (nn_real*)((char*)trainer->shared + SLOT_OFFSET);
+  if(barrier_init(trainer->barrier, world) != 0) return -1;
+
+  trainer->children = calloc(world, sizeof(pid_t));
+  if(!trainer->children) return -1;
+  trainer->parent = getpid();
+
+  fflush(NULL);
+  for(uint32_t r = 1; r < world; r++) {
+    pid_t pid = fork();
+    if(pid < 0) {
+      printf("Failed to start rank %u\n", r);
+      exit(EXIT_FAILURE);
+    }
+    if(pid == 0) {
+#ifdef __linux__
+      /* A rank whose parent is gone would wait at the next barrier forever. */
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+      free(trainer->children);
+      trainer->children = NULL;
+      trainer->rank = r;
+      return (int)r;
+    }
+    trainer->children[r] = pid;
+  }
+  return 0;
+}
+
+/* Slot 'owner' of the buffer used by the current step. */
+static nn_real* slot(dist_trainer* t, uint32_t owner) {
+  return t->slots + ((t->step & 1) * t->world + owner) * t->chunk;
+}
+
+/* Element range of chunk c (taken mod world) of an n-element vector. */
+static void chunk_range(const dist_trainer* t, int64_t c, uint64_t n, uint64_t* lo, uint64_t* hi) {
+  uint64_t index = (uint64_t)((c % t->world + t->world) % t->world);
+  *lo = index * t->chunk < n ? index * t->chunk : n;
+  *hi = *lo + t->chunk < n ? *lo + t->chunk : n;
+}
+
+void dist_allreduce(dist_trainer* trainer, nn_real* buffer, uint64_t n) {
+  uint32_t world = trainer->world;
+  if(world == 1) return;
+  if(n > trainer->chunk * world) {
+    printf("All-reduce of %llu elements exceeds the segment\n", (unsigned long long)n);
+    exit(EXIT_FAILURE);
+  }
+
+  int64_t rank = trainer->rank;
+  uint32_t previous = (trainer->rank + world - 1) % world;
+  uint64_t lo, hi;
+
+  /* Reduce-scatter: after step s, this rank has summed s + 2 ranks' copies of chunk rank - 1 - s. */
+  for(uint32_t s = 0; s + 1 < world; s++, trainer->step++) {
+    chunk_range(trainer, rank - s, n, &lo, &hi);
+    memcpy(slot(trainer, trainer->rank), buffer + lo, (hi - lo) * sizeof(nn_real));
+    barrier_wait(trainer);
+
+    chunk_range(trainer, rank - 1 - s, n, &lo, &hi);
+    const nn_real* in = slot(trainer, previous);
+    for(uint64_t k = lo; k < hi; k++) buffer[k] += in[k - lo];
+  }
+
+  /* All-gather: this rank now owns the full sum of chunk rank + 1; pass the finished chunks around the ring. */
+  for(uint32_t s = 0; s + 1 < world; s++, trainer->step++) {
+    chunk_range(trainer, rank + 1 - s, n, &lo, &hi);
+    memcpy(slot(trainer, trainer->rank), buffer + lo, (hi - lo) * sizeof(nn_real));
+    barrier_wait(trainer);
+
+    chunk_range(trainer, rank - s, n, &lo, &hi);
+    memcpy(buffer + lo, slot(trainer, previous), (hi - lo) * sizeof(nn_real));
+  }
+}
+
+double dist_step(dist_trainer* trainer, matrix* inputs, matrix* y_true) {
+  neural_network* network = trainer->network;
+
+  matrix out = forward_pass(network, inputs);
+  double loss = cross_entropy(&out, y_true);
+  compute_gradients(network, inputs, y_true, 0);
+
+  /* The gradient block is already one flat vector; the loss and sample count follow in a second, tiny all-reduce. */
+  nn_real totals[2] = {(nn_real)(loss * (double)inputs->column_size), (nn_real)inputs->column_size};
+  dist_allreduce(trainer, network->gradients.base, network->gradients.used);
+  dist_allreduce(trainer, totals, 2);
+
+  double samples = (double)totals[1];
+  apply_update(network, (uint64_t)samples);
+  return (double)totals[0] / samples;
+}
+
+int dist_finish(dist_trainer* trainer) {
+  int failed = 0;
+  if(trainer->rank == 0 && trainer->children) {
+    for(uint32_t r = 1; r < trainer->world; r++) {
+      int status;
+      if(trainer->children[r] <= 0 || waitpid(trainer->children[r], &status, 0) < 0 || !WIFEXITED(status) ||
+         WEXITSTATUS(status) != 0) {
+        failed = 1;
+      }
+    }
+  }
+  if(trainer->shared) munmap(trainer->shared, trainer->shared_size);
+  free(trainer->children);
+  trainer->shared = NULL;
+  trainer->children = NULL;
+  return failed;
+}
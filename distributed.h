@@ -0,0 +1,85 @@
+#ifndef DISTRIBUTED_H_
+#define DISTRIBUTED_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+
+/*
+  Counting barrier usable across processes (its memory lives in the shared segment). A rank that
+  dies can never arrive, so waiters wake up periodically to check their peers; once any rank sees
+  one gone it sets 'aborted', and every rank then exits with an error instead of waiting forever.
+*/
+typedef struct {
+  pthread_mutex_t mutex;   /* robust: a holder's death is reported to the next locker */
+  pthread_cond_t cond;
+  uint32_t count;
+  uint32_t waiting;
+  uint64_t phase;
+  int aborted;
+} dist_barrier;
+
+/*
+  Multi-process synchronous data parallelism on one machine. dist_launch() forks the training
+  process into 'world' ranks that share one anonymous shared-memory segment. Every step, each
+  rank computes the gradients of its own batch, and its gradient block (then the loss and
+  sample count) is summed across ranks in place with a ring all-reduce through the segment.
+  Every rank then applies the same update to its own copy of the weights, so the copies stay
+  identical without ever being sent.
+
+  The ring all-reduce splits the vector into one chunk per rank. In each of the world - 1
+  reduce-scatter steps, every rank passes one chunk to the next rank, which adds it to its own.
+  In the world - 1 all-gather steps, the fully reduced chunks travel around the ring the same
+  way. Each rank moves 2 * (world - 1) / world of the vector per all-reduce, whatever the world
+  size. The slots are double-buffered, so a step costs one barrier.
+
+  Fork before starting any threads (trainer, pipeline, evaluator): the children get the parent's
+  memory, i.e. identical initial weights and the mapped datasets, but none of its threads.
+*/
+typedef struct {
+  uint32_t rank;
+  uint32_t world;
+  neural_network* network;
+
+  uint64_t size;         /* largest all-reduce: the gradient block */
+  uint64_t chunk;        /* elements per ring chunk */
+
+  void* shared;          /* the segment: barrier, then slots[2][world][chunk] */
+  size_t shared_size;
+  dist_barrier* barrier;
+  nn_real* slots;
+  uint64_t step;         /* all-gather/reduce-scatter steps so far, picks the slot parity */
+
+  pid_t* children;       /* rank 0 only */
+  pid_t parent;          /* rank 0's pid, for the other ranks to notice it is gone */
+} dist_trainer;
+
+/*
+  Create the shared segment and fork world - 1 child processes for training 'network'. Returns
+  this process's rank (0 in the original process), or -1 on failure.
+*/
+int dist_launch(dist_trainer* trainer, neural_network* network, uint32_t world);
+
+/*
+  Sum 'n' elements of 'buffer' across all ranks, in place. Every rank must call it with the same n.
+  Exits the process with an error if another rank has died.
+*/
+void dist_allreduce(dist_trainer* trainer, nn_real* buffer, uint64_t n);
+
+/*
+  One synchronous step on this rank's batch: forward, gradients, all-reduce, and the update
+  (network->optimizer or SGD) averaged over the samples of all ranks. Returns the mean loss over
+  all ranks' samples.
+*/
+double dist_step(dist_trainer* trainer, matrix* inputs, matrix* y_true);
+
+/*
+  Leave the group. Rank 0 waits for the other ranks to exit. Returns 0 when every rank exited
+  cleanly, nonzero otherwise.
+*/
+int dist_finish(dist_trainer* trainer);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "evaluator.h"
+#include "batch.h"
+#include "profile.h"
+
+/* Same floor on the label's probability as cross_entropy(). */
+#define LOSS_EPS 1e-12
+
+/* Run one batch through the network and add its metrics to the worker's totals. */
+static void eval_batch(eval_worker* w, uint32_t b) {
+  evaluator* ev = w->evaluator;
+  const eval_dataset* data = ev->data;
+  uint32_t start = b * ev->batch_size;
+  uint32_t bs = (data->count - start < ev->batch_size) ? data->count - start : ev->batch_size;
+
+  matrix x = batch_view(&w->x, bs);
+  const uint8_t* labels;
+  if(data->cache) {
+    build_batch_inputs(&x, data->cache, NULL, start, bs, NULL);
+    labels = data->cache->labels + start;
+  } else {
+    build_batch_inputs_u8(&x, data->pixels + (uint64_t)start * ev->features, NULL, bs, NULL);
+    labels = data->labels + start;
+  }
+
+  matrix out = infer(ev->network, &w->ctx, &x);
+
+  for(uint32_t c = 0; c < bs; c++) {
+    uint32_t label = labels[c];
+    if(label >= ev->classes) {
+      printf("Invalid label %u\n", label);
+      exit(EXIT_FAILURE);
+    }
+
+    double target = out.array[(uint64_t)label * bs + c];
+    uint32_t predicted = 0, above = 0;
+    double best = out.array[c];
+    for(uint32_t k = 0; k < ev->classes; k++) {
+      double v = out.array[(uint64_t)k * bs + c];
+      if(v > best) {
+        best = v;
+        predicted = k;
+      }
+      if(v > target) above++;
+    }
+
+    w->correct += predicted == label;
+    w->top_k_correct += above < ev->top_k;
+    w->loss -= log(target < LOSS_EPS ? LOSS_EPS : target);
+    w->confusion[label * ev->classes + predicted]++;
+  }
+}
+
+/* Claim batches of the current job until none are left. */
+static void eval_work(eval_worker* w) {
+  evaluator* ev = w->evaluator;
+  w->correct = 0;
+  w->top_k_correct = 0;
+  w->loss = 0.0;
+  for(uint64_t i = 0; i < (uint64_t)ev->classes * ev->classes; i++) w->confusion[i] = 0;
+
+  for(;;) {
+    uint32_t b = __atomic_fetch_add(&ev->next_batch, 1, __ATOMIC_RELAXED);
+    if(b >= ev->batches) break;
+    eval_batch(w, b);
+  }
+}
+
+static void* eval_worker_main(void* arg) {
+  eval_worker* w = (eval_worker*)arg;
+  evaluator* ev = w->evaluator;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&ev->mutex);
+  for(;;) {
+    while(ev->generation == seen && !ev->stop) pthread_cond_wait(&ev->start, &ev->mutex);
+    if(ev->stop) break;
+    seen = ev->generation;
+    pthread_mutex_unlock(&ev->mutex);
+
+    eval_work(w);
+
+    pthread_mutex_lock(&ev->mutex);
+    if(--ev->running == 0) pthread_cond_signal(&ev->done);
+  }
+  pthread_mutex_unlock(&ev->mutex);
+  return NULL;
+}
+
+/* Stop and join workers 1 .. started - 1, which are waiting for a job. */
+static void stop_workers(evaluator* ev, uint32_t started) {
+  pthread_mutex_lock(&ev->mutex);
+  ev->stop = 1;
+  pthread_cond_broadcast(&ev->start);
+  pthread_mutex_unlock(&ev->mutex);
+  for(uint32_t i = 1; i < started; i++) pthread_join(ev->workers[i].thread, NULL);
+}
+
+/* Release everything evaluator_init() allocated; buffers it never reached are still zeroed. */
+static void release_evaluator(evaluator* ev) {
+  pthread_mutex_destroy(&ev->mutex);
+  pthread_cond_destroy(&ev->start);
+  pthread_cond_destroy(&ev->done);
+
+  for(uint32_t i = 0; ev->workers && i < ev->threads; i++) {
+    free_matrix(&ev->workers[i].x);
+    free(ev->workers[i].confusion);
+    inference_context_free(&ev->workers[i].ctx);
+  }
+  free(ev->workers);
+  free(ev->confusion);
+  ev->workers = NULL;
+  ev->confusion = NULL;
+}
+
+int evaluator_init(evaluator* ev, const neural_network* network, uint32_t threads, uint32_t batch_size, uint32_t top_k) {
+  memset(ev, 0, sizeof(*ev));
+  if(threads == 0 || batch_size == 0 || network->number_of_layers == 0) return 1;
+
+  ev->threads = threads;
+  ev->batch_size = batch_size;
+  ev->features = (uint32_t)network->layers[0].weights.column_size;
+  ev->classes = (uint32_t)network->layers[network->number_of_layers - 1].neurons;
+  ev->top_k = top_k == 0 ? 1 : (top_k > ev->classes ? ev->classes : top_k);
+  pthread_mutex_init(&ev->mutex, NULL);
+  pthread_cond_init(&ev->start, NULL);
+  pthread_cond_init(&ev->done, NULL);
+
+  ev->workers = calloc(threads, sizeof(eval_worker));
+  ev->confusion = calloc((size_t)ev->classes * ev->classes, sizeof(uint64_t));
+  if(!ev->workers || !ev->confusion) {
+    release_evaluator(ev);
+    return 1;
+  }
+
+  for(uint32_t i = 0; i < threads; i++) {
+    eval_worker* w = &ev->workers[i];
+    w->evaluator = ev;
+    w->id = i;
+    w->x = create_matrix(ev->features, batch_size);
+    w->confusion = calloc((size_t)ev->classes * ev->classes, sizeof(uint64_t));
+    if(!w->x.array || !w->confusion || inference_context_init(&w->ctx, network, batch_size) != 0) {
+      release_evaluator(ev);
+      return 1;
+    }
+  }
+
+  for(uint32_t i = 1; i < threads; i++) {
+    if(pthread_create(&ev->workers[i].thread, NULL, eval_worker_main, &ev->workers[i]) != 0) {
+      printf("Failed to start eval worker %u\n", i);
+      stop_workers(ev, i);
+      release_evaluator(ev);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void evaluator_run(evaluator* ev, const neural_network* network, const eval_dataset* data, eval_result* out) {
+  pthread_mutex_lock(&ev->mutex);
+  ev->network = network;
+  ev->data = data;
+  ev->batches = (data->count + ev->batch_size - 1) / ev->batch_size;
+  ev->next_batch = 0;
+  ev->running = ev->threads - 1;
+  ev->generation++;
+  pthread_cond_broadcast(&ev->start);
+  pthread_mutex_unlock(&ev->mutex);
+
+  double start = profile_now();
+  eval_work(&ev->workers[0]);
+
+  pthread_mutex_lock(&ev->mutex);
+  while(ev->running) pthread_cond_wait(&ev->done, &ev->mutex);
+  pthread_mutex_unlock(&ev->mutex);
+
+  uint64_t cells = (uint64_t)ev->classes * ev->classes;
+  out->samples = data->count;
+  out->correct = 0;
+  out->top_k_correct = 0;
+  out->loss = 0.0;
+  for(uint64_t i = 0; i < cells; i++) ev->confusion[i] = 0;
+  for(uint32_t t = 0; t < ev->threads; t++) {
+    const eval_worker* w = &ev->workers[t];
+    out->correct += w->correct;
+    out->top_k_correct += w->top_k_correct;
+    out->loss += w->loss;
+    for(uint64_t i = 0; i < cells; i++) ev->confusion[i] += w->confusion[i];
+  }
+  if(data->count) out->loss /= (double)data->count;
+  out->classes = ev->classes;
+  out->top_k = ev->top_k;
+  out->confusion = ev->confusion;
+  out->seconds = profile_now() - start;
+}
+
+void eval_print_confusion(const eval_result* result) {
+  printf("confusion (rows: true class, columns: predicted)\n     ");
+  for(uint32_t p = 0; p < result->classes; p++) printf(" %6u", p);
+  printf("\n");
+  for(uint32_t t = 0; t < result->classes; t++) {
+    printf("%4u:", t);
+    for(uint32_t p = 0; p < result->classes; p++) {
+      printf(" %6llu", (unsigned long long)result->confusion[(uint64_t)t * result->classes + p]);
+    }
+    printf("\n");
+  }
+}
+
+void evaluator_free(evaluator* ev) {
+  if(!ev->workers) return;
+
+  stop_workers(ev, ev->threads);
+  release_evaluator(ev);
+}
+
+/* Both networks have the same layers, so their parameter blocks match and a copy is one memcpy. */
+static void snapshot_copy(neural_network* snapshot, const neural_network* src) {
+  memcpy(snapshot->parameters.base, src->parameters.base, src->parameters.used * sizeof(nn_real));
+}
+
+/* The queued snapshot submitted first, or -1. */
+static int next_queued(const async_evaluator* ae) {
+  int pick = -1;
+  for(int i = 0; i < 2; i++) {
+    if(ae->state[i] == SNAPSHOT_QUEUED && (pick < 0 || ae->tag[i] < ae->tag[pick])) pick = i;
+  }
+  return pick;
+}
+
+static void* async_eval_main(void* arg) {
+  async_evaluator* ae = (async_evaluator*)arg;
+
+  pthread_mutex_lock(&ae->mutex);
+  for(;;) {
+    int slot;
+    while((slot = next_queued(ae)) < 0 && !ae->stop) pthread_cond_wait(&ae->changed, &ae->mutex);
+    if(slot < 0) break;
+    ae->state[slot] = SNAPSHOT_RUNNING;
+    pthread_mutex_unlock(&ae->mutex);
+
+    eval_result result;
+    evaluator_run(ae->evaluator, &ae->snapshots[slot], ae->data, &result);
+    ae->done(ae->context, ae->tag[slot], &result);
+
+    pthread_mutex_lock(&ae->mutex);
+    ae->state[slot] = SNAPSHOT_FREE;
+    pthread_cond_broadcast(&ae->changed);
+  }
+  pthread_mutex_unlock(&ae->mutex);
+  return NULL;
+}
+
+int async_evaluator_init(async_evaluator* ae, evaluator* ev, const neural_network* network, const eval_dataset* data,
+                         eval_callback done, void* context) {
+  ae->evaluator = ev;
+  ae->data = data;
+  ae->done = done;
+  ae->context = context;
+  ae->stop = 0;
+  for(int i = 0; i < 2; i++) {
+    ae->state[i] = SNAPSHOT_FREE;
+    ae->tag[i] = 0;
+    if(network_clone(&ae->snapshots[i], network) != 0) return 1;
+  }
+
+  pthread_mutex_init(&ae->mutex, NULL);
+  pthread_cond_init(&ae->changed, NULL);
+  if(pthread_create(&ae->thread, NULL, async_eval_main, ae) != 0) {
+    printf("Failed to start async evaluator\n");
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
+
+void async_evaluator_submit(async_evaluator* ae, const neural_network* network, uint64_t tag) {
+  pthread_mutex_lock(&ae->mutex);
+  int slot;
+  while((slot = (ae->state[0] == SNAPSHOT_FREE) ? 0 : (ae->state[1] == SNAPSHOT_FREE) ? 1 : -1) < 0) {
+    pthread_cond_wait(&ae->changed, &ae->mutex);
+  }
+  ae->state[slot] = SNAPSHOT_FILLING;
+  pthread_mutex_unlock(&ae->mutex);
+
+  /* The slot is ours until it is queued, so the copy runs unlocked. */
+  snapshot_copy(&ae->snapshots[slot], network);
+
+  pthread_mutex_lock(&ae->mutex);
+  ae->tag[slot] = tag;
+  ae->state[slot] = SNAPSHOT_QUEUED;
+  pthread_cond_broadcast(&ae->changed);
+  pthread_mutex_unlock(&ae->mutex);
+}
+
+void async_evaluator_wait(async_evaluator* ae) {
+  pthread_mutex_lock(&ae->mutex);
+  while(ae->state[0] != SNAPSHOT_FREE || ae->state[1] != SNAPSHOT_FREE) pthread_cond_wait(&ae->changed, &ae->mutex);
+  pthread_mutex_unlock(&ae->mutex);
+}
+
+void async_evaluator_free(async_evaluator* ae) {
+  async_evaluator_wait(ae);
+  pthread_mutex_lock(&ae->mutex);
+  ae->stop = 1;
+  pthread_cond_broadcast(&ae->changed);
+  pthread_mutex_unlock(&ae->mutex);
+  pthread_join(ae->thread, NULL);
+
+  pthread_mutex_destroy(&ae->mutex);
+  pthread_cond_destroy(&ae->changed);
+  for(int i = 0; i < 2; i++) free_network_memory(&ae->snapshots[i]);
+}
@@ -0,0 +1,138 @@
+#ifndef EVALUATOR_H_
+#define EVALUATOR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+#include "inference.h"
+#include "dataset_cache.h"
+
+/*
+  Labelled samples to evaluate on. The samples come either from a pre-normalized dataset cache
+  or, when cache is NULL, from raw bytes stored back to back (e.g. a mapped IDX file) that are
+  scaled to [0, 1] as they are read. Both are only read, so any number of threads can share one.
+*/
+typedef struct {
+  const dataset_cache* cache;
+  const uint8_t* pixels;   /* count * features bytes, used when cache is NULL */
+  const uint8_t* labels;   /* used when cache is NULL */
+  uint32_t count;
+} eval_dataset;
+
+typedef struct {
+  uint64_t samples;
+  uint64_t correct;          /* top-1 */
+  uint64_t top_k_correct;    /* label among the top_k highest outputs */
+  double loss;               /* mean cross-entropy */
+  double seconds;            /* wall time of the evaluation */
+  uint32_t classes;
+  uint32_t top_k;
+  /* confusion[true_class * classes + predicted_class]; owned by the evaluator, valid until its next run. */
+  const uint64_t* confusion;
+} eval_result;
+
+typedef struct eval_worker {
+  struct evaluator* evaluator;
+  uint32_t id;
+  pthread_t thread;
+  inference_context ctx;
+  matrix x;                  /* (features x batch_size) input batch */
+  uint64_t correct;
+  uint64_t top_k_correct;
+  double loss;
+  uint64_t* confusion;       /* classes * classes */
+} eval_worker;
+
+/*
+  Multithreaded evaluation through the read-only inference path (infer()), so it never touches
+  the training activations and can run against weights that are not being trained. The test
+  set is split into batches that the workers claim one at a time; each worker keeps its own
+  inference context, input batch and metric totals, and the totals are merged at the end. After
+  evaluator_init() nothing is allocated. The labels are compared against the outputs directly,
+  with no one-hot matrix. The calling thread acts as worker 0.
+*/
+typedef struct evaluator {
+  uint32_t threads;
+  uint32_t batch_size;
+  uint32_t features;
+  uint32_t classes;
+  uint32_t top_k;
+  eval_worker* workers;
+  uint64_t* confusion;       /* merged result */
+
+  /* Current job, published under the mutex; 'generation' counts jobs. */
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  uint32_t running;          /* helper workers still on the current job */
+  const neural_network* network;
+  const eval_dataset* data;
+  uint32_t batches;
+  uint32_t next_batch;       /* claimed with an atomic add */
+  int stop;
+} evaluator;
+
+/*
+  Start threads - 1 helper threads and size every buffer for 'network's shape. Every network later
+  passed to evaluator_run() must have the same layer sizes. Returns 0 on success, nonzero on
+  failure, in which case any started threads have been joined and nothing is left to free.
+*/
+int evaluator_init(evaluator* ev, const neural_network* network, uint32_t threads, uint32_t batch_size, uint32_t top_k);
+
+/* Evaluate 'network' on every sample of 'data'. */
+void evaluator_run(evaluator* ev, const neural_network* network, const eval_dataset* data, eval_result* out);
+
+/* Print the confusion matrix, true classes down, predictions across. */
+void eval_print_confusion(const eval_result* result);
+
+void evaluator_free(evaluator* ev);
+
+/* Called on the async evaluator's thread with the result for the snapshot submitted as 'tag'. */
+typedef void (*eval_callback)(void* context, uint64_t tag, const eval_result* result);
+
+enum snapshot_state { SNAPSHOT_FREE, SNAPSHOT_FILLING, SNAPSHOT_QUEUED, SNAPSHOT_RUNNING };
+
+/*
+  Evaluation off the training thread. async_evaluator_submit() copies the network's parameters
+  into one of two snapshot networks and returns; a background thread runs the evaluator on the
+  snapshot while training carries on with the live weights, and reports through the callback
+  when done. With two snapshots one can be evaluated while the next is taken, so a submit only
+  waits when evaluation falls more than a full submit interval behind.
+  Snapshots are evaluated in submission order.
+*/
+typedef struct {
+  evaluator* evaluator;      /* not owned; used only from the background thread once started */
+  const eval_dataset* data;
+  eval_callback done;
+  void* context;
+
+  neural_network snapshots[2];
+  enum snapshot_state state[2];
+  uint64_t tag[2];
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  int stop;
+} async_evaluator;
+
+/*
+  Allocate snapshots shaped like 'network' and start the background thread. Returns 0 on
+  success, nonzero on failure.
+*/
+int async_evaluator_init(async_evaluator* ae, evaluator* ev, const neural_network* network, const eval_dataset* data,
+                         eval_callback done, void* context);
+
+/* Snapshot 'network's parameters for evaluation. Call between training steps, not during one. */
+void async_evaluator_submit(async_evaluator* ae, const neural_network* network, uint64_t tag);
+
+/* Block until every submitted snapshot has been evaluated and reported. */
+void async_evaluator_wait(async_evaluator* ae);
+
+/* Finish the outstanding evaluations, then stop the thread and free the snapshots. */
+void async_evaluator_free(async_evaluator* ae);
+
+#endif
@@ -0,0 +1,462 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gemm.h"
+#include "simd.h"
+
+/*
+  GEMM follows the usual packed layout: op(B) is packed KC x NC at a time into NR-column slivers
+  (reused from L3/L2 for every row block), op(A) MC x KC at a time into MR-row slivers (reused
+  from L2 for every sliver of B), and the micro-kernel keeps an MR x NR block of C in registers
+  while streaming both slivers from L1. Packing zero-pads the ragged edges, so the micro-kernel
+  always runs the full tile and only the write-back is clipped.
+
+  The kernels (gemm_kernels.inc) are compiled for the baseline ISA and, on x86-64, again for
+  AVX2+FMA and AVX-512; the set is chosen to match simd_isa(), so NN_SIMD overrides both modules
+  at once. Each set has its own register tile (MR x NR), and packing follows the active set's.
+*/
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define GEMM_X86 1
+#endif
+
+/*
+  Register tiles (MR rows x NR columns of C): the baseline and AVX2 sets keep 6 rows of 64 bytes,
+  AVX-512 12 rows of 128 bytes, two zmm vectors each, so its 24 accumulators fit in 32 registers.
+*/
+#ifdef NN_FLOAT32
+  #define NARROW_MR 6
+  #define NARROW_NR 16
+  #define WIDE_MR 12
+  #define WIDE_NR 32
+#else
+  #define NARROW_MR 6
+  #define NARROW_NR 8
+  #define WIDE_MR 12
+  #define WIDE_NR 16
+#endif
+#define MC 72     /* multiple of every MR; MC x KC of A stays in L2 */
+#define KC 256
+#define NC 4096   /* multiple of every NR */
+#define PACK_ALIGN 64
+
+/* Products with at most this many columns run as one gemv per column. */
+#define GEMV_COLUMNS 4
+
+/* Products below this many multiply-adds per thread are not worth a thread start. */
+#define MIN_THREAD_WORK (1u << 21)
+
+static uint64_t min_u64(uint64_t a, uint64_t b) { return a < b ? a : b; }
+static uint64_t round_up(uint64_t n, uint64_t multiple) { return (n + multiple - 1) / multiple * multiple; }
+
+/* Copy the mc x kc block of op(A) starting at 'a' into tile_m-row slivers: sliver[p * tile_m + i]. */
+static void pack_a(const nn_real* a, uint64_t lda, int transposed, uint64_t mc, uint64_t kc, uint64_t tile_m, nn_real* out) {
+  for(uint64_t ir = 0; ir < mc; ir += tile_m) {
+    uint64_t mr = min_u64(tile_m, mc - ir);
+    for(uint64_t p = 0; p < kc; p++) {
+      for(uint64_t i = 0; i < tile_m; i++) {
+        if(i >= mr) out[p * tile_m + i] = 0;
+        else out[p * tile_m + i] = transposed ? a[p * lda + ir + i] : a[(ir + i) * lda + p];
+      }
+    }
+    out += tile_m * kc;
+  }
+}
+
+/* Copy the kc x nc block of op(B) starting at 'b' into tile_n-column slivers: sliver[p * tile_n + j]. */
+static void pack_b(const nn_real* b, uint64_t ldb, int transposed, uint64_t kc, uint64_t nc, uint64_t tile_n, nn_real* out) {
+  for(uint64_t jr = 0; jr < nc; jr += tile_n) {
+    uint64_t nr = min_u64(tile_n, nc - jr);
+    for(uint64_t p = 0; p < kc; p++) {
+      for(uint64_t j = 0; j < tile_n; j++) {
+        if(j >= nr) out[p * tile_n + j] = 0;
+        else out[p * tile_n + j] = transposed ? b[(jr + j) * ldb + p] : b[p * ldb + jr + j];
+      }
+    }
+    out += tile_n * kc;
+  }
+}
+
+typedef struct {
+  const char* name;
+  uint64_t mr, nr;   /* register tile */
+  void (*macro_kernel)(uint64_t mc, uint64_t nc, uint64_t kc, nn_real alpha, const nn_real* packed_a, const nn_real* packed_b,
+                       nn_real* C, uint64_t ldc);
+  void (*gemv_rows)(uint64_t M, uint64_t N, nn_real alpha, const nn_real* A, uint64_t lda, const nn_real* x, nn_real beta, nn_real* y);
+  void (*gemv_columns)(uint64_t M, uint64_t N, nn_real alpha, const nn_real* A, uint64_t lda, const nn_real* x, nn_real beta, nn_real* y);
+  void (*axpy)(uint64_t n, nn_real alpha, const nn_real* x, nn_real* y);
+  void (*scal)(uint64_t n, nn_real alpha, nn_real* x);
+} gemm_kernels;
+
+/* Baseline: SSE2 on x86-64, NEON on AArch64, 16-byte vectors either way. */
+#define KERNEL(name) name##_generic
+#define GEMM_NAME "generic"
+#define GEMM_TARGET
+#define VEC_BYTES 16
+#define MR NARROW_MR
+#define NR NARROW_NR
+#include "gemm_kernels.inc"
+#undef KERNEL
+#undef GEMM_NAME
+#undef GEMM_TARGET
+#undef VEC_BYTES
+
+#ifdef GEMM_X86
+/* AVX2 + FMA: the same tile in two 32-byte vectors per row. */
+#define KERNEL(name) name##_avx2
+#define GEMM_NAME "avx2"
+#define GEMM_TARGET __attribute__((target("avx2,fma")))
+#define VEC_BYTES 32
+#include "gemm_kernels.inc"
+#undef KERNEL
+#undef GEMM_NAME
+#undef GEMM_TARGET
+#undef VEC_BYTES
+#undef MR
+#undef NR
+
+/* AVX-512: four times the AVX2 tile, which only fits in the 32 zmm registers. */
+#define KERNEL(name) name##_avx512
+#define GEMM_NAME "avx512"
+#define GEMM_TARGET __attribute__((target("avx512f")))
+#define VEC_BYTES 64
+#define MR WIDE_MR
+#define NR WIDE_NR
+#include "gemm_kernels.inc"
+#endif
+
+static const gemm_kernels* active = &kernels_generic;
+
+typedef struct {
+  int trans_a;
+  int trans_b;
+  uint64_t M, N, K;
+  nn_real alpha;
+  const nn_real* A;
+  uint64_t lda;
+  const nn_real* B;
+  uint64_t ldb;
+  nn_real* C;
+  uint64_t ldc;
+  nn_real* packed_a;   /* MC x KC */
+  nn_real* packed_b;   /* KC x min(NC, N rounded up to NR) */
+  int ready;           /* set when a pool worker should run this task */
+} gemm_task;
+
+/* C += alpha * op(A) * op(B) on one thread; beta has already been applied. */
+static void gemm_serial(const gemm_task* t) {
+  uint64_t mr = active->mr, nr = active->nr;
+  for(uint64_t jc = 0; jc < t->N; jc += NC) {
+    uint64_t nc = min_u64(NC, t->N - jc);
+    for(uint64_t pc = 0; pc < t->K; pc += KC) {
+      uint64_t kc = min_u64(KC, t->K - pc);
+      const nn_real* b = t->trans_b ? t->B + jc * t->ldb + pc : t->B + pc * t->ldb + jc;
+      pack_b(b, t->ldb, t->trans_b, kc, nc, nr, t->packed_b);
+
+      for(uint64_t ic = 0; ic < t->M; ic += MC) {
+        uint64_t mc = min_u64(MC, t->M - ic);
+        const nn_real* a = t->trans_a ? t->A + pc * t->lda + ic : t->A + ic * t->lda + pc;
+        pack_a(a, t->lda, t->trans_a, mc, kc, mr, t->packed_a);
+        active->macro_kernel(mc, nc, kc, t->alpha, t->packed_a, t->packed_b, t->C + ic * t->ldc + jc, t->ldc);
+      }
+    }
+  }
+}
+
+/*
+  Helper threads for the threaded path, started on first use and then parked on a condition
+  variable, so a threaded product costs a wakeup per helper instead of a pthread_create/join.
+  One nn_gemm() call owns the pool at a time: worker i runs tasks[i] and the caller runs
+  tasks[0]. A call that finds the pool taken (e.g. trainer workers multiplying concurrently)
+  runs on its own thread.
+*/
+typedef struct {
+  pthread_mutex_t owner;   /* held by the nn_gemm() call using the pool */
+  pthread_mutex_t mutex;   /* guards the fields below */
+  pthread_cond_t start;
+  pthread_cond_t done;
+  gemm_task* tasks;
+  uint32_t capacity;       /* tasks allocated, including the caller's */
+  uint32_t workers;        /* helper threads started */
+  uint32_t pending;        /* helpers still running the current product */
+} gemm_pool;
+
+static gemm_pool pool = {
+  .owner = PTHREAD_MUTEX_INITIALIZER, .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void* pool_worker(void* arg) {
+  uint32_t id = (uint32_t)(uintptr_t)arg;
+  pthread_mutex_lock(&pool.mutex);
+  for(;;) {
+    while(!pool.tasks[id].ready) pthread_cond_wait(&pool.start, &pool.mutex);
+    gemm_task* task = &pool.tasks[id];
+    pthread_mutex_unlock(&pool.mutex);
+    gemm_serial(task);
+    pthread_mutex_lock(&pool.mutex);
+    task->ready = 0;
+    if(--pool.pending == 0) pthread_cond_signal(&pool.done);
+  }
+  return NULL;
+}
+
+/*
+  Take the pool for a product split 'threads' ways, starting helpers as needed. Returns how many
+  ways the product can actually be split: 1 (pool not taken) if it is busy or nothing could be
+  started, otherwise at most 'threads', and the caller must pool_release().
+*/
+static uint64_t pool_acquire(uint64_t threads) {
+  if(threads <= 1 || pthread_mutex_trylock(&pool.owner) != 0) return 1;
+
+  pthread_mutex_lock(&pool.mutex);
+  if(pool.capacity < threads) {
+    gemm_task* grown = realloc(pool.tasks, threads * sizeof(gemm_task));
+    if(grown != NULL) {
+      memset(grown + pool.capacity, 0, (threads - pool.capacity) * sizeof(gemm_task));
+      pool.tasks = grown;
+      pool.capacity = (uint32_t)threads;
+    }
+  }
+  while(pool.workers + 1 < min_u64(threads, pool.capacity)) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, pool_worker, (void*)(uintptr_t)(pool.workers + 1)) != 0) break;
+    pthread_detach(thread);
+    pool.workers++;
+  }
+  pthread_mutex_unlock(&pool.mutex);
+
+  threads = min_u64(threads, pool.workers + 1);
+  if(threads <= 1) pthread_mutex_unlock(&pool.owner);
+  return threads;
+}
+
+/*
+  Run tasks[1 .. threads - 1] on the helpers and tasks[0] here, then give the pool back. Called
+  with pool.mutex held, taken before the tasks were filled in.
+*/
+static void pool_run(uint64_t threads) {
+  pool.pending = (uint32_t)(threads - 1);
+  for(uint64_t t = 1; t < threads; t++) pool.tasks[t].ready = 1;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.mutex);
+
+  gemm_serial(&pool.tasks[0]);
+
+  pthread_mutex_lock(&pool.mutex);
+  while(pool.pending > 0) pthread_cond_wait(&pool.done, &pool.mutex);
+  pthread_mutex_unlock(&pool.mutex);
+  pthread_mutex_unlock(&pool.owner);
+}
+
+/* A forked child (distributed.c) inherits the pool's state but none of its threads. */
+static void pool_after_fork(void) {
+  pthread_mutex_init(&pool.owner, NULL);
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.start, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  for(uint32_t t = 0; t < pool.capacity; t++) pool.tasks[t].ready = 0;
+  pool.workers = 0;
+  pool.pending = 0;
+}
+
+/*
+  Packing space belongs to the calling thread and is kept between calls, so steady-state
+  products do not allocate. The key's destructor frees it when the thread exits.
+*/
+typedef struct {
+  nn_real* base;
+  uint64_t capacity;
+} pack_space;
+
+static pthread_key_t pack_key;
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+/* Read by every nn_gemm() call and settable at any time, so accessed atomically (relaxed: it is only a hint). */
+static uint32_t gemm_threads = 1;
+
+static void free_pack_space(void* space) {
+  free(((pack_space*)space)->base);
+  free(space);
+}
+
+static void setup(void) {
+  pthread_key_create(&pack_key, free_pack_space);
+  pthread_atfork(NULL, NULL, pool_after_fork);
+#ifdef GEMM_X86
+  const char* isa = simd_isa();
+  if(strcmp(isa, "avx2") == 0) active = &kernels_avx2;
+  else if(strcmp(isa, "avx512") == 0) active = &kernels_avx512;
+#endif
+  const char* requested = getenv("NN_GEMM_THREADS");
+  if(requested != NULL && atoi(requested) > 0) __atomic_store_n(&gemm_threads, (uint32_t)atoi(requested), __ATOMIC_RELAXED);
+}
+
+void nn_gemm_set_threads(uint32_t threads) {
+  pthread_once(&setup_once, setup);
+  __atomic_store_n(&gemm_threads, threads > 0 ? threads : 1, __ATOMIC_RELAXED);
+}
+
+static nn_real* pack_buffer(uint64_t elements) {
+  pack_space* space = pthread_getspecific(pack_key);
+  if(space == NULL) {
+    space = calloc(1, sizeof(pack_space));
+    if(space == NULL) return NULL;
+    pthread_setspecific(pack_key, space);
+  }
+  if(space->capacity < elements) {
+    free(space->base);
+    space->capacity = round_up(elements, PACK_ALIGN / sizeof(nn_real));
+    space->base = aligned_alloc(PACK_ALIGN, space->capacity * sizeof(nn_real));
+    if(space->base == NULL) {
+      space->capacity = 0;
+      return NULL;
+    }
+  }
+  return space->base;
+}
+
+static void scale_c(uint64_t M, uint64_t N, nn_real beta, nn_real* C, uint64_t ldc) {
+  if(beta == 1) return;
+  for(uint64_t i = 0; i < M; i++) {
+    nn_real* row = C + i * ldc;
+    /* beta == 0 overwrites, so garbage (NaN) in C does not leak through */
+    if(beta == 0) for(uint64_t j = 0; j < N; j++) row[j] = 0;
+    else for(uint64_t j = 0; j < N; j++) row[j] *= beta;
+  }
+}
+
+void nn_gemm(enum CBLAS_ORDER order, enum CBLAS_TRANSPOSE trans_a, enum CBLAS_TRANSPOSE trans_b, int M, int N, int K,
+             double alpha, const nn_real* A, int lda, const nn_real* B, int ldb, double beta, nn_real* C, int ldc) {
+  /* Column-major C = op(A) op(B) is row-major C^T = op(B)^T op(A)^T. */
+  if(order == CblasColMajor) {
+    nn_gemm(CblasRowMajor, trans_b, trans_a, N, M, K, alpha, B, ldb, A, lda, beta, C, ldc);
+    return;
+  }
+  if(M <= 0 || N <= 0) return;
+
+  /*
+    A few columns (tiny batches) are a few gemvs: packing all of A would cost more than the
+    product. Each column of B and C is gathered into contiguous scratch for the gemv kernels.
+  */
+  if(N <= GEMV_COLUMNS && K > 0) {
+    pthread_once(&setup_once, setup);
+    nn_real* x = pack_buffer((uint64_t)K + (uint64_t)M);
+    assert(x != NULL);
+    nn_real* y = x + K;
+    for(int j = 0; j < N; j++) {
+      for(int k = 0; k < K; k++) x[k] = trans_b == CblasNoTrans ? B[(uint64_t)k * ldb + j] : B[(uint64_t)j * ldb + k];
+      for(int i = 0; i < M; i++) y[i] = C[(uint64_t)i * ldc + j];
+      if(trans_a == CblasNoTrans) active->gemv_rows((uint64_t)M, (uint64_t)K, (nn_real)alpha, A, (uint64_t)lda, x, (nn_real)beta, y);
+      else active->gemv_columns((uint64_t)K, (uint64_t)M, (nn_real)alpha, A, (uint64_t)lda, x, (nn_real)beta, y);
+      for(int i = 0; i < M; i++) C[(uint64_t)i * ldc + j] = y[i];
+    }
+    return;
+  }
+
+  scale_c((uint64_t)M, (uint64_t)N, (nn_real)beta, C, (uint64_t)ldc);
+  if(K <= 0 || alpha == 0) return;
+
+  pthread_once(&setup_once, setup);
+  gemm_task base = {
+    .trans_a = trans_a != CblasNoTrans, .trans_b = trans_b != CblasNoTrans,
+    .M = (uint64_t)M, .N = (uint64_t)N, .K = (uint64_t)K, .alpha = (nn_real)alpha,
+    .A = A, .lda = (uint64_t)lda, .B = B, .ldb = (uint64_t)ldb, .C = C, .ldc = (uint64_t)ldc,
+  };
+
+  /* Split the larger of M and N into whole tiles, one contiguous range per thread. */
+  uint64_t work = base.M * base.N * base.K;
+  uint64_t threads = min_u64(__atomic_load_n(&gemm_threads, __ATOMIC_RELAXED), work / MIN_THREAD_WORK);
+  int split_n = base.N >= base.M;
+  uint64_t tile = split_n ? active->nr : active->mr;
+  uint64_t tiles = round_up(split_n ? base.N : base.M, tile) / tile;
+  threads = pool_acquire(min_u64(threads, tiles));
+
+  uint64_t b_columns = round_up(min_u64(NC, base.N), active->nr);
+  uint64_t per_thread = round_up(MC * KC + KC * b_columns, PACK_ALIGN / sizeof(nn_real));
+  nn_real* space = pack_buffer(per_thread * threads);
+  assert(space != NULL);
+
+  gemm_task single;
+  gemm_task* tasks = threads > 1 ? pool.tasks : &single;
+  if(threads > 1) pthread_mutex_lock(&pool.mutex);
+  uint64_t tiles_per_thread = (tiles + threads - 1) / threads;
+  for(uint64_t t = 0; t < threads; t++) {
+    uint64_t start = min_u64(t * tiles_per_thread * tile, split_n ? base.N : base.M);
+    uint64_t end = min_u64((t + 1) * tiles_per_thread * tile, split_n ? base.N : base.M);
+    tasks[t] = base;
+    tasks[t].packed_a = space + t * per_thread;
+    tasks[t].packed_b = tasks[t].packed_a + MC * KC;
+    if(split_n) {
+      tasks[t].N = end - start;
+      tasks[t].B = base.trans_b ? base.B + start * base.ldb : base.B + start;
+      tasks[t].C = base.C + start;
+    } else {
+      tasks[t].M = end - start;
+      tasks[t].A = base.trans_a ? base.A + start : base.A + start * base.lda;
+      tasks[t].C = base.C + start * base.ldc;
+    }
+  }
+
+  if(threads > 1) pool_run(threads);
+  else gemm_serial(&tasks[0]);
+}
+
+void nn_gemv(enum CBLAS_ORDER order, enum CBLAS_TRANSPOSE trans, int M, int N, double alpha, const nn_real* A, int lda,
+             const nn_real* x, int incx, double beta, nn_real* y, int incy) {
+  int transposed = trans != CblasNoTrans;
+  /* Column-major A is row-major A^T. */
+  if(order == CblasColMajor) {
+    int rows = M;
+    M = N;
+    N = rows;
+    transposed = !transposed;
+  }
+  if(M <= 0 || N <= 0) return;
+  uint64_t x_length = (uint64_t)(transposed ? M : N);
+  uint64_t y_length = (uint64_t)(transposed ? N : M);
+
+  pthread_once(&setup_once, setup);
+  if(incx == 1 && incy == 1) {
+    if(transposed) active->gemv_columns((uint64_t)M, (uint64_t)N, (nn_real)alpha, A, (uint64_t)lda, x, (nn_real)beta, y);
+    else active->gemv_rows((uint64_t)M, (uint64_t)N, (nn_real)alpha, A, (uint64_t)lda, x, (nn_real)beta, y);
+    return;
+  }
+
+  /* Strided vectors (unused by this project) take the plain loops. */
+  int64_t x_start = incx < 0 ? -(int64_t)(x_length - 1) * incx : 0;
+  int64_t y_start = incy < 0 ? -(int64_t)(y_length - 1) * incy : 0;
+  for(uint64_t i = 0; i < y_length; i++) {
+    nn_real sum = 0;
+    for(uint64_t k = 0; k < x_length; k++) {
+      nn_real a = transposed ? A[k * (uint64_t)lda + i] : A[i * (uint64_t)lda + k];
+      sum += a * x[x_start + (int64_t)k * incx];
+    }
+    nn_real* out = &y[y_start + (int64_t)i * incy];
+    *out = (beta == 0 ? 0 : (nn_real)beta * *out) + (nn_real)alpha * sum;
+  }
+}
+
+void nn_axpy(int n, double alpha, const nn_real* x, int incx, nn_real* y, int incy) {
+  if(n <= 0) return;
+  pthread_once(&setup_once, setup);
+  if(incx == 1 && incy == 1) {
+    active->axpy((uint64_t)n, (nn_real)alpha, x, y);
+    return;
+  }
+  int64_t x_start = incx < 0 ? -(int64_t)(n - 1) * incx : 0;
+  int64_t y_start = incy < 0 ? -(int64_t)(n - 1) * incy : 0;
+  for(int64_t i = 0; i < n; i++) y[y_start + i * incy] += (nn_real)alpha * x[x_start + i * incx];
+}
+
+void nn_scal(int n, double alpha, nn_real* x, int incx) {
+  if(n <= 0 || incx <= 0) return;
+  pthread_once(&setup_once, setup);
+  if(incx == 1) {
+    active->scal((uint64_t)n, (nn_real)alpha, x);
+    return;
+  }
+  for(int64_t i = 0; i < n; i++) x[i * incx] *= (nn_real)alpha;
+}
@@ -0,0 +1,44 @@
+#ifndef GEMM_H_
+#define GEMM_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+
+/*
+  Built-in BLAS subset: cache-blocked, packed, register-tiled GEMM plus the level-1/2 routines
+  this project calls, with the CBLAS calling convention (row-major only). It is always compiled
+  so it can be benchmarked against an external BLAS; building with NN_BUILTIN_BLAS points
+  NN_CBLAS() at it, so no external BLAS is needed at all.
+*/
+
+#ifdef NN_BUILTIN_BLAS
+  /* Same values as cblas.h, which is not included in this mode. */
+  enum CBLAS_ORDER { CblasRowMajor = 101, CblasColMajor = 102 };
+  enum CBLAS_TRANSPOSE { CblasNoTrans = 111, CblasTrans = 112, CblasConjTrans = 113 };
+#endif
+
+/* C = alpha * op(A) * op(B) + beta * C, with op(A) M x K and op(B) K x N. */
+void nn_gemm(enum CBLAS_ORDER order, enum CBLAS_TRANSPOSE trans_a, enum CBLAS_TRANSPOSE trans_b, int M, int N, int K,
+             double alpha, const nn_real* A, int lda, const nn_real* B, int ldb, double beta, nn_real* C, int ldc);
+
+/* y = alpha * op(A) * x + beta * y, with A M x N. */
+void nn_gemv(enum CBLAS_ORDER order, enum CBLAS_TRANSPOSE trans, int M, int N, double alpha, const nn_real* A, int lda,
+             const nn_real* x, int incx, double beta, nn_real* y, int incy);
+
+/* y += alpha * x */
+void nn_axpy(int n, double alpha, const nn_real* x, int incx, nn_real* y, int incy);
+
+/* x *= alpha */
+void nn_scal(int n, double alpha, nn_real* x, int incx);
+
+/*
+  Threads nn_gemm() splits large products over (default: the NN_GEMM_THREADS environment
+  variable, else 1; the trainer already parallelizes across samples). Only products of at least
+  a couple of million multiply-adds per thread are split, so small layers and batches stay on the
+  calling thread. The helpers are started once and reused; while one call is using them, other
+  threads' calls run unsplit. Safe to call at any time, including while other threads multiply.
+*/
+void nn_gemm_set_threads(uint32_t threads);
+
+#endif
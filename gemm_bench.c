@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "matrix.h"
+#include "gemm.h"
+
+/*
+  Compares the built-in GEMM/GEMV (gemm.c) against the linked CBLAS at the exact products one
+  training step of the 784-128-64-10 network performs, for a few batch sizes:
+    forward      z = W a             (neurons x inputs) * (inputs x batch)
+    delta        W^T delta           (inputs x neurons) * (neurons x batch), hidden layers only
+    weight grad  dW = delta a^T      (neurons x batch) * (batch x inputs)
+  plus the batch-1 gemv of the inference fast path. Reports GFLOP/s for each and the largest
+  difference between the two results. Built with NN_BUILTIN_BLAS there is no CBLAS to compare
+  against, and only the built-in column is filled in.
+*/
+
+#define MIN_SECONDS 0.2
+
+typedef struct {
+  const char* name;
+  enum CBLAS_TRANSPOSE trans_a;
+  enum CBLAS_TRANSPOSE trans_b;
+  int M, N, K;
+} gemm_shape;
+
+typedef void (*gemm_function)(enum CBLAS_ORDER, enum CBLAS_TRANSPOSE, enum CBLAS_TRANSPOSE, int, int, int, double,
+                              const nn_real*, int, const nn_real*, int, double, nn_real*, int);
+
+static void die(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static nn_real* random_array(uint64_t n) {
+  nn_real* a = malloc(n * sizeof(nn_real));
+  if(!a) die("malloc failed");
+  for(uint64_t i = 0; i < n; i++) a[i] = (nn_real)rand() / RAND_MAX - (nn_real)0.5;
+  return a;
+}
+
+#ifndef NN_BUILTIN_BLAS
+/* Adapters so both implementations go through one function pointer type. */
+static void cblas_gemm(enum CBLAS_ORDER order, enum CBLAS_TRANSPOSE ta, enum CBLAS_TRANSPOSE tb, int M, int N, int K,
+                       double alpha, const nn_real* A, int lda, const nn_real* B, int ldb, double beta, nn_real* C, int ldc) {
+  NN_CBLAS(gemm)(order, ta, tb, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+static double max_difference(const nn_real* a, const nn_real* b, uint64_t n) {
+  double worst = 0;
+  for(uint64_t i = 0; i < n; i++) {
+    double d = fabs((double)a[i] - (double)b[i]);
+    if(d > worst) worst = d;
+  }
+  return worst;
+}
+#endif
+
+/* GFLOP/s of 'gemm' on 'shape', repeating until MIN_SECONDS have passed; the result is left in C. */
+static double time_gemm(gemm_function gemm, const gemm_shape* s, const nn_real* A, const nn_real* B, nn_real* C) {
+  int lda = s->trans_a == CblasNoTrans ? s->K : s->M;
+  int ldb = s->trans_b == CblasNoTrans ? s->N : s->K;
+  gemm(CblasRowMajor, s->trans_a, s->trans_b, s->M, s->N, s->K, 1.0, A, lda, B, ldb, 0.0, C, s->N);
+
+  uint64_t calls = 0;
+  double t0 = now_seconds(), elapsed;
+  do {
+    gemm(CblasRowMajor, s->trans_a, s->trans_b, s->M, s->N, s->K, 1.0, A, lda, B, ldb, 0.0, C, s->N);
+    calls++;
+    elapsed = now_seconds() - t0;
+  } while(elapsed < MIN_SECONDS);
+  return 2.0 * s->M * s->N * s->K * (double)calls / elapsed * 1e-9;
+}
+
+static void bench_shape(const gemm_shape* s, uint64_t batch) {
+  uint64_t a_size = (uint64_t)s->M * s->K, b_size = (uint64_t)s->K * s->N, c_size = (uint64_t)s->M * s->N;
+  nn_real* A = random_array(a_size);
+  nn_real* B = random_array(b_size);
+  nn_real* C_builtin = random_array(c_size);
+  nn_real* C_blas = random_array(c_size);
+
+  double builtin = time_gemm(nn_gemm, s, A, B, C_builtin);
+  printf("%-12s %5llu %4d x %4d x %4d %12.2f", s->name, (unsigned long long)batch, s->M, s->N, s->K, builtin);
+#ifndef NN_BUILTIN_BLAS
+  double blas = time_gemm(cblas_gemm, s, A, B, C_blas);
+  printf(" %12.2f %8.2fx %12.2e\n", blas, builtin / blas, max_difference(C_builtin, C_blas, c_size));
+#else
+  printf(" %12s\n", "-");
+#endif
+
+  free(A);
+  free(B);
+  free(C_builtin);
+  free(C_blas);
+}
+
+/* The inference fast path: one (neurons x inputs) gemv per layer. */
+static void bench_gemv(int M, int N) {
+  nn_real* A = random_array((uint64_t)M * N);
+  nn_real* x = random_array((uint64_t)N);
+  nn_real* y_builtin = random_array((uint64_t)M);
+  nn_real* y_blas = random_array((uint64_t)M);
+
+  double rate[2] = {0, 0};
+  for(int which = 0; which < 2; which++) {
+#ifdef NN_BUILTIN_BLAS
+    if(which == 1) break;
+#endif
+    nn_real* y = which == 0 ? y_builtin : y_blas;
+    uint64_t calls = 0;
+    double t0 = now_seconds(), elapsed;
+    do {
+      if(which == 0) nn_gemv(CblasRowMajor, CblasNoTrans, M, N, 1.0, A, N, x, 1, 0.0, y, 1);
+#ifndef NN_BUILTIN_BLAS
+      else NN_CBLAS(gemv)(CblasRowMajor, CblasNoTrans, M, N, 1.0, A, N, x, 1, 0.0, y, 1);
+#endif
+      calls++;
+      elapsed = now_seconds() - t0;
+    } while(elapsed < MIN_SECONDS);
+    rate[which] = 2.0 * M * N * (double)calls / elapsed * 1e-9;
+  }
+
+  printf("%-12s %5d %4d x %4d x %4d %12.2f", "gemv", 1, M, 1, N, rate[0]);
+#ifndef NN_BUILTIN_BLAS
+  printf(" %12.2f %8.2fx %12.2e\n", rate[1], rate[0] / rate[1], max_difference(y_builtin, y_blas, (uint64_t)M));
+#else
+  printf(" %12s\n", "-");
+#endif
+
+  free(A);
+  free(x);
+  free(y_builtin);
+  free(y_blas);
+}
+
+int main(int argc, char** argv) {
+  static const int sizes[] = {784, 128, 64, 10};
+  static const int layers = 3;
+  uint64_t batches[8] = {32, 128, 256};
+  uint32_t batch_count = 3;
+  uint32_t threads = 1;
+  int usage = 0, user_batches = 0;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      if(!user_batches) batch_count = 0;
+      user_batches = 1;
+      if(batch_count < 8) batches[batch_count++] = (uint64_t)atoll(argv[++i]);
+      else usage = 1;
+    }
+    else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = (uint32_t)atoi(argv[++i]);
+    else usage = 1;
+  }
+  for(uint32_t b = 0; b < batch_count; b++) usage |= batches[b] == 0;
+  if(usage || threads == 0) {
+    fprintf(stderr, "Usage: %s [--batch N]... [--threads N]\n", argv[0]);
+    return 1;
+  }
+  nn_gemm_set_threads(threads);
+
+  printf("built-in GEMM threads %u, %s\n", threads, sizeof(nn_real) == 4 ? "float32" : "float64");
+  printf("%-12s %5s %18s %12s %12s %9s %12s\n", "product", "batch", "M x N x K", "built-in", "cblas", "ratio", "max diff");
+  printf("%-12s %5s %18s %12s %12s\n", "", "", "", "GFLOP/s", "GFLOP/s");
+
+  for(uint32_t b = 0; b < batch_count; b++) {
+    int batch = (int)batches[b];
+    for(int l = 0; l < layers; l++) {
+      int inputs = sizes[l], neurons = sizes[l + 1];
+      gemm_shape forward = {"forward", CblasNoTrans, CblasNoTrans, neurons, batch, inputs};
+      gemm_shape delta = {"delta", CblasTrans, CblasNoTrans, inputs, batch, neurons};
+      gemm_shape weights = {"weight grad", CblasNoTrans, CblasTrans, neurons, inputs, batch};
+      bench_shape(&forward, batches[b]);
+      if(l > 0) bench_shape(&delta, batches[b]);
+      bench_shape(&weights, batches[b]);
+    }
+  }
+  for(int l = 0; l < layers; l++) bench_gemv(sizes[l + 1], sizes[l]);
+  return 0;
+}
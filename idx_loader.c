@@ -3,6 +3,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static int read_u32_be(FILE* f, uint32_t* out) {
   uint8_t b[4];
@@ -11,10 +15,33 @@ static int read_u32_be(FILE* f, uint32_t* out) {
   return 0;
 }
 
+static uint32_t load_u32_be(const uint8_t* b) {
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+}
+
 void idx_free(void* p) {
   free(p);
 }
 
+/* Map a whole file read-only; *size receives its length. Returns NULL on failure. */
+static uint8_t* map_file(const char* path, uint64_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return NULL;
+
+  *size = (uint64_t)st.st_size;
+  return (uint8_t*)p;
+}
+
 int idx_read_u8_images(const char* path, idx_u8_images* out) {
   if (!out) return 1;
   memset(out, 0, sizeof(*out));
@@ -93,3 +120,227 @@ int idx_read_u8_labels(const char* path, idx_u8_labels* out) {
   out->count = count;
   return 0;
 }
+
+int idx_map_u8_images(const char* path, idx_u8_images* out) {
+  if (!out) return 1;
+  memset(out, 0, sizeof(*out));
+
+  uint64_t size = 0;
+  uint8_t* base = map_file(path, &size);
+  if (!base) return 2;
+
+  if (size < 16) {
+    munmap(base, (size_t)size);
+    return 3;
+  }
+
+  /* 0x00000803 = unsigned byte, 3 dimensions */
+  if (load_u32_be(base) != 0x00000803) {
+    munmap(base, (size_t)size);
+    return 4;
+  }
+
+  uint32_t count = load_u32_be(base + 4);
+  uint32_t rows = load_u32_be(base + 8);
+  uint32_t cols = load_u32_be(base + 12);
+  uint64_t n = (uint64_t)count * (uint64_t)rows * (uint64_t)cols;
+  if (size - 16 < n) {
+    munmap(base, (size_t)size);
+    return 6;
+  }
+
+  out->data = base + 16;
+  out->count = count;
+  out->rows = rows;
+  out->cols = cols;
+  out->mapping = base;
+  out->mapping_size = size;
+  return 0;
+}
+
+int idx_map_u8_labels(const char* path, idx_u8_labels* out) {
+  if (!out) return 1;
+  memset(out, 0, sizeof(*out));
+
+  uint64_t size = 0;
+  uint8_t* base = map_file(path, &size);
+  if (!base) return 2;
+
+  if (size < 8) {
+    munmap(base, (size_t)size);
+    return 3;
+  }
+
+  /* 0x00000801 = unsigned byte, 1 dimension */
+  if (load_u32_be(base) != 0x00000801) {
+    munmap(base, (size_t)size);
+    return 4;
+  }
+
+  uint32_t count = load_u32_be(base + 4);
+  if (size - 8 < count) {
+    munmap(base, (size_t)size);
+    return 6;
+  }
+
+  out->data = base + 8;
+  out->count = count;
+  out->mapping = base;
+  out->mapping_size = size;
+  return 0;
+}
+
+void idx_release_images(idx_u8_images* images) {
+  if (images->mapping) munmap(images->mapping, (size_t)images->mapping_size);
+  else idx_free(images->data);
+  memset(images, 0, sizeof(*images));
+}
+
+void idx_release_labels(idx_u8_labels* labels) {
+  if (labels->mapping) munmap(labels->mapping, (size_t)labels->mapping_size);
+  else idx_free(labels->data);
+  memset(labels, 0, sizeof(*labels));
+}
+
+int idx_stream_open(const char* path, uint32_t chunk_samples, idx_stream* s) {
+  if (!s || chunk_samples == 0) return 1;
+  memset(s, 0, sizeof(*s));
+
+  FILE* f = fopen(path, "rb");
+  if (!f) return 2;
+
+  /* Magic: two zero bytes, element type (0x08 = unsigned byte), number of dimensions */
+  uint8_t magic[4];
+  if (fread(magic, 1, 4, f) != 4) {
+    fclose(f);
+    return 3;
+  }
+  if (magic[0] != 0 || magic[1] != 0 || magic[2] != 0x08 || magic[3] == 0 || magic[3] > 4) {
+    fclose(f);
+    return 4;
+  }
+
+  s->ndims = magic[3];
+  s->sample_size = 1;
+  for (uint8_t d = 0; d < s->ndims; d++) {
+    if (read_u32_be(f, &s->dims[d])) {
+      fclose(f);
+      return 3;
+    }
+    if (d > 0) s->sample_size *= s->dims[d];
+  }
+  s->count = s->dims[0];
+  s->data_offset = 4 + 4 * (long)s->ndims;
+
+  s->chunk = (uint8_t*)malloc((size_t)(chunk_samples * s->sample_size));
+  if (!s->chunk) {
+    fclose(f);
+    return 5;
+  }
+  s->chunk_capacity = chunk_samples;
+  s->file = f;
+  return 0;
+}
+
+const uint8_t* idx_stream_next(idx_stream* s) {
+  if (s->chunk_pos == s->chunk_len) {
+    uint32_t want = s->count - s->next;
+    if (want > s->chunk_capacity) want = s->chunk_capacity;
+    if (want == 0) return NULL;
+
+    size_t got = fread(s->chunk, (size_t)s->sample_size, want, s->file);
+    if (got == 0) return NULL;
+    s->next += (uint32_t)got;
+    s->chunk_len = (uint32_t)got;
+    s->chunk_pos = 0;
+  }
+  return s->chunk + (uint64_t)s->chunk_pos++ * s->sample_size;
+}
+
+uint32_t idx_stream_read(idx_stream* s, uint8_t* out, uint32_t n) {
+  uint32_t i = 0;
+  for (; i < n; i++) {
+    const uint8_t* sample = idx_stream_next(s);
+    if (!sample) break;
+    memcpy(out + (uint64_t)i * s->sample_size, sample, (size_t)s->sample_size);
+  }
+  return i;
+}
+
+int idx_stream_rewind(idx_stream* s) {
+  if (fseek(s->file, s->data_offset, SEEK_SET) != 0) return 1;
+  s->next = 0;
+  s->chunk_len = 0;
+  s->chunk_pos = 0;
+  return 0;
+}
+
+void idx_stream_close(idx_stream* s) {
+  if (s->file) fclose(s->file);
+  free(s->chunk);
+  memset(s, 0, sizeof(*s));
+}
+
+/* Pull samples from the streams into empty slots until the buffer is full or the streams end. */
+static void shuffle_fill(idx_shuffle_buffer* b) {
+  while (b->filled < b->capacity) {
+    const uint8_t* sample = idx_stream_next(b->samples);
+    const uint8_t* label = idx_stream_next(b->labels);
+    if (!sample || !label) return;
+    memcpy(b->slots + (uint64_t)b->filled * b->samples->sample_size, sample, (size_t)b->samples->sample_size);
+    memcpy(b->slot_labels + (uint64_t)b->filled * b->labels->sample_size, label, (size_t)b->labels->sample_size);
+    b->filled++;
+  }
+}
+
+int idx_shuffle_init(idx_shuffle_buffer* b, idx_stream* samples, idx_stream* labels, uint32_t capacity) {
+  memset(b, 0, sizeof(*b));
+  if (capacity == 0 || samples->count != labels->count) return 1;
+
+  b->samples = samples;
+  b->labels = labels;
+  b->capacity = capacity;
+  b->slots = (uint8_t*)malloc((size_t)(capacity * samples->sample_size));
+  b->slot_labels = (uint8_t*)malloc((size_t)(capacity * labels->sample_size));
+  if (!b->slots || !b->slot_labels) {
+    idx_shuffle_free(b);
+    return 2;
+  }
+  return idx_shuffle_reset(b);
+}
+
+int idx_shuffle_reset(idx_shuffle_buffer* b) {
+  if (idx_stream_rewind(b->samples) != 0 || idx_stream_rewind(b->labels) != 0) return 1;
+  b->filled = 0;
+  shuffle_fill(b);
+  return 0;
+}
+
+int idx_shuffle_next(idx_shuffle_buffer* b, uint8_t* sample, uint8_t* label) {
+  if (b->filled == 0) return 1;
+
+  uint64_t ss = b->samples->sample_size;
+  uint64_t ls = b->labels->sample_size;
+  uint32_t k = (uint32_t)(rand() % b->filled);
+  memcpy(sample, b->slots + k * ss, (size_t)ss);
+  memcpy(label, b->slot_labels + k * ls, (size_t)ls);
+
+  /* Refill slot k from the streams, or close the gap with the last slot once they run dry. */
+  const uint8_t* next_sample = idx_stream_next(b->samples);
+  const uint8_t* next_label = idx_stream_next(b->labels);
+  if (next_sample && next_label) {
+    memcpy(b->slots + k * ss, next_sample, (size_t)ss);
+    memcpy(b->slot_labels + k * ls, next_label, (size_t)ls);
+  } else {
+    b->filled--;
+    memmove(b->slots + k * ss, b->slots + (uint64_t)b->filled * ss, (size_t)ss);
+    memmove(b->slot_labels + k * ls, b->slot_labels + (uint64_t)b->filled * ls, (size_t)ls);
+  }
+  return 0;
+}
+
+void idx_shuffle_free(idx_shuffle_buffer* b) {
+  free(b->slots);
+  free(b->slot_labels);
+  memset(b, 0, sizeof(*b));
+}
@@ -2,17 +2,23 @@
 #define IDX_LOADER_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
 typedef struct {
   uint8_t* data;
   uint32_t count;
   uint32_t rows;
   uint32_t cols;
+  /* Non-NULL when data points into a read-only mapping of the file (idx_map_u8_images). */
+  void* mapping;
+  uint64_t mapping_size;
 } idx_u8_images;
 
 typedef struct {
   uint8_t* data;
   uint32_t count;
+  void* mapping;
+  uint64_t mapping_size;
 } idx_u8_labels;
 
 /**
@@ -35,4 +41,102 @@ int idx_read_u8_labels(const char* path, idx_u8_labels* out);
  */
 void idx_free(void* p);
 
+/**
+ * Like idx_read_u8_images, but maps the file read-only (mmap) instead of copying it.
+ * out->data points just past the header; release with idx_release_images().
+ * The pages are shared with every other process mapping the same file.
+ * Returns 0 on success, nonzero on failure.
+ */
+int idx_map_u8_images(const char* path, idx_u8_images* out);
+
+/**
+ * Like idx_read_u8_labels, but maps the file read-only (mmap). Release with idx_release_labels().
+ * Returns 0 on success, nonzero on failure.
+ */
+int idx_map_u8_labels(const char* path, idx_u8_labels* out);
+
+/**
+ * Release images or labels from either the read or the map functions, and zero the struct.
+ */
+void idx_release_images(idx_u8_images* images);
+void idx_release_labels(idx_u8_labels* labels);
+
+/**
+ * Sequential, chunked reader over the samples of an unsigned-byte IDX file of any rank.
+ * A sample is one slice along the first dimension (an image, a label). Memory use is bounded
+ * by the chunk size, whatever the file size.
+ */
+typedef struct {
+  FILE* file;
+  uint32_t dims[4];
+  uint8_t ndims;
+  uint32_t count;        /* samples in the file (first dimension) */
+  uint64_t sample_size;  /* bytes per sample (product of the remaining dimensions) */
+  long data_offset;      /* file offset of sample 0 */
+  uint32_t next;         /* index of the next sample to read from the file */
+
+  uint8_t* chunk;        /* read-ahead buffer of chunk_capacity samples */
+  uint32_t chunk_capacity;
+  uint32_t chunk_len;
+  uint32_t chunk_pos;
+} idx_stream;
+
+/**
+ * Open an unsigned-byte IDX file for streaming with a read-ahead of chunk_samples samples.
+ * Returns 0 on success, nonzero on failure.
+ */
+int idx_stream_open(const char* path, uint32_t chunk_samples, idx_stream* s);
+
+/**
+ * Return the next sample, or NULL at the end of the file. The pointer is valid until the next
+ * call on this stream.
+ */
+const uint8_t* idx_stream_next(idx_stream* s);
+
+/**
+ * Copy up to n samples into out (n * sample_size bytes). Returns the number copied.
+ */
+uint32_t idx_stream_read(idx_stream* s, uint8_t* out, uint32_t n);
+
+/**
+ * Start again from sample 0. Returns 0 on success, nonzero on failure.
+ */
+int idx_stream_rewind(idx_stream* s);
+
+void idx_stream_close(idx_stream* s);
+
+/**
+ * Shuffle buffer over a pair of streams (samples and their labels). It holds 'capacity'
+ * samples and emits a uniformly random one, refilling its slot from the streams. This gives
+ * an approximate shuffle of an arbitrarily large dataset in bounded memory; the larger the
+ * capacity, the closer to a full shuffle.
+ */
+typedef struct {
+  idx_stream* samples;
+  idx_stream* labels;
+  uint8_t* slots;        /* capacity * samples->sample_size */
+  uint8_t* slot_labels;  /* capacity * labels->sample_size */
+  uint32_t capacity;
+  uint32_t filled;
+} idx_shuffle_buffer;
+
+/**
+ * Allocate the buffer and fill it from the start of the streams. The streams must hold the
+ * same number of samples. Returns 0 on success, nonzero on failure.
+ */
+int idx_shuffle_init(idx_shuffle_buffer* b, idx_stream* samples, idx_stream* labels, uint32_t capacity);
+
+/**
+ * Rewind both streams and refill, starting a new epoch. Returns 0 on success, nonzero on failure.
+ */
+int idx_shuffle_reset(idx_shuffle_buffer* b);
+
+/**
+ * Copy one randomly chosen buffered sample and its label out, and refill its slot from the
+ * streams. Returns 0 on success, 1 once every sample of the epoch has been emitted.
+ */
+int idx_shuffle_next(idx_shuffle_buffer* b, uint8_t* sample, uint8_t* label);
+
+void idx_shuffle_free(idx_shuffle_buffer* b);
+
 #endif
\ No newline at end of file
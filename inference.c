@@ -0,0 +1,105 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "inference.h"
+
+int inference_context_init(inference_context* ctx, const neural_network* network, uint64_t max_batch) {
+  memset(ctx, 0, sizeof(*ctx));
+
+  uint64_t max_neurons = 0;
+  for(int i = 0; i < network->number_of_layers; i++) {
+    if(network->layers[i].neurons > max_neurons) max_neurons = network->layers[i].neurons;
+  }
+
+  if(arena_init(&ctx->arena, 2 * arena_matrix_size(max_neurons, max_batch)) != 0) return 1;
+  ctx->max_batch = max_batch;
+  ctx->buffers[0] = arena_matrix(&ctx->arena, max_neurons, max_batch);
+  ctx->buffers[1] = arena_matrix(&ctx->arena, max_neurons, max_batch);
+  return 0;
+}
+
+matrix infer(const neural_network* network, inference_context* ctx, const matrix* inputs) {
+  uint64_t batch = inputs->column_size;
+  assert(batch <= ctx->max_batch);
+
+  matrix last = *inputs;
+  for(int i = 0; i < network->number_of_layers; i++) {
+    const layer* l = &network->layers[i];
+    /* Local copies of the parameter headers; the kernels take non-const matrices but only read them. */
+    matrix weights = l->weights;
+    matrix biases = l->biases;
+    matrix out = {.row_size = l->neurons, .column_size = batch, .array = ctx->buffers[i % 2].array};
+
+    matrix_v_multiply_into(&weights, &last, &biases, &out, 1.0, 1.0);
+    l->a(&out, &out);
+    last = out;
+  }
+  return last;
+}
+
+/* Softmax of a contiguous vector; in and out may alias. */
+static void softmax_vector(const nn_real* in, nn_real* out, uint64_t n) {
+  double mx = in[0];
+  for(uint64_t i = 1; i < n; i++) {
+    if(in[i] > mx) mx = in[i];
+  }
+
+  double sum = 0.0;
+  for(uint64_t i = 0; i < n; i++) {
+    double e = exp(in[i] - mx);
+    out[i] = (nn_real)e;
+    sum += e;
+  }
+
+  nn_real inv = (sum > 0.0) ? (nn_real)(1.0 / sum) : 0;
+  for(uint64_t i = 0; i < n; i++) out[i] *= inv;
+}
+
+static uint64_t argmax_vector(const nn_real* v, uint64_t n) {
+  uint64_t best = 0;
+  for(uint64_t i = 1; i < n; i++) {
+    if(v[i] > v[best]) best = i;
+  }
+  return best;
+}
+
+uint64_t infer_one(const neural_network* network, inference_context* ctx, const nn_real* input, nn_real* probabilities) {
+  assert(ctx->max_batch >= 1);
+
+  const nn_real* x = input;
+  uint16_t last_layer = network->number_of_layers - 1;
+
+  for(int i = 0; i < network->number_of_layers; i++) {
+    const layer* l = &network->layers[i];
+    uint64_t n = l->neurons;
+    uint64_t inputs = l->weights.column_size;
+    nn_real* out = ctx->buffers[i % 2].array;
+
+    /* out = W*x + b: seed with the bias and let gemv accumulate onto it. */
+    memcpy(out, l->biases.array, n * sizeof(nn_real));
+    NN_CBLAS(gemv)(CblasRowMajor, CblasNoTrans, (int)n, (int)inputs, 1.0, l->weights.array, (int)inputs, x, 1, 1.0, out, 1);
+
+    if(l->a == relu_into) {
+      for(uint64_t k = 0; k < n; k++) out[k] = out[k] > 0 ? out[k] : 0;
+    } else if(l->a == softmax_into) {
+      /* Softmax is monotonic, so the logits already give the argmax. */
+      if(i == last_layer && !probabilities) return argmax_vector(out, n);
+      softmax_vector(out, i == last_layer ? probabilities : out, n);
+      if(i == last_layer) return argmax_vector(probabilities, n);
+    } else {
+      matrix column = {.row_size = n, .column_size = 1, .array = out};
+      l->a(&column, &column);
+    }
+    x = out;
+  }
+
+  uint64_t classes = network->layers[last_layer].neurons;
+  if(probabilities) memcpy(probabilities, x, classes * sizeof(nn_real));
+  return argmax_vector(x, classes);
+}
+
+void inference_context_free(inference_context* ctx) {
+  arena_free(&ctx->arena);
+  memset(ctx, 0, sizeof(*ctx));
+}
@@ -0,0 +1,39 @@
+#ifndef INFERENCE_H_
+#define INFERENCE_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+
+/*
+  Read-only inference, separate from the training forward_pass(). The network is only read, and
+  every buffer a call needs lives in a caller-owned inference_context, so any number of threads
+  can serve one model at once (one context each) and a call never allocates.
+*/
+typedef struct {
+  matrix_arena arena;
+  uint64_t max_batch;
+  matrix buffers[2];   /* ping-pong activations, (widest layer x max_batch) each */
+} inference_context;
+
+/* Size a context for batches of up to max_batch samples. Returns 0 on success, nonzero on failure. */
+int inference_context_init(inference_context* ctx, const neural_network* network, uint64_t max_batch);
+
+/*
+  Run the network on inputs (features x batch, batch <= ctx->max_batch). Returns the output
+  (classes x batch) as a view into ctx, valid until the next infer() call with the same context.
+*/
+matrix infer(const neural_network* network, inference_context* ctx, const matrix* inputs);
+
+/*
+  Single-sample fast path for per-request serving. Each layer is one gemv onto a copy of its
+  bias, with the activation applied in the same pass over the output vector. Returns the
+  predicted class. When 'probabilities' is NULL the softmax is skipped, because it does not
+  change the argmax; otherwise the output activations are written there.
+*/
+uint64_t infer_one(const neural_network* network, inference_context* ctx, const nn_real* input, nn_real* probabilities);
+
+void inference_context_free(inference_context* ctx);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+#include "checkpoint.h"
+#include "inference.h"
+
+/*
+  Inference latency benchmark: maps a checkpoint and has N threads serve infer() calls against
+  the one shared model, each thread with its own inference_context, for batch sizes 1..256.
+  Batch 1 is measured twice: through infer() and through the infer_one() fast path (argmax only).
+  Reports per-call p50/p99 latency and aggregate throughput.
+*/
+
+#define WARMUP_CALLS 20
+
+typedef struct {
+  const neural_network* network;
+  inference_context ctx;
+  matrix x;             /* (inputs x max_batch) random inputs */
+  uint64_t batch;
+  int fast;             /* use infer_one() (batch 1) */
+  uint32_t iterations;
+  double* latencies;    /* per call, microseconds */
+  pthread_t thread;
+} latency_worker;
+
+static void die(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec * 1e-3;
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void* worker_main(void* arg) {
+  latency_worker* w = (latency_worker*)arg;
+  matrix x = {.row_size = w->x.row_size, .column_size = w->batch, .array = w->x.array};
+
+  /* The fast path takes one contiguous sample; any 'inputs' random values will do. */
+  for(uint32_t i = 0; i < WARMUP_CALLS + w->iterations; i++) {
+    double t0 = now_us();
+    if(w->fast) infer_one(w->network, &w->ctx, w->x.array, NULL);
+    else infer(w->network, &w->ctx, &x);
+    if(i >= WARMUP_CALLS) w->latencies[i - WARMUP_CALLS] = now_us() - t0;
+  }
+  return NULL;
+}
+
+/*
+  Run every worker for one batch size and print a row. 'all' holds the workers' latency arrays
+  back to back.
+*/
+static void measure(latency_worker* workers, uint32_t threads, uint64_t batch, int fast, double* all) {
+  uint32_t iterations = workers[0].iterations;
+
+  double t0 = now_us();
+  for(uint32_t t = 0; t < threads; t++) {
+    workers[t].batch = batch;
+    workers[t].fast = fast;
+    if(pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) die("Failed to start thread");
+  }
+  for(uint32_t t = 0; t < threads; t++) pthread_join(workers[t].thread, NULL);
+  double elapsed = now_us() - t0;
+
+  uint64_t n = (uint64_t)threads * iterations;
+  qsort(all, n, sizeof(double), compare_double);
+  double calls = (double)threads * (iterations + WARMUP_CALLS);
+  printf("%6llu%-4s %10.2f %10.2f %14.0f\n", (unsigned long long)batch, fast ? " gv" : "", all[n / 2],
+         all[n * 99 / 100], calls * (double)batch / (elapsed * 1e-6));
+}
+
+int main(int argc, char** argv) {
+  char* path = NULL;
+  uint32_t threads = 1;
+  uint32_t iterations = 2000;
+  uint64_t max_batch = 256;
+  int usage = 0;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = (uint32_t)atoi(argv[++i]);
+    else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = (uint32_t)atoi(argv[++i]);
+    else if(strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc) max_batch = (uint64_t)atoll(argv[++i]);
+    else if(argv[i][0] != '-' && !path) path = argv[i];
+    else usage = 1;
+  }
+  if(usage || !path || threads == 0 || iterations == 0 || max_batch == 0) {
+    fprintf(stderr, "Usage: %s CHECKPOINT [--threads N] [--iterations N] [--max-batch N]\n", argv[0]);
+    return 1;
+  }
+
+  checkpoint ckpt;
+  neural_network net;
+  if(checkpoint_map(path, &ckpt, &net) != 0) die("Failed to map checkpoint");
+  uint64_t inputs = net.layers[0].weights.column_size;
+
+  latency_worker* workers = calloc(threads, sizeof(latency_worker));
+  double* all = malloc((size_t)threads * iterations * sizeof(double));
+  if(!workers || !all) die("malloc failed");
+
+  for(uint32_t t = 0; t < threads; t++) {
+    latency_worker* w = &workers[t];
+    w->network = &net;
+    w->iterations = iterations;
+    w->latencies = all + (uint64_t)t * iterations;
+    w->x = create_matrix(inputs, max_batch);
+    if(!w->x.array) die("malloc failed");
+    fill_matrix(&w->x, 0.0, 1.0);
+    if(inference_context_init(&w->ctx, &net, max_batch) != 0) die("Failed to allocate inference context");
+  }
+
+  printf("threads %u, %u calls per thread per batch size\n", threads, iterations);
+  printf("%10s %10s %10s %14s\n", "batch", "p50 us", "p99 us", "samples/s");
+
+  measure(workers, threads, 1, 1, all);
+  for(uint64_t batch = 1; batch <= max_batch; batch *= 2) measure(workers, threads, batch, 0, all);
+
+  for(uint32_t t = 0; t < threads; t++) {
+    inference_context_free(&workers[t].ctx);
+    free_matrix(&workers[t].x);
+  }
+  free(all);
+  free(workers);
+  checkpoint_unmap(&ckpt, &net);
+  return 0;
+}
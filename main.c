@@ -3,27 +3,51 @@
 #include <stdint.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 
 #include "idx_loader.h"
+#include "dataset_cache.h"
 #include "matrix.h"
 #include "neural_network.h"
+#include "optimizer.h"
+#include "trainer.h"
+#include "pipeline.h"
+#include "checkpoint.h"
+#include "inference.h"
+#include "quantize.h"
+#include "batch.h"
+#include "profile.h"
+#include "evaluator.h"
+#include "distributed.h"
 
 #define IMAGE_SIZE 28
-#define TRAIN_SIZE 60000
-#define TEST_SIZE 10000
 
 #define MNIST_INPUTS (IMAGE_SIZE * IMAGE_SIZE)
 #define MNIST_CLASSES 10
 
-static uint8_t* train_image[TRAIN_SIZE];
-static uint8_t* test_image[TEST_SIZE];
-static uint8_t* train_label = NULL;
-static uint8_t* test_label = NULL;
+/* Default mode: pre-normalized caches mapped from disk. */
+static dataset_cache train_data;
+static dataset_cache test_data;
 
-static idx_u8_images train_images_raw;
-static idx_u8_images test_images_raw;
-static idx_u8_labels train_labels_raw;
-static idx_u8_labels test_labels_raw;
+/* Streaming mode (--stream N): the IDX files are read in chunks, training samples through a shuffle buffer. */
+#define STREAM_CHUNK_SAMPLES 4096
+
+/* --trace PATH records the first TRACE_STEPS training steps as a Chrome trace (profile.h). */
+#define TRACE_STEPS 16
+
+static idx_stream train_images;
+static idx_stream train_labels;
+static idx_shuffle_buffer train_shuffle;
+/* The test set is only read in order and in parallel by the evaluator, so it is mapped rather than streamed. */
+static idx_u8_images test_images;
+static idx_u8_labels test_labels;
+
+/* Cache files are per element type, so fp32 and fp64 builds don't keep overwriting each other's. */
+#ifdef NN_FLOAT32
+  #define CACHE_SUFFIX ".f32.cache"
+#else
+  #define CACHE_SUFFIX ".f64.cache"
+#endif
 
 /**
  * Print an error message and exit.
@@ -34,96 +58,60 @@ static void die(const char* msg) {
 }
 
 /**
- * Load MNIST from ./data using the generic IDX loader.
+ * Load MNIST from ./data as pre-normalized dataset caches. The first run converts the IDX files
+ * and writes a .cache file next to each; later runs just map the caches.
  * MNIST-specific filenames and expected shapes are kept in this file (main.c) only.
  */
 static void load_mnist_data(void) {
-  if (idx_read_u8_images("data/train-images-idx3-ubyte", &train_images_raw) != 0) die("Failed to read train images");
-  if (idx_read_u8_labels("data/train-labels-idx1-ubyte", &train_labels_raw) != 0) die("Failed to read train labels");
-  if (idx_read_u8_images("data/t10k-images-idx3-ubyte", &test_images_raw) != 0) die("Failed to read test images");
-  if (idx_read_u8_labels("data/t10k-labels-idx1-ubyte", &test_labels_raw) != 0) die("Failed to read test labels");
-
-  if (train_images_raw.count != TRAIN_SIZE || train_images_raw.rows != IMAGE_SIZE || train_images_raw.cols != IMAGE_SIZE) {
-    die("Train images shape mismatch");
+  if (dataset_cache_open("data/train-images-idx3-ubyte" CACHE_SUFFIX, "data/train-images-idx3-ubyte",
+                         "data/train-labels-idx1-ubyte", &train_data) != 0) {
+    die("Failed to read train images");
   }
-  if (test_images_raw.count != TEST_SIZE || test_images_raw.rows != IMAGE_SIZE || test_images_raw.cols != IMAGE_SIZE) {
-    die("Test images shape mismatch");
-  }
-  if (train_labels_raw.count != TRAIN_SIZE || test_labels_raw.count != TEST_SIZE) {
-    die("Labels count mismatch");
+  if (dataset_cache_open("data/t10k-images-idx3-ubyte" CACHE_SUFFIX, "data/t10k-images-idx3-ubyte",
+                         "data/t10k-labels-idx1-ubyte", &test_data) != 0) {
+    die("Failed to read test images");
   }
 
-  train_label = train_labels_raw.data;
-  test_label = test_labels_raw.data;
-
-  for (uint32_t i = 0; i < TRAIN_SIZE; i++) {
-    train_image[i] = train_images_raw.data + (uint64_t)i * MNIST_INPUTS;
-  }
-  for (uint32_t i = 0; i < TEST_SIZE; i++) {
-    test_image[i] = test_images_raw.data + (uint64_t)i * MNIST_INPUTS;
-  }
+  if (train_data.count == 0 || train_data.features != MNIST_INPUTS) die("Train images shape mismatch");
+  if (test_data.count == 0 || test_data.features != MNIST_INPUTS) die("Test images shape mismatch");
 }
 
 /**
- * Free MNIST buffers allocated by load_mnist_data().
+ * Open MNIST's IDX files in ./data for streaming, with a shuffle buffer of 'capacity' training
+ * samples. Memory use is set by the chunk and buffer sizes, not by the dataset size.
  */
-static void free_mnist_data(void) {
-  idx_free(train_images_raw.data);
-  idx_free(test_images_raw.data);
-  idx_free(train_labels_raw.data);
-  idx_free(test_labels_raw.data);
-  memset(&train_images_raw, 0, sizeof(train_images_raw));
-  memset(&test_images_raw, 0, sizeof(test_images_raw));
-  memset(&train_labels_raw, 0, sizeof(train_labels_raw));
-  memset(&test_labels_raw, 0, sizeof(test_labels_raw));
-  train_label = NULL;
-  test_label = NULL;
-}
+static void open_mnist_streams(uint32_t capacity) {
+  if (idx_stream_open("data/train-images-idx3-ubyte", STREAM_CHUNK_SAMPLES, &train_images) != 0 ||
+      idx_stream_open("data/train-labels-idx1-ubyte", STREAM_CHUNK_SAMPLES, &train_labels) != 0) {
+    die("Failed to read train images");
+  }
+  if (idx_map_u8_images("data/t10k-images-idx3-ubyte", &test_images) != 0 ||
+      idx_map_u8_labels("data/t10k-labels-idx1-ubyte", &test_labels) != 0) {
+    die("Failed to read test images");
+  }
 
-/**
- * Return the row index of the maximum value in a given column.
- */
-static uint64_t argmax_col(const matrix* m, uint64_t col) {
-  uint64_t best = 0;
-  double bestv = m->array[col];
-  for (uint64_t i = 1; i < m->row_size; i++) {
-    double v = m->array[i * m->column_size + col];
-    if (v > bestv) {
-      bestv = v;
-      best = i;
-    }
+  if (train_images.count == 0 || train_images.sample_size != MNIST_INPUTS || train_labels.sample_size != 1 ||
+      train_labels.count != train_images.count) {
+    die("Train images shape mismatch");
   }
-  return best;
+  if (test_images.count == 0 || test_images.rows * test_images.cols != MNIST_INPUTS || test_labels.count != test_images.count) {
+    die("Test images shape mismatch");
+  }
+
+  if (idx_shuffle_init(&train_shuffle, &train_images, &train_labels, capacity) != 0) die("Failed to fill shuffle buffer");
 }
 
 /**
- * Fill an input batch matrix X and one-hot label matrix Y from an image/label dataset.
- * X has shape (MNIST_INPUTS x batch_size), Y has shape (MNIST_CLASSES x batch_size).
+ * Release whatever load_mnist_data() or open_mnist_streams() opened.
  */
-static void build_batch_inputs(
-  matrix* x,
-  const uint8_t* const* images,
-  const uint8_t* labels,
-  const uint32_t* idx,
-  uint32_t start,
-  uint32_t bs,
-  matrix* y_onehot
-) {
-  for (uint64_t i = 0; i < x->row_size * x->column_size; i++) x->array[i] = 0.0;
-  for (uint64_t i = 0; i < y_onehot->row_size * y_onehot->column_size; i++) y_onehot->array[i] = 0.0;
-
-  for (uint32_t col = 0; col < bs; col++) {
-    uint32_t k = idx[start + col];
-    const uint8_t* img = images[k];
-
-    for (uint32_t p = 0; p < MNIST_INPUTS; p++) {
-      x->array[p * bs + col] = (double)img[p] / 255.0;
-    }
-
-    uint8_t y = labels[k];
-    if (y >= MNIST_CLASSES) die("Invalid label");
-    y_onehot->array[(uint32_t)y * bs + col] = 1.0;
-  }
+static void free_mnist_data(void) {
+  dataset_cache_free(&train_data);
+  dataset_cache_free(&test_data);
+  idx_shuffle_free(&train_shuffle);
+  idx_stream_close(&train_images);
+  idx_stream_close(&train_labels);
+  idx_release_images(&test_images);
+  idx_release_labels(&test_labels);
 }
 
 /**
@@ -139,98 +127,401 @@ static void shuffle_u32(uint32_t* a, uint32_t n) {
 }
 
 /**
- * Evaluate test-set accuracy using the current model.
+ * Batches read from a pair of IDX streams, through a shuffle buffer or in file order.
  */
-static double eval_test_accuracy(neural_network* net, uint32_t batch_size) {
-  uint64_t correct = 0;
+typedef struct {
+  idx_shuffle_buffer* shuffle;  /* NULL reads images/labels in file order */
+  idx_stream* images;
+  idx_stream* labels;
+  uint8_t* pixels;              /* batch_size * MNIST_INPUTS staging bytes */
+  uint8_t* label_bytes;         /* batch_size staging bytes */
+  uint32_t batch_size;
+} streamed_batches;
 
-  uint32_t* idx = (uint32_t*)malloc(sizeof(uint32_t) * TEST_SIZE);
-  if (!idx) die("malloc failed");
-  for (uint32_t i = 0; i < TEST_SIZE; i++) idx[i] = i;
+/**
+ * batch_builder over IDX streams. Steps must be built in order, which the pipeline guarantees.
+ */
+static void build_streamed_batch(void* context, uint64_t step, matrix* x, matrix* y) {
+  const streamed_batches* sb = (const streamed_batches*)context;
+  uint32_t start = (uint32_t)step * sb->batch_size;
+  uint32_t bs = sb->batch_size;
+  if (start + bs > sb->images->count) bs = sb->images->count - start;
+
+  if (sb->shuffle) {
+    for (uint32_t c = 0; c < bs; c++) {
+      if (idx_shuffle_next(sb->shuffle, sb->pixels + (uint64_t)c * MNIST_INPUTS, &sb->label_bytes[c]) != 0) {
+        die("IDX stream ended early");
+      }
+    }
+  } else if (idx_stream_read(sb->images, sb->pixels, bs) != bs || idx_stream_read(sb->labels, sb->label_bytes, bs) != bs) {
+    die("IDX stream ended early");
+  }
+
+  *x = batch_view(x, bs);
+  *y = batch_view(y, bs);
+  build_batch_inputs_u8(x, sb->pixels, sb->label_bytes, bs, y);
+}
 
-  for (uint32_t start = 0; start < TEST_SIZE; start += batch_size) {
-    uint32_t bs = batch_size;
-    if (start + bs > TEST_SIZE) bs = TEST_SIZE - start;
+#ifdef NN_FLOAT32
+  #define FLOAT_NAME "fp32"
+#else
+  #define FLOAT_NAME "fp64"
+#endif
 
-    matrix x = create_matrix(MNIST_INPUTS, bs);
-    matrix y = create_matrix(MNIST_CLASSES, bs);
+static double seconds_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
 
-    build_batch_inputs(&x, (const uint8_t* const*)test_image, test_label, idx, start, bs, &y);
+/**
+ * Quantize the trained model to int8, calibrated on the first 'samples' training images, and
+ * compare it with the float model one sample at a time on the raw t10k pixels.
+ */
+static void report_quantized(const neural_network* net, uint32_t samples) {
+  idx_u8_images train_raw, test_raw;
+  idx_u8_labels test_raw_labels;
+  if (idx_map_u8_images("data/train-images-idx3-ubyte", &train_raw) != 0 ||
+      idx_map_u8_images("data/t10k-images-idx3-ubyte", &test_raw) != 0 ||
+      idx_map_u8_labels("data/t10k-labels-idx1-ubyte", &test_raw_labels) != 0) {
+    die("Failed to map raw IDX files");
+  }
+  if (samples > train_raw.count) samples = train_raw.count;
+
+  quantized_network q;
+  quantized_context qctx;
+  inference_context ctx;
+  if (quantize_network(net, train_raw.data, samples, &q) != 0) die("Failed to quantize network");
+  if (quantized_context_init(&qctx, &q) != 0) die("malloc failed");
+  if (inference_context_init(&ctx, net, 1) != 0) die("Failed to allocate inference context");
+
+  /* Float reference: the same raw pixels, scaled to [0, 1], through the batch-1 fast path. */
+  nn_real input[MNIST_INPUTS];
+  uint64_t float_correct = 0, int8_correct = 0;
+  double float_seconds = 0.0, int8_seconds = 0.0;
+
+  for (uint32_t i = 0; i < test_raw.count; i++) {
+    const uint8_t* pixels = test_raw.data + (uint64_t)i * MNIST_INPUTS;
+    uint8_t label = test_raw_labels.data[i];
+
+    double t0 = seconds_now();
+    for (uint32_t p = 0; p < MNIST_INPUTS; p++) input[p] = (nn_real)pixels[p] / 255;
+    float_correct += infer_one(net, &ctx, input, NULL) == label;
+    double t1 = seconds_now();
+    int8_correct += quantized_predict(&q, &qctx, pixels) == label;
+    double t2 = seconds_now();
+
+    float_seconds += t1 - t0;
+    int8_seconds += t2 - t1;
+  }
 
-    matrix out = forward_pass(net, &x);
+  double float_acc = (double)float_correct / test_raw.count;
+  double int8_acc = (double)int8_correct / test_raw.count;
+  printf("int8 (calibrated on %u samples) | " FLOAT_NAME " t10k acc %.4f, %.2f us/sample"
+         " | int8 t10k acc %.4f, %.2f us/sample | delta %+.2f pts\n",
+         samples, float_acc, 1e6 * float_seconds / test_raw.count, int8_acc, 1e6 * int8_seconds / test_raw.count,
+         100.0 * (int8_acc - float_acc));
+
+  inference_context_free(&ctx);
+  quantized_context_free(&qctx);
+  free_quantized_network(&q);
+  idx_release_images(&train_raw);
+  idx_release_images(&test_raw);
+  idx_release_labels(&test_raw_labels);
+}
 
-    for (uint32_t col = 0; col < bs; col++) {
-      uint64_t pred = argmax_col(&out, col);
-      if ((uint8_t)pred == test_label[idx[start + col]]) correct++;
-    }
+/**
+ * Allocate an identity permutation of n indices.
+ */
+static uint32_t* identity_index(uint32_t n) {
+  uint32_t* idx = (uint32_t*)malloc(sizeof(uint32_t) * n);
+  if (!idx) die("malloc failed");
+  for (uint32_t i = 0; i < n; i++) idx[i] = i;
+  return idx;
+}
 
-    free_matrix(&x);
-    free_matrix(&y);
-  }
+/* Test-set results, printed as they arrive; the last epoch's also get the confusion matrix. */
+typedef struct {
+  uint64_t last_epoch;
+} eval_report;
+
+static void print_eval(void* context, uint64_t epoch, const eval_result* result) {
+  const eval_report* report = (const eval_report*)context;
+  flockfile(stdout);
+  printf("epoch %llu | test loss %.4f | test acc %.4f | top-%u %.4f | eval %.0f ms\n", (unsigned long long)epoch,
+         result->loss, (double)result->correct / result->samples, result->top_k,
+         (double)result->top_k_correct / result->samples, 1e3 * result->seconds);
+  if (epoch == report->last_epoch) eval_print_confusion(result);
+  fflush(stdout);
+  funlockfile(stdout);
+}
 
-  free(idx);
-  return (double)correct / (double)TEST_SIZE;
+/* Stop profiling and write what was recorded; a failed write is reported, not fatal. */
+static void finish_trace(neural_network* net, const char* path) {
+  if (network_profile_write_trace(net->profile, path) != 0) fprintf(stderr, "Could not write trace %s\n", path);
+  else printf("Wrote trace of %u events to %s\n", net->profile->event_count, path);
+  net->profile = NULL;
 }
 
 int main(int argc, char** argv) {
   uint32_t epochs = 5;
   uint32_t batch_size = 128;
   double lr = 0.01;
+  uint32_t threads = 1;
+  uint32_t accumulate = 1;
+  char* optimizer_name = "sgd";
+  int explicit_optimizer = 0;  /* --optimizer given; a resumed checkpoint must then match it */
+  uint32_t stream_buffer = 0;  /* shuffle buffer capacity in samples; 0 uses the dataset caches */
+  char* checkpoint_path = NULL;
+  uint32_t checkpoint_every = 1;
+  int resume = 0;
+  uint32_t quantize_samples = 0;  /* calibration samples for the int8 report; 0 skips it */
+  char* trace_path = NULL;
+  uint32_t eval_threads = 0;  /* 0: as many as --threads */
+  uint32_t top_k = 3;
+  int async_eval = 0;
+  int hogwild = 0;
+  uint32_t world = 1;  /* training processes (--world) */
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc) epochs = (uint32_t)atoi(argv[++i]);
     else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batch_size = (uint32_t)atoi(argv[++i]);
     else if (strcmp(argv[i], "--lr") == 0 && i + 1 < argc) lr = atof(argv[++i]);
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--accumulate") == 0 && i + 1 < argc) accumulate = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc) {
+      optimizer_name = argv[++i];
+      explicit_optimizer = 1;
+    }
+    else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) stream_buffer = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) checkpoint_path = argv[++i];
+    else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) checkpoint_every = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--resume") == 0) resume = 1;
+    else if (strcmp(argv[i], "--quantize") == 0 && i + 1 < argc) quantize_samples = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace_path = argv[++i];
+    else if (strcmp(argv[i], "--eval-threads") == 0 && i + 1 < argc) eval_threads = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc) top_k = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--async-eval") == 0) async_eval = 1;
+    else if (strcmp(argv[i], "--hogwild") == 0) hogwild = 1;
+    else if (strcmp(argv[i], "--world") == 0 && i + 1 < argc) world = (uint32_t)atoi(argv[++i]);
     else {
-      fprintf(stderr, "Usage: %s [--epochs N] [--batch N] [--lr X]\n", argv[0]);
+      fprintf(stderr, "Usage: %s [--epochs N] [--batch N] [--lr X] [--threads N] [--accumulate N]"
+                      " [--optimizer sgd|momentum|nesterov|adam|adamw] [--stream N]"
+                      " [--checkpoint PATH [--checkpoint-every N] [--resume]] [--quantize N] [--trace PATH]"
+                      " [--eval-threads N] [--top-k K] [--async-eval] [--hogwild] [--world N]\n", argv[0]);
       return 1;
     }
   }
 
-  srand((unsigned)time(NULL));
-  load_mnist_data();
+  if (checkpoint_every == 0) die("--checkpoint-every must be at least 1");
+  /* Hogwild workers build their own batches concurrently and step the weights with plain SGD. */
+  if (hogwild && (stream_buffer || accumulate != 1 || strcmp(optimizer_name, "sgd") != 0 || trace_path)) {
+    die("--hogwild needs the dataset caches, plain SGD, no --accumulate and no --trace");
+  }
+  /* Each --world rank is one single-threaded training process over its own shard of the cached training set. */
+  if (world == 0 || (world > 1 && (stream_buffer || hogwild || accumulate != 1 || threads != 1 || trace_path))) {
+    die("--world N needs the dataset caches, one thread per rank, no --hogwild, no --accumulate and no --trace");
+  }
 
-  neural_network net = create_network();
+  srand((unsigned)time(NULL));
+  if (stream_buffer) open_mnist_streams(stream_buffer);
+  else load_mnist_data();
+
+  uint32_t train_count = stream_buffer ? train_images.count : train_data.count;
+  uint32_t test_count = stream_buffer ? test_images.count : test_data.count;
+
+  /* --resume picks up the weights, optimizer state and epoch count from the checkpoint, if there is one. */
+  neural_network net;
+  optimizer opt;
+  uint64_t first_epoch = 0;
+
+  int loaded = CHECKPOINT_NOT_FOUND;
+  if (resume && checkpoint_path) {
+    loaded = checkpoint_load(checkpoint_path, &net, &opt, &first_epoch);
+    /* Only a missing file means a fresh start; training over any other failure would overwrite the checkpoint at the first save. */
+    if (loaded != CHECKPOINT_OK && loaded != CHECKPOINT_NOT_FOUND) {
+      fprintf(stderr, "Cannot resume from %s: %s%s%s\n", checkpoint_path, checkpoint_error(loaded),
+              loaded == CHECKPOINT_IO_ERROR ? ": " : "", loaded == CHECKPOINT_IO_ERROR ? strerror(errno) : "");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (loaded == CHECKPOINT_OK) {
+    if (net.layers[0].weights.column_size != MNIST_INPUTS || net.layers[net.number_of_layers - 1].neurons != MNIST_CLASSES) {
+      die("Checkpoint does not match the dataset");
+    }
+    /* The checkpoint's optimizer state replaces --optimizer, so a different explicit choice is an error, not silently dropped. */
+    const char* resumed_optimizer = optimizer_kind_name(opt.kind);
+    if (explicit_optimizer && strcmp(optimizer_name, resumed_optimizer) != 0) {
+      fprintf(stderr, "Checkpoint %s was trained with --optimizer %s, not %s; resume without --optimizer or with --optimizer %s\n",
+              checkpoint_path, resumed_optimizer, optimizer_name, resumed_optimizer);
+      exit(EXIT_FAILURE);
+    }
+    if (hogwild && opt.kind != OPTIMIZER_SGD) die("--hogwild needs plain SGD, but the checkpoint was trained with another optimizer");
+    printf("Resumed from %s after epoch %llu (optimizer %s)\n", checkpoint_path, (unsigned long long)first_epoch, resumed_optimizer);
+  } else {
+    net = create_network();
+    add_layer(&net, linear(MNIST_INPUTS, 128, "relu"));
+    add_layer(&net, linear(128, 64, "relu"));
+    add_layer(&net, linear(64, MNIST_CLASSES, "softmax"));
+    if (optimizer_init(&opt, optimizer_name, &net) != 0) die("Failed to set up optimizer");
+  }
   net.learning_rate = lr;
+  network_reserve(&net, batch_size);
+
+  /* Plain SGD keeps the fused update in back_propagate; anything else goes through the optimizer. */
+  if (opt.kind != OPTIMIZER_SGD) net.optimizer = &opt;
+
+  /*
+    --world N forks here, before any thread starts, so every rank begins from the same weights and
+    optimizer state. Only rank 0 evaluates, prints and writes checkpoints.
+  */
+  dist_trainer dist;
+  int rank = 0;
+  if (world > 1) {
+    rank = dist_launch(&dist, &net, world);
+    if (rank < 0) die("Failed to start training processes");
+    srand((unsigned)time(NULL) + 7919u * (unsigned)rank);
+  }
+  int leader = rank == 0;
+
+  /*
+    The in-process trainer steps every batch, except under --world (ranks use dist_step()) and
+    --hogwild: lock-free asynchronous SGD across --threads workers that build their own batches.
+  */
+  int synchronous = world == 1 && !hogwild;
+  parallel_trainer trainer;
+  if (synchronous && trainer_init(&trainer, &net, threads, accumulate, batch_size) != 0) die("Failed to start trainer");
+  hogwild_trainer hogwild_workers;
+  if (hogwild && hogwild_init(&hogwild_workers, &net, threads, batch_size) != 0) die("Failed to start Hogwild trainer");
+
+  /*
+    Test-set evaluation runs on its own threads through the inference path; all its buffers are allocated here.
+    Only the leader evaluates, so the other --world ranks skip it.
+  */
+  evaluator eval;
+  if (leader && evaluator_init(&eval, &net, eval_threads ? eval_threads : threads, batch_size, top_k) != 0) {
+    die("Failed to start evaluator");
+  }
+  eval_dataset test_set = stream_buffer ? (eval_dataset){NULL, test_images.data, test_labels.data, test_count}
+                                        : (eval_dataset){&test_data, NULL, NULL, test_count};
+  eval_result result;
+  eval_report report = {epochs};
+
+  /* --async-eval: evaluate a snapshot of each epoch's weights on a background thread while the next epoch trains. */
+  async_evaluator background_eval;
+  if (async_eval && leader && async_evaluator_init(&background_eval, &eval, &net, &test_set, print_eval, &report) != 0) {
+    die("Failed to start async evaluator");
+  }
 
-  add_layer(&net, linear(MNIST_INPUTS, 128, "relu"));
-  add_layer(&net, linear(128, 64, "relu"));
-  add_layer(&net, linear(64, MNIST_CLASSES, "softmax"));
+  uint32_t* train_idx = NULL;
+  uint32_t* shard_idx = NULL;  /* this rank's part of train_idx */
+  uint8_t* staging = NULL;
+  cached_batches train_cached;
+  streamed_batches train_streamed;
+  batch_builder build;
+  void* train_context;
+
+  if (stream_buffer) {
+    /* Staging area for the producer thread's training batches. */
+    staging = (uint8_t*)malloc((size_t)batch_size * (MNIST_INPUTS + 1));
+    if (!staging) die("malloc failed");
+
+    train_streamed = (streamed_batches){&train_shuffle, &train_images, &train_labels, staging,
+                                        staging + (size_t)batch_size * MNIST_INPUTS, batch_size};
+    build = build_streamed_batch;
+    train_context = &train_streamed;
+  } else {
+    train_idx = identity_index(train_count);
+    shard_idx = train_idx;
+    if (world > 1) {
+      /* Rank r trains on samples [r * shard, (r + 1) * shard); the last train_count % world are unused. */
+      train_count /= world;
+      shard_idx = train_idx + (uint64_t)rank * train_count;
+    }
+    train_cached = (cached_batches){&train_data, shard_idx, batch_size};
+    build = build_cached_batch;
+    train_context = &train_cached;
+  }
 
-  uint32_t* train_idx = (uint32_t*)malloc(sizeof(uint32_t) * TRAIN_SIZE);
-  if (!train_idx) die("malloc failed");
-  for (uint32_t i = 0; i < TRAIN_SIZE; i++) train_idx[i] = i;
+  /* Training batches are built one step ahead on the pipeline's producer thread (Hogwild workers build their own). */
+  batch_pipeline pipeline;
+  if (!hogwild && pipeline_init(&pipeline, build, train_context, MNIST_INPUTS, MNIST_CLASSES, batch_size) != 0) {
+    die("Failed to start batch pipeline");
+  }
 
-  uint32_t steps_per_epoch = (TRAIN_SIZE + batch_size - 1) / batch_size;
+  /* Ranks step in lockstep, so with --world every rank takes the same number of full batches. */
+  uint32_t steps_per_epoch = world > 1 ? train_count / batch_size : (train_count + batch_size - 1) / batch_size;
+  if (steps_per_epoch == 0) die("Too few training samples per rank for one batch");
+  uint64_t epoch_samples = world > 1 ? (uint64_t)steps_per_epoch * batch_size * world : train_count;
+
+  network_profile trace;
+  uint32_t traced_steps = 0;
+  if (trace_path) {
+    if (network_profile_init(&trace, net.number_of_layers) != 0 ||
+        network_profile_trace(&trace, TRACE_STEPS * (net.number_of_layers * PROFILE_PHASES + 8)) != 0) {
+      die("Failed to allocate trace");
+    }
+    net.profile = &trace;
+  }
 
-  for (uint32_t e = 0; e < epochs; e++) {
-    shuffle_u32(train_idx, TRAIN_SIZE);
+  for (uint32_t e = (uint32_t)first_epoch; e < epochs; e++) {
+    if (stream_buffer) {
+      if (idx_shuffle_reset(&train_shuffle) != 0) die("Failed to rewind train images");
+    } else {
+      shuffle_u32(shard_idx, train_count);
+    }
 
     double epoch_loss = 0.0;
+    double epoch_start = seconds_now();
+
+    if (hogwild) {
+      epoch_loss = hogwild_epoch(&hogwild_workers, build, train_context, steps_per_epoch) * steps_per_epoch;
+    } else {
+      pipeline_start(&pipeline, steps_per_epoch);
+      matrix x, y;
+      while (pipeline_next(&pipeline, &x, &y) == 0) {
+        double start = net.profile ? profile_now() : 0.0;
+        epoch_loss += synchronous ? trainer_step(&trainer, &x, &y) : dist_step(&dist, &x, &y);
+        if (net.profile) {
+          network_profile_span(net.profile, "train_step", start, profile_now());
+          if (++traced_steps == TRACE_STEPS) finish_trace(&net, trace_path);
+        }
+      }
+      if (synchronous) trainer_flush(&trainer);
+    }
 
-    for (uint32_t start = 0; start < TRAIN_SIZE; start += batch_size) {
-      uint32_t bs = batch_size;
-      if (start + bs > TRAIN_SIZE) bs = TRAIN_SIZE - start;
-
-      matrix x = create_matrix(MNIST_INPUTS, bs);
-      matrix y = create_matrix(MNIST_CLASSES, bs);
-
-      build_batch_inputs(&x, (const uint8_t* const*)train_image, train_label, train_idx, start, bs, &y);
-
-      matrix out = forward_pass(&net, &x);
-      epoch_loss += cross_entropy(&out, &y);
-
-      back_propagate(&net, &x, &y);
+    if (!leader) continue;
 
-      free_matrix(&x);
-      free_matrix(&y);
+    printf("epoch %u | loss %.6f | %.0f samples/s\n", e + 1, epoch_loss / (double)steps_per_epoch,
+           epoch_samples / (seconds_now() - epoch_start));
+    if (async_eval) {
+      async_evaluator_submit(&background_eval, &net, e + 1);
+    } else {
+      evaluator_run(&eval, &net, &test_set, &result);
+      print_eval(&report, e + 1, &result);
     }
 
-    printf("epoch %u | loss %.6f | test acc %.4f\n", e + 1, epoch_loss / (double)steps_per_epoch, eval_test_accuracy(&net, batch_size));
+    if (checkpoint_path && ((e + 1) % checkpoint_every == 0 || e + 1 == epochs)) {
+      if (checkpoint_save(checkpoint_path, &net, &opt, e + 1) != 0) {
+        fprintf(stderr, "Could not write checkpoint %s\n", checkpoint_path);
+      }
+    }
   }
 
+  if (async_eval && leader) async_evaluator_free(&background_eval);
+  if (net.profile) finish_trace(&net, trace_path);
+  if (trace_path) network_profile_free(&trace);
+  if (quantize_samples && leader) report_quantized(&net, quantize_samples);
+
+  if (!hogwild) pipeline_free(&pipeline);
+  if (hogwild) hogwild_free(&hogwild_workers);
+  if (synchronous) trainer_free(&trainer);
+  optimizer_free(&opt);
+  if (leader) evaluator_free(&eval);
+  free(staging);
   free(train_idx);
   free_network_memory(&net);
   free_mnist_data();
+  if (world > 1 && dist_finish(&dist) != 0) die("A training process failed");
   return 0;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include "matrix.h"
+#include "simd.h"
 
 /** Return a random double in [min, max). */
 double randfrom(double min, double max) {
@@ -9,14 +10,37 @@ double randfrom(double min, double max) {
   return min + (rand() / div);
 }
 
+static matrix_counters counters;
+
+/* A shared atomic add per event, so it is compiled in only when asked for (NN_COUNTERS). */
+static inline void count(uint64_t* counter, uint64_t n) {
+#ifdef NN_COUNTERS
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+  (void)counter;
+  (void)n;
+#endif
+}
+
+matrix_counters matrix_counters_read(void) {
+  matrix_counters c;
+  c.allocations = __atomic_load_n(&counters.allocations, __ATOMIC_RELAXED);
+  c.allocated_bytes = __atomic_load_n(&counters.allocated_bytes, __ATOMIC_RELAXED);
+  c.gemm_calls = __atomic_load_n(&counters.gemm_calls, __ATOMIC_RELAXED);
+  c.gemm_flops = __atomic_load_n(&counters.gemm_flops, __ATOMIC_RELAXED);
+  return c;
+}
+
 /** Allocate a row-major matrix (row_size x column_size), zero-initialized. */
 matrix create_matrix(uint64_t row_size, uint64_t column_size) {
   matrix mat;
+  count(&counters.allocations, 1);
+  count(&counters.allocated_bytes, row_size * column_size * sizeof(nn_real));
   mat.row_size = row_size;
   mat.column_size = column_size;
-  mat.array = calloc(mat.row_size * mat.column_size, sizeof(double));
+  mat.array = calloc(mat.row_size * mat.column_size, sizeof(nn_real));
   if (!mat.array) {
-    printf("Failed to allocate memory for matrix of size (%llu, %llu)\n", row_size, column_size);
+    printf("Failed to allocate memory for matrix of size (%llu, %llu)\n", (unsigned long long)row_size, (unsigned long long)column_size);
   }
   return mat;
 }
@@ -26,10 +50,62 @@ void free_matrix(matrix* mat) {
   free(mat->array);
 }
 
-/** Matrix multiply wrapper around cblas_dgemm; returns a newly-allocated matrix. */
-matrix matrix_m_multiply(matrix* A, matrix* B, matrix* C, double alpha, double beta, uint8_t tranpose) {
-  uint8_t t1 = CblasNoTrans;
-  uint8_t t2 = CblasNoTrans;
+/* Arena allocations are rounded up to a whole 64-byte cache line. */
+#define ARENA_ALIGN_ELEMENTS (64 / sizeof(nn_real))
+
+/** Number of elements arena_matrix() reserves for a (row_size x column_size) matrix, padding included. */
+uint64_t arena_matrix_size(uint64_t row_size, uint64_t column_size) {
+  uint64_t n = row_size * column_size;
+  return (n + ARENA_ALIGN_ELEMENTS - 1) / ARENA_ALIGN_ELEMENTS * ARENA_ALIGN_ELEMENTS;
+}
+
+/** Allocate a zeroed arena holding 'capacity' elements. Returns 0 on success, nonzero on failure. */
+int arena_init(matrix_arena* arena, uint64_t capacity) {
+  arena->used = 0;
+  arena->capacity = arena_matrix_size(capacity, 1);
+  count(&counters.allocations, 1);
+  count(&counters.allocated_bytes, arena->capacity * sizeof(nn_real));
+  arena->base = aligned_alloc(ARENA_ALIGN_ELEMENTS * sizeof(nn_real), arena->capacity * sizeof(nn_real));
+  if (!arena->base) {
+    arena->capacity = 0;
+    return 1;
+  }
+  memset(arena->base, 0, arena->capacity * sizeof(nn_real));
+  return 0;
+}
+
+/** Carve a (row_size x column_size) matrix out of the arena. Aborts if the arena is exhausted. */
+matrix arena_matrix(matrix_arena* arena, uint64_t row_size, uint64_t column_size) {
+  uint64_t n = arena_matrix_size(row_size, column_size);
+  if (arena->used + n > arena->capacity) {
+    printf("Arena exhausted allocating matrix of size (%llu, %llu)\n", (unsigned long long)row_size, (unsigned long long)column_size);
+    exit(EXIT_FAILURE);
+  }
+  matrix mat;
+  mat.row_size = row_size;
+  mat.column_size = column_size;
+  mat.array = arena->base + arena->used;
+  arena->used += n;
+  return mat;
+}
+
+/** Hand the whole arena back without releasing its storage. */
+void arena_reset(matrix_arena* arena) {
+  arena->used = 0;
+}
+
+/** Release the arena's storage. Safe to call on a zeroed arena. */
+void arena_free(matrix_arena* arena) {
+  free(arena->base);
+  arena->base = NULL;
+  arena->capacity = 0;
+  arena->used = 0;
+}
+
+/** BLAS gemm directly into C: C = alpha*op(A)*op(B) + beta*C. */
+void gemm_into(matrix* A, matrix* B, matrix* C, double alpha, double beta, uint8_t tranpose) {
+  enum CBLAS_TRANSPOSE t1 = CblasNoTrans;
+  enum CBLAS_TRANSPOSE t2 = CblasNoTrans;
   uint64_t M = C->row_size;
   uint64_t N = C->column_size;
   uint64_t K = 0;
@@ -56,90 +132,124 @@ matrix matrix_m_multiply(matrix* A, matrix* B, matrix* C, double alpha, double b
     K = A->row_size;
   }
 
-  matrix C_copy = create_matrix(C->row_size, C->column_size);
-  memcpy(C_copy.array, C->array, C->row_size * C->column_size * sizeof(double));
-
-  cblas_dgemm(
+  count(&counters.gemm_calls, 1);
+  count(&counters.gemm_flops, 2 * M * N * K);
+  NN_CBLAS(gemm)(
     CblasRowMajor, t1, t2,
     M, N, K,
     alpha,
     A->array, A->column_size,
     B->array, B->column_size,
     beta,
-    C_copy.array, C->column_size
+    C->array, C->column_size
   );
+}
 
+/** Matrix multiply wrapper around BLAS gemm; returns a newly-allocated matrix. */
+matrix matrix_m_multiply(matrix* A, matrix* B, matrix* C, double alpha, double beta, uint8_t tranpose) {
+  matrix C_copy = create_matrix(C->row_size, C->column_size);
+  memcpy(C_copy.array, C->array, C->row_size * C->column_size * sizeof(nn_real));
+  gemm_into(A, B, &C_copy, alpha, beta, tranpose);
   return C_copy;
 }
 
-/** Compute A*B + bias (C interpreted as bias vector). Returns a newly-allocated matrix. */
-matrix matrix_v_multiply(matrix* A, matrix* B, matrix* C, double alpha, double beta) {
+/** out = alpha*A*B + beta*bias, with the (rows x 1) bias broadcast across columns. */
+void matrix_v_multiply_into(matrix* A, matrix* B, matrix* bias, matrix* out, double alpha, double beta) {
   assert(A->column_size == B->row_size);
-  assert(A->row_size == C->row_size);
-
-  matrix temp = create_matrix(A->row_size, B->column_size);
-  matrix m = matrix_m_multiply(A, B, &temp, alpha, 1.0, 0);
-  free_matrix(&temp);
-
-  for (int i = 0; i < m.row_size; i++) {
-    for (int j = 0; j < m.column_size; j++) {
-      m.array[i * m.column_size + j] += beta * C->array[i];
+  assert(A->row_size == bias->row_size && out->row_size == A->row_size);
+
+  /* Seed out with the broadcast bias and let gemm accumulate onto it (beta = 1). */
+  for (uint64_t i = 0; i < out->row_size; i++) {
+    nn_real b = (nn_real)(beta * bias->array[i]);
+    nn_real* row = out->array + i * out->column_size;
+    for (uint64_t j = 0; j < out->column_size; j++) {
+      row[j] = b;
     }
   }
+
+  gemm_into(A, B, out, alpha, 1.0, 0);
+}
+
+/** Compute A*B + bias (C interpreted as bias vector). Returns a newly-allocated matrix. */
+matrix matrix_v_multiply(matrix* A, matrix* B, matrix* C, double alpha, double beta) {
+  matrix m = create_matrix(A->row_size, B->column_size);
+  matrix_v_multiply_into(A, B, C, &m, alpha, beta);
   return m;
 }
 
+/** out = A .* B elementwise; out may alias A or B. */
+void hadamard_into(matrix* A, matrix* B, matrix* out) {
+  assert(A->row_size == B->row_size && A->column_size == B->column_size);
+  assert(A->row_size == out->row_size && A->column_size == out->column_size);
+  simd_mul(A->array, B->array, out->array, A->row_size * A->column_size);
+}
+
 /** Elementwise multiply A and B. Returns a newly-allocated matrix. */
 matrix hadamard(matrix* A, matrix* B) {
-  assert(A->row_size == B->row_size && A->column_size == B->column_size);
   matrix C = create_matrix(A->row_size, A->column_size);
-  for (int i = 0; i < A->row_size * A->column_size; i++) {
-    C.array[i] = A->array[i] * B->array[i];
-  }
+  hadamard_into(A, B, &C);
   return C;
 }
 
 /** In-place subtraction A -= B. */
 void matrix_subtract(matrix* A, matrix* B) {
   assert(A->row_size == B->row_size && A->column_size == B->column_size);
-  for (int i = 0; i < A->row_size * A->column_size; i++) {
-    A->array[i] = A->array[i] - B->array[i];
-  }
+  simd_sub(A->array, B->array, A->array, A->row_size * A->column_size);
+}
+
+/** Y += alpha*X (BLAS axpy over the whole matrix). */
+void axpy(matrix* Y, matrix* X, double alpha) {
+  assert(Y->row_size == X->row_size && Y->column_size == X->column_size);
+  NN_CBLAS(axpy)((int)(Y->row_size * Y->column_size), alpha, X->array, 1, Y->array, 1);
+}
+
+/** In-place A *= scale. */
+void matrix_scale_inplace(matrix* A, double scale) {
+  NN_CBLAS(scal)((int)(A->row_size * A->column_size), scale, A->array, 1);
 }
 
 /** Return a newly-allocated copy of A scaled by 'scale'. */
 matrix matrix_scale(matrix* A, double scale) {
   matrix A_copy = create_matrix(A->row_size, A->column_size);
-  memcpy(A_copy.array, A->array, A->row_size * A->column_size * sizeof(double));
-  cblas_dscal((int)(A_copy.row_size * A_copy.column_size), scale, A_copy.array, 1);
+  memcpy(A_copy.array, A->array, A->row_size * A->column_size * sizeof(nn_real));
+  matrix_scale_inplace(&A_copy, scale);
   return A_copy;
 }
 
 /** Print (row_size, column_size). */
 void shape(matrix* mat) {
-  printf("(%llu, %llu)\n", mat->row_size, mat->column_size);
+  printf("(%llu, %llu)\n", (unsigned long long)mat->row_size, (unsigned long long)mat->column_size);
+}
+
+/** out = alpha*sum(A across columns) + beta*out; out is (row_size x 1). */
+void row_sum_into(matrix* A, matrix* out, double alpha, double beta) {
+  assert(out->row_size == A->row_size && out->column_size == 1);
+  for (uint64_t i = 0; i < A->row_size; i++) {
+    const nn_real* row = A->array + i * A->column_size;
+    nn_real sum = 0;
+    for (uint64_t j = 0; j < A->column_size; j++) {
+      sum += row[j];
+    }
+    out->array[i] = (nn_real)(alpha * sum + (beta == 0.0 ? 0.0 : beta * out->array[i]));
+  }
 }
 
 /** Row-sum reduction over columns; returns (row_size x 1). */
 matrix row_sum(matrix* A) {
-  matrix B = create_matrix(A->column_size, 1);
   matrix C = create_matrix(A->row_size, 1);
-  set_matrix(&B, 1);
-  cblas_dgemv(CblasRowMajor, CblasNoTrans, A->row_size, A->column_size, 1.0, A->array, A->column_size, B.array, 1, 1.0, C.array, 1);
-  free_matrix(&B);
+  row_sum_into(A, &C, 1.0, 0.0);
   return C;
 }
 
 /** Fill matrix with random values in [min, max). */
 void fill_matrix(matrix* mat, double min, double max) {
-  for (int i = 0; i < mat->row_size * mat->column_size; i++) {
+  /* rand() is sequential, so this stays a scalar loop. */
+  for (uint64_t i = 0; i < mat->row_size * mat->column_size; i++) {
     mat->array[i] = randfrom(min, max);
   }
 }
 
 /** Fill matrix with a constant value. */
 void set_matrix(matrix* mat, double val) {
-  for (int i = 0; i < mat->row_size * mat->column_size; i++) {
-    mat->array[i] = val;
-  }
+  simd_fill(mat->array, (nn_real)val, mat->row_size * mat->column_size);
 }
\ No newline at end of file
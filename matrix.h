@@ -5,26 +5,63 @@
 #include <stdint.h>
 #include <string.h>
 
-#if defined(__has_include)
-  #if __has_include(<cblas.h>)
-    #include <cblas.h>
-  #elif __has_include(<vecLib/cblas.h>)
-    #include <vecLib/cblas.h>
-  #elif __has_include(<Accelerate/Accelerate.h>)
-    #include <Accelerate/Accelerate.h>
+/*
+  Element type for all matrix storage. Defining NN_FLOAT32 switches the whole stack (storage,
+  BLAS calls, batch inputs) to single precision; scalars such as alpha, beta, the learning rate
+  and reported losses stay double either way.
+  NN_CBLAS(gemm) expands to cblas_sgemm or cblas_dgemm to match, or to the built-in nn_gemm
+  (gemm.h) when NN_BUILTIN_BLAS is defined.
+*/
+#ifdef NN_FLOAT32
+  typedef float nn_real;
+#else
+  typedef double nn_real;
+#endif
+
+#if defined(NN_BUILTIN_BLAS)
+  #include "gemm.h"
+  #define NN_CBLAS(name) nn_##name
+#else
+  #if defined(__has_include)
+    #if __has_include(<cblas.h>)
+      #include <cblas.h>
+    #elif __has_include(<mkl_cblas.h>)
+      #include <mkl_cblas.h>
+    #elif __has_include(<vecLib/cblas.h>)
+      #include <vecLib/cblas.h>
+    #elif __has_include(<Accelerate/Accelerate.h>)
+      #include <Accelerate/Accelerate.h>
+    #else
+      #include <cblas.h>
+    #endif
   #else
     #include <cblas.h>
   #endif
-#else
-  #include <cblas.h>
+
+  #ifdef NN_FLOAT32
+    #define NN_CBLAS(name) cblas_s##name
+  #else
+    #define NN_CBLAS(name) cblas_d##name
+  #endif
 #endif
 
 typedef struct {
   uint64_t row_size;
   uint64_t column_size;
-  double* array;
+  nn_real* array;
 } matrix;
 
+/**
+ * Bump allocator that hands out matrices carved from one pre-sized block.
+ * Every matrix handed out starts on a 64-byte boundary. Matrices obtained from
+ * an arena must not be passed to free_matrix(); release the arena instead.
+ */
+typedef struct {
+  nn_real* base;
+  uint64_t capacity; /* in elements */
+  uint64_t used;     /* in elements */
+} matrix_arena;
+
 /** Return a random double in [min, max). */
 double randfrom(double min, double max);
 
@@ -34,8 +71,23 @@ matrix create_matrix(uint64_t row_size, uint64_t column_size);
 /** Free the heap storage for a matrix (does not free the struct itself). */
 void free_matrix(matrix* mat);
 
+/** Number of elements arena_matrix() reserves for a (row_size x column_size) matrix, padding included. */
+uint64_t arena_matrix_size(uint64_t row_size, uint64_t column_size);
+
+/** Allocate a zeroed arena holding 'capacity' elements. Returns 0 on success, nonzero on failure. */
+int arena_init(matrix_arena* arena, uint64_t capacity);
+
+/** Carve a (row_size x column_size) matrix out of the arena. Aborts if the arena is exhausted. */
+matrix arena_matrix(matrix_arena* arena, uint64_t row_size, uint64_t column_size);
+
+/** Hand the whole arena back without releasing its storage. */
+void arena_reset(matrix_arena* arena);
+
+/** Release the arena's storage. Safe to call on a zeroed arena. */
+void arena_free(matrix_arena* arena);
+
 /**
- * Matrix multiply wrapper around cblas_dgemm.
+ * Matrix multiply wrapper around BLAS gemm (cblas_dgemm, or cblas_sgemm under NN_FLOAT32).
  * IMPORTANT: this returns a newly-allocated matrix (it does not write into C).
  * tranpose:
  *   0: C = alpha*A*B + beta*C
@@ -69,4 +121,43 @@ void set_matrix(matrix* mat, double val);
 /** Print (row_size, column_size). */
 void shape(matrix* mat);
 
+/*
+  Output-parameter variants. These write into caller-provided storage and never allocate;
+  the value-returning operations above are thin wrappers around them.
+*/
+
+/** BLAS gemm directly into C: C = alpha*op(A)*op(B) + beta*C, with 'tranpose' as in matrix_m_multiply. */
+void gemm_into(matrix* A, matrix* B, matrix* C, double alpha, double beta, uint8_t tranpose);
+
+/** out = alpha*A*B + beta*bias, with the (rows x 1) bias broadcast across columns (written first, then gemm with beta=1). */
+void matrix_v_multiply_into(matrix* A, matrix* B, matrix* bias, matrix* out, double alpha, double beta);
+
+/** out = A .* B elementwise; out may alias A or B. */
+void hadamard_into(matrix* A, matrix* B, matrix* out);
+
+/** Y += alpha*X (BLAS axpy over the whole matrix). */
+void axpy(matrix* Y, matrix* X, double alpha);
+
+/** In-place A *= scale. */
+void matrix_scale_inplace(matrix* A, double scale);
+
+/** out = alpha*sum(A across columns) + beta*out; out is (row_size x 1). */
+void row_sum_into(matrix* A, matrix* out, double alpha, double beta);
+
+/**
+ * Process-wide operation counters: heap allocations made by create_matrix() and arena_init(),
+ * and the gemm_into() calls and FLOPs (2*M*N*K each). Only counted in builds with NN_COUNTERS
+ * defined (train_bench always, the other binaries with -DNN_COUNTERS=ON); otherwise the hooks
+ * compile to nothing and every counter reads 0. Take a snapshot before and after a region and
+ * subtract.
+ */
+typedef struct {
+  uint64_t allocations;
+  uint64_t allocated_bytes;
+  uint64_t gemm_calls;
+  uint64_t gemm_flops;
+} matrix_counters;
+
+matrix_counters matrix_counters_read(void);
+
 #endif
\ No newline at end of file
@@ -6,6 +6,9 @@
 #include <float.h>
 
 #include "neural_network.h"
+#include "optimizer.h"
+#include "simd.h"
+#include "profile.h"
 
 void print(matrix m) {
   for(uint64_t i = 0; i < m.row_size; i++) {
@@ -17,39 +20,55 @@ void print(matrix m) {
   printf("\n");
 }
 
+void relu_into(matrix* z, matrix* out) {
+  assert(z->row_size == out->row_size && z->column_size == out->column_size);
+  simd_relu(z->array, out->array, z->row_size * z->column_size);
+}
+
 matrix relu(matrix* activations) {
   matrix activated_matrix = create_matrix(activations->row_size, activations->column_size);
-  for(uint64_t i = 0; i < activations->row_size * activations->column_size; i++) {
-    activated_matrix.array[i] = MAX(0, activations->array[i]);
-  }
+  relu_into(activations, &activated_matrix);
   return activated_matrix;
 }
 
-matrix softmax(matrix* z) {
-  /* softmax over rows, per column (sample) */
-  matrix out = create_matrix(z->row_size, z->column_size);
+/* softmax_into handles this many columns at a time, keeping their running max and sum on the stack. */
+#define SOFTMAX_BLOCK 256
+
+void softmax_into(matrix* z, matrix* out) {
+  /*
+    softmax over rows, per column (sample). A row is contiguous across the columns, so a block
+    of columns is processed a row at a time with vector kernels rather than striding down each
+    column: running max, then exp(z - max) with the column sums, then the scale by 1/sum.
+  */
+  assert(z->row_size == out->row_size && z->column_size == out->column_size);
+  uint64_t rows = z->row_size, cols = z->column_size;
+  nn_real mx[SOFTMAX_BLOCK];
+  nn_real sum[SOFTMAX_BLOCK];
+
+  for(uint64_t c0 = 0; c0 < cols; c0 += SOFTMAX_BLOCK) {
+    uint64_t w = (cols - c0 < SOFTMAX_BLOCK) ? cols - c0 : SOFTMAX_BLOCK;
 
-  for(uint64_t col = 0; col < z->column_size; col++) {
     /* max for stability */
-    double mx = z->array[col];
-    for(uint64_t i = 1; i < z->row_size; i++) {
-      double v = z->array[i * z->column_size + col];
-      if(v > mx) mx = v;
+    memcpy(mx, z->array + c0, w * sizeof(nn_real));
+    for(uint64_t i = 1; i < rows; i++) {
+      simd_max(mx, z->array + i * cols + c0, mx, w);
     }
 
-    double sum = 0.0;
-    for(uint64_t i = 0; i < z->row_size; i++) {
-      double e = exp(z->array[i * z->column_size + col] - mx);
-      out.array[i * out.column_size + col] = e;
-      sum += e;
+    simd_fill(sum, 0, w);
+    for(uint64_t i = 0; i < rows; i++) {
+      simd_exp_sub_accumulate(z->array + i * cols + c0, mx, out->array + i * cols + c0, sum, w);
     }
 
-    double inv = (sum > 0.0) ? (1.0 / sum) : 0.0;
-    for(uint64_t i = 0; i < z->row_size; i++) {
-      out.array[i * out.column_size + col] *= inv;
+    for(uint64_t k = 0; k < w; k++) sum[k] = (sum[k] > 0) ? 1 / sum[k] : 0;
+    for(uint64_t i = 0; i < rows; i++) {
+      simd_mul(out->array + i * cols + c0, sum, out->array + i * cols + c0, w);
     }
   }
+}
 
+matrix softmax(matrix* z) {
+  matrix out = create_matrix(z->row_size, z->column_size);
+  softmax_into(z, &out);
   return out;
 }
 
@@ -73,30 +92,30 @@ double cross_entropy(matrix* p, matrix* y_true) {
   return sum / (double)p->column_size;
 }
 
-matrix cross_entropy_prime(matrix* p, matrix* y_true) {
+void cross_entropy_prime_into(matrix* p, matrix* y_true, matrix* out) {
   assert(p->row_size == y_true->row_size && p->column_size == y_true->column_size);
+  assert(p->row_size == out->row_size && p->column_size == out->column_size);
 
+  simd_sub(p->array, y_true->array, out->array, p->row_size * p->column_size);
+}
+
+matrix cross_entropy_prime(matrix* p, matrix* y_true) {
   matrix out = create_matrix(p->row_size, p->column_size);
-  for(uint64_t i = 0; i < p->row_size * p->column_size; i++) {
-    out.array[i] = p->array[i] - y_true->array[i];
-  }
+  cross_entropy_prime_into(p, y_true, &out);
   return out;
 }
 
-matrix relu_prime(matrix* activations) {
-  matrix relu_prime_matrix = create_matrix(activations->row_size, activations->column_size);
-  for(uint64_t i = 0; i < activations->row_size * activations->column_size; i++) {
-    relu_prime_matrix.array[i] = (activations->array[i] > 0.0) ? 1.0 : 0.0;
-  }
-  return relu_prime_matrix;
+void relu_prime_into(matrix* z, matrix* out) {
+  assert(z->row_size == out->row_size && z->column_size == out->column_size);
+  simd_relu_prime(z->array, out->array, z->row_size * z->column_size);
 }
 
 activation_function get_activation(char* activation) {
   if(strcmp(activation, "relu") == 0) {
-    return relu;
+    return relu_into;
   }
   else if(strcmp(activation, "softmax") == 0) {
-    return softmax;
+    return softmax_into;
   }
   else {
     printf("%s is not a valid activation function.\n", activation);
@@ -106,7 +125,7 @@ activation_function get_activation(char* activation) {
 
 activation_function get_derivative_activation(char* activation) {
   if(strcmp(activation, "relu") == 0) {
-    return relu_prime;
+    return relu_prime_into;
   }
   else if(strcmp(activation, "softmax") == 0) {
     /*
@@ -114,7 +133,7 @@ activation_function get_derivative_activation(char* activation) {
         - softmax + cross-entropy on the output layer
         - cross_entropy_prime() handles the gradient, so this isn't used in that case
     */
-    return softmax;
+    return softmax_into;
   }
   else {
     printf("%s is not a valid activation function.\n", activation);
@@ -123,129 +142,397 @@ activation_function get_derivative_activation(char* activation) {
 }
 
 neural_network create_network() {
-  neural_network network = {.number_of_layers = 0, .layers = NULL, .learning_rate = 0.01};
+  neural_network network = {.number_of_layers = 0, .layers = NULL, .learning_rate = 0.01, .optimizer = NULL};
+  memset(&network.parameters, 0, sizeof(network.parameters));
+  memset(&network.gradients, 0, sizeof(network.gradients));
+  memset(&network.workspace, 0, sizeof(network.workspace));
+  network.max_batch = 0;
   return network;
 }
 
+/* Elements a layer takes in the parameter (and gradient) block, padding included. */
+static uint64_t layer_parameters(const layer* l) {
+  return arena_matrix_size(l->weights.row_size, l->weights.column_size) + arena_matrix_size(l->biases.row_size, 1);
+}
+
+/*
+  Point every layer's weights/biases at its slot in the parameter block, and its dW/db at the
+  same slot in the gradient block once that is large enough.
+*/
+static void bind_views(neural_network* network) {
+  int gradients = network->gradients.capacity >= network->parameters.used;
+  uint64_t offset = 0;
+  for(int i = 0; i < network->number_of_layers; i++) {
+    layer* l = &network->layers[i];
+    uint64_t bias_offset = offset + arena_matrix_size(l->weights.row_size, l->weights.column_size);
+    l->weights.array = network->parameters.base + offset;
+    l->biases.array = network->parameters.base + bias_offset;
+    if(gradients) {
+      l->dW = (matrix){.row_size = l->weights.row_size, .column_size = l->weights.column_size,
+                       .array = network->gradients.base + offset};
+      l->db = (matrix){.row_size = l->biases.row_size, .column_size = 1, .array = network->gradients.base + bias_offset};
+    }
+    offset += layer_parameters(l);
+  }
+}
+
+/* Grow the parameter block to hold at least 'needed' elements, keeping its contents. */
+static void grow_parameters(neural_network* network, uint64_t needed) {
+  matrix_arena grown;
+  uint64_t capacity = 2 * network->parameters.capacity;
+  if(arena_init(&grown, capacity > needed ? capacity : needed) != 0) {
+    printf("Failed to allocate %llu parameters\n", (unsigned long long)needed);
+    exit(EXIT_FAILURE);
+  }
+  if(network->parameters.used) {
+    memcpy(grown.base, network->parameters.base, network->parameters.used * sizeof(nn_real));
+  }
+  grown.used = network->parameters.used;
+  arena_free(&network->parameters);
+  network->parameters = grown;
+}
+
 void add_layer(neural_network* network, layer l) {
-  network->layers = realloc(network->layers, ++network->number_of_layers * sizeof(layer));
-  if(!network->layers) {
-    printf("Failed to reallocate memory for %huth layer\n", network->number_of_layers);
+  if(network->number_of_layers == UINT16_MAX) {
+    printf("A network holds at most %u layers\n", (unsigned)UINT16_MAX);
     exit(EXIT_FAILURE);
   }
-  network->layers[network->number_of_layers - 1] = l;
+  if(network->number_of_layers == network->layer_capacity) {
+    uint32_t doubled = network->layer_capacity ? 2u * network->layer_capacity : 4u;
+    uint16_t capacity = doubled > UINT16_MAX ? UINT16_MAX : (uint16_t)doubled;
+    layer* layers = realloc(network->layers, capacity * sizeof(layer));
+    if(!layers) {
+      printf("Failed to reallocate memory for %huth layer\n", (uint16_t)(network->number_of_layers + 1));
+      exit(EXIT_FAILURE);
+    }
+    network->layers = layers;
+    network->layer_capacity = capacity;
+  }
+
+  if(network->borrowed_parameters) {
+    /* The owner of the borrowed block has laid this layer out already; there is nothing to move. */
+    assert(!l.weights.array && !l.biases.array);
+    network->parameters.used += layer_parameters(&l);
+    network->parameters.capacity = network->parameters.used;
+  } else {
+    /* Move the weights and biases into the parameter block. */
+    uint64_t needed = network->parameters.used + layer_parameters(&l);
+    if(needed > network->parameters.capacity) grow_parameters(network, needed);
+    matrix weights = arena_matrix(&network->parameters, l.weights.row_size, l.weights.column_size);
+    matrix biases = arena_matrix(&network->parameters, l.biases.row_size, 1);
+    if(l.weights.array) {
+      memcpy(weights.array, l.weights.array, weights.row_size * weights.column_size * sizeof(nn_real));
+      free_matrix(&l.weights);
+    }
+    if(l.biases.array) {
+      memcpy(biases.array, l.biases.array, biases.row_size * sizeof(nn_real));
+      free_matrix(&l.biases);
+    }
+    l.weights = weights;
+    l.biases = biases;
+  }
+
+  network->layers[network->number_of_layers++] = l;
+  bind_views(network);
+
+  /* Give the new layer its workspace and gradient views if the network was already sized. */
+  if(network->max_batch) {
+    network_reserve(network, network->max_batch);
+  }
 
 #ifdef NN_DEBUG
   printf("Weights %d: \n", network->number_of_layers);
-  print(l.weights);
+  print(network->layers[network->number_of_layers - 1].weights);
   printf("Biases %d: \n", network->number_of_layers);
-  print(l.biases);
+  print(network->layers[network->number_of_layers - 1].biases);
 #endif
 }
 
+int network_clone(neural_network* out, const neural_network* src) {
+  *out = create_network();
+  out->learning_rate = src->learning_rate;
+  out->layers = malloc((src->number_of_layers ? src->number_of_layers : 1) * sizeof(layer));
+  if(!out->layers) return 1;
+  memcpy(out->layers, src->layers, src->number_of_layers * sizeof(layer));
+  out->number_of_layers = src->number_of_layers;
+  out->layer_capacity = src->number_of_layers;
+
+  if(arena_init(&out->parameters, src->parameters.used) != 0) {
+    free_network_memory(out);
+    return 2;
+  }
+  out->parameters.used = src->parameters.used;
+  for(int i = 0; i < out->number_of_layers; i++) {
+    layer* l = &out->layers[i];
+    memset(&l->zs, 0, sizeof(matrix));
+    memset(&l->activations, 0, sizeof(matrix));
+    memset(&l->deltas, 0, sizeof(matrix));
+    memset(&l->dW, 0, sizeof(matrix));
+    memset(&l->db, 0, sizeof(matrix));
+  }
+  bind_views(out);
+  return 0;
+}
+
+void network_borrow_parameters(neural_network* network, nn_real* parameters) {
+  uint64_t used = network->parameters.used;
+  if(!network->borrowed_parameters) arena_free(&network->parameters);
+  network->parameters = (matrix_arena){.base = parameters, .capacity = used, .used = used};
+  network->borrowed_parameters = 1;
+  bind_views(network);
+}
+
+void network_reserve(neural_network* network, uint64_t max_batch) {
+  uint64_t max_neurons = 0, total = 0;
+
+  for(int i = 0; i < network->number_of_layers; i++) {
+    layer* l = &network->layers[i];
+    if(l->neurons > max_neurons) max_neurons = l->neurons;
+    total += (l->forward ? 2 : 3) * arena_matrix_size(l->neurons, max_batch);
+  }
+  total += arena_matrix_size(max_neurons, max_batch);
+
+  arena_free(&network->workspace);
+  if(arena_init(&network->workspace, total) != 0) {
+    printf("Failed to allocate workspace for batch size %llu\n", (unsigned long long)max_batch);
+    exit(EXIT_FAILURE);
+  }
+  network->max_batch = max_batch;
+
+  for(int i = 0; i < network->number_of_layers; i++) {
+    layer* l = &network->layers[i];
+    l->activations = arena_matrix(&network->workspace, l->neurons, max_batch);
+    l->zs = l->forward ? l->activations : arena_matrix(&network->workspace, l->neurons, max_batch);
+    l->deltas = arena_matrix(&network->workspace, l->neurons, max_batch);
+  }
+  network->scratch = arena_matrix(&network->workspace, max_neurons, max_batch);
+
+  /* The gradient block is kept across batch sizes; it only grows with the parameters. */
+  if(network->gradients.capacity < network->parameters.used) {
+    arena_free(&network->gradients);
+    if(arena_init(&network->gradients, network->parameters.used) != 0) {
+      printf("Failed to allocate gradients for %llu parameters\n", (unsigned long long)network->parameters.used);
+      exit(EXIT_FAILURE);
+    }
+  }
+  network->gradients.used = network->parameters.used;
+  bind_views(network);
+}
+
+/* deltas *= relu'(z), reading the mask off the activations: relu(z) > 0 exactly where z > 0. */
+static void relu_backward(matrix* activations, matrix* deltas) {
+  assert(activations->row_size == deltas->row_size && activations->column_size == deltas->column_size);
+  simd_relu_mask(activations->array, deltas->array, deltas->row_size * deltas->column_size);
+}
+
+/* Reshape a workspace buffer to (rows x cols); the storage must already be large enough. */
+static matrix view(matrix* storage, uint64_t rows, uint64_t cols) {
+  matrix m = {.row_size = rows, .column_size = cols, .array = storage->array};
+  return m;
+}
+
+/* Phase timing into network->profile; both are no-ops when profiling is off. */
+static double phase_start(const neural_network* network) {
+  return network->profile ? profile_now() : 0.0;
+}
+
+static void phase_end(const neural_network* network, int layer, profile_phase phase, double start, double flops) {
+  if(network->profile) network_profile_add(network->profile, (uint16_t)layer, phase, start, profile_now(), flops);
+}
+
+/* FLOPs of one pass of a layer's weights over the batch: 2 * neurons * inputs * batch. */
+static double gemm_flops(const layer* l, uint64_t batch) {
+  return 2.0 * (double)l->weights.row_size * (double)l->weights.column_size * (double)batch;
+}
+
 matrix forward_pass(neural_network* network, matrix* inputs) {
+  uint64_t batch = inputs->column_size;
+  if(batch > network->max_batch) {
+    network_reserve(network, batch);
+  }
+
   matrix last_activations = *inputs;
 
   for(int i = 0; i < network->number_of_layers; i++) {
-    /* free cached matrices from the previous forward pass */
-    if(network->layers[i].zs.array) {
-      free_matrix(&network->layers[i].zs);
-    }
-    if(network->layers[i].activations.array) {
-      free_matrix(&network->layers[i].activations);
-    }
+    layer* l = &network->layers[i];
 
 #ifdef NN_DEBUG
     printf("Inputs: \n");
     print(*inputs);
 #endif
 
-    matrix z = network->layers[i].z(&network->layers[i], &last_activations);
-    network->layers[i].zs = z;
-
-    matrix a = network->layers[i].a(&z);
-    network->layers[i].activations = a;
+    l->zs = view(&l->zs, l->neurons, batch);
+    l->activations = view(&l->activations, l->neurons, batch);
+    l->deltas = view(&l->deltas, l->neurons, batch);
+
+    /* A fused forward is z then a in place (zs aliases activations), so profiling splits it into those. */
+    if(l->forward && !network->profile) {
+      l->forward(l, &last_activations);
+    } else {
+      double t = phase_start(network);
+      l->z(l, &last_activations, &l->zs);
+      phase_end(network, i, PROFILE_FORWARD_GEMM, t, gemm_flops(l, batch));
+      t = phase_start(network);
+      l->a(&l->zs, &l->activations);
+      phase_end(network, i, PROFILE_ACTIVATION, t, 0.0);
+    }
 
-    last_activations = a;
+    last_activations = l->activations;
 
 #ifdef NN_DEBUG
     printf("Z_%d:\n", i + 1);
-    print(z);
+    print(l->zs);
     printf("A_%d:\n", i + 1);
-    print(a);
+    print(l->activations);
 #endif
   }
 
   return last_activations;
 }
 
-void back_propagate(neural_network* network, matrix* inputs, matrix* y_true) {
+/* What backward() does with each layer's gradient. */
+enum backward_mode {
+  BACKWARD_SGD_STEP,          /* W -= lr/batch * dW straight into the weights; dW never materialized */
+  BACKWARD_WRITE_GRADIENTS,   /* dW/db = batch gradient */
+  BACKWARD_ACCUMULATE         /* dW/db += batch gradient */
+};
+
+static void backward(neural_network* network, matrix* inputs, matrix* y_true, enum backward_mode mode) {
   assert(network->number_of_layers > 0);
 
   int last = (int)network->number_of_layers - 1;
   layer* l = &network->layers[last];
 
-  uint16_t batch_size = (uint16_t)l->activations.column_size;
+  uint64_t batch_size = l->activations.column_size;
   double scale_factor = network->learning_rate / (double)batch_size;
 
-  matrix delta;
-  matrix dC_da;
-  matrix da_dz;
-
   /* Output-layer delta */
-  if(l->a == softmax) {
-    dC_da = cross_entropy_prime(&l->activations, y_true);
-    delta = dC_da; /* reuse the allocated buffer */
+  double t = phase_start(network);
+  if(l->a == softmax_into) {
+    cross_entropy_prime_into(&l->activations, y_true, &l->deltas);
   } else {
-    dC_da = l2cost_prime(&l->activations, y_true);
-    da_dz = l->a_prime(&l->zs);
-    delta = hadamard(&dC_da, &da_dz);
-    free_matrix(&dC_da);
-    free_matrix(&da_dz);
+    matrix da_dz = view(&network->scratch, l->neurons, batch_size);
+    l2cost_prime_into(&l->activations, y_true, &l->deltas);
+    l->a_prime(&l->zs, &da_dz);
+    hadamard_into(&l->deltas, &da_dz, &l->deltas);
   }
+  phase_end(network, last, PROFILE_OUTPUT_DELTA, t, 0.0);
 
   /* Iterate layers from last -> first */
   for(int i = last; i >= 0; i--) {
     layer* cur = &network->layers[i];
+    matrix* delta = &cur->deltas;
 
     matrix* prev_a = (i == 0) ? inputs : &network->layers[i - 1].activations;
 
-    /* Weight update: W -= lr/batch * (delta * prev_a^T) */
-    matrix Cw = create_matrix(delta.row_size, prev_a->row_size);
-    matrix weight_sub = matrix_m_multiply(&delta, prev_a, &Cw, scale_factor, 0.0, 2);
+    /* Prepare delta for the next layer (if any), before this layer's weights change */
+    if(i > 0) {
+      layer* prev = &network->layers[i - 1];
+
+      t = phase_start(network);
+      gemm_into(&cur->weights, delta, &prev->deltas, 1.0, 0.0, 1);
+      phase_end(network, i, PROFILE_BACKWARD_GEMM, t, gemm_flops(cur, batch_size));
+
+      t = phase_start(network);
+      if(prev->a == relu_into) {
+        relu_backward(&prev->activations, &prev->deltas);
+      } else {
+        matrix da_dz = view(&network->scratch, prev->neurons, batch_size);
+        prev->a_prime(&prev->zs, &da_dz);
+        hadamard_into(&prev->deltas, &da_dz, &prev->deltas);
+      }
+      phase_end(network, i - 1, PROFILE_ACTIVATION_BACKWARD, t, 0.0);
+    }
 
-    /* Bias update: b -= lr/batch * sum(delta across batch) */
-    matrix bias_reduce = row_sum(&delta);
-    matrix bias_sub = matrix_scale(&bias_reduce, scale_factor);
-    free_matrix(&bias_reduce);
+    if(mode != BACKWARD_SGD_STEP) {
+      /* dW (+)= delta * prev_a^T, db (+)= sum(delta across batch) */
+      double beta = (mode == BACKWARD_ACCUMULATE) ? 1.0 : 0.0;
+      t = phase_start(network);
+      gemm_into(delta, prev_a, &cur->dW, 1.0, beta, 2);
+      phase_end(network, i, PROFILE_WEIGHT_GRADIENT, t, gemm_flops(cur, batch_size));
+      t = phase_start(network);
+      row_sum_into(delta, &cur->db, 1.0, beta);
+      phase_end(network, i, PROFILE_BIAS_REDUCTION, t, (double)cur->neurons * (double)batch_size);
+    } else {
+      /* Weight update: W -= lr/batch * (delta * prev_a^T), accumulated straight into W */
+      t = phase_start(network);
+      gemm_into(delta, prev_a, &cur->weights, -scale_factor, 1.0, 2);
+      phase_end(network, i, PROFILE_WEIGHT_GRADIENT, t, gemm_flops(cur, batch_size));
+
+      /* Bias update: b -= lr/batch * sum(delta across batch) */
+      t = phase_start(network);
+      row_sum_into(delta, &cur->biases, -scale_factor, 1.0);
+      phase_end(network, i, PROFILE_BIAS_REDUCTION, t, (double)cur->neurons * (double)batch_size);
+    }
+  }
+}
 
-    matrix_subtract(&cur->weights, &weight_sub);
-    matrix_subtract(&cur->biases, &bias_sub);
+void back_propagate(neural_network* network, matrix* inputs, matrix* y_true) {
+  backward(network, inputs, y_true, BACKWARD_SGD_STEP);
+}
 
-    free_matrix(&Cw);
-    free_matrix(&weight_sub);
-    free_matrix(&bias_sub);
+void compute_gradients(neural_network* network, matrix* inputs, matrix* y_true, int accumulate) {
+  backward(network, inputs, y_true, accumulate ? BACKWARD_ACCUMULATE : BACKWARD_WRITE_GRADIENTS);
+}
 
-    /* Prepare delta for the next layer (if any) */
-    if(i > 0) {
-      matrix temp = create_matrix(cur->weights.column_size, delta.column_size);
-      matrix dl_new = matrix_m_multiply(&cur->weights, &delta, &temp, 1.0, 0.0, 1);
-      free_matrix(&temp);
+void begin_update(neural_network* network) {
+  if(network->optimizer) optimizer_begin_step(network->optimizer);
+}
 
-      da_dz = network->layers[i - 1].a_prime(&network->layers[i - 1].zs);
+void update_range(neural_network* network, uint64_t lo, uint64_t hi, uint64_t samples) {
+  assert(samples > 0 && hi <= network->parameters.used);
+  nn_real* param = network->parameters.base;
+  const nn_real* grad = network->gradients.base;
+  optimizer* opt = network->optimizer;
 
-      matrix new_delta = hadamard(&dl_new, &da_dz);
+  if(!opt) {
+    nn_real step = (nn_real)(network->learning_rate / (double)samples);
+    for(uint64_t k = lo; k < hi; k++) {
+      param[k] -= step * grad[k];
+    }
+    return;
+  }
 
-      free_matrix(&dl_new);
-      free_matrix(&da_dz);
+  double grad_scale = 1.0 / (double)samples;
+  if(opt->weight_decay == 0.0) {
+    optimizer_update(opt, network->learning_rate, param, grad, lo, hi, grad_scale, 0);
+    return;
+  }
 
-      /* free old delta, then replace */
-      free_matrix(&delta);
-      delta = new_delta;
+  /* Decoupled weight decay applies to the weights only, so the range is cut at each layer's biases. */
+  for(int i = 0; i < network->number_of_layers && lo < hi; i++) {
+    const layer* l = &network->layers[i];
+    uint64_t bias_start = (uint64_t)(l->biases.array - param);
+    uint64_t layer_end = bias_start + arena_matrix_size(l->biases.row_size, 1);
+    if(lo < bias_start) {
+      uint64_t end = hi < bias_start ? hi : bias_start;
+      optimizer_update(opt, network->learning_rate, param, grad, lo, end, grad_scale, 1);
+      lo = end;
     }
+    if(lo < hi && lo < layer_end) {
+      uint64_t end = hi < layer_end ? hi : layer_end;
+      optimizer_update(opt, network->learning_rate, param, grad, lo, end, grad_scale, 0);
+      lo = end;
+    }
+  }
+}
+
+void apply_update(neural_network* network, uint64_t samples) {
+  begin_update(network);
+  if(!network->profile) {
+    update_range(network, 0, network->parameters.used, samples);
+    return;
   }
 
-  free_matrix(&delta);
+  /* Profiling attributes the update to layers: one layer's (contiguous) parameters at a time. */
+  uint64_t lo = 0;
+  for(int i = 0; i < network->number_of_layers; i++) {
+    uint64_t hi = lo + layer_parameters(&network->layers[i]);
+    double t = phase_start(network);
+    update_range(network, lo, hi, samples);
+    phase_end(network, i, PROFILE_UPDATE, t, 0.0);
+    lo = hi;
+  }
 }
 
 double l2cost(matrix* activations, matrix* y_true) {
@@ -260,25 +547,39 @@ double l2cost(matrix* activations, matrix* y_true) {
   return total / (2.0 * (double)activations->column_size);
 }
 
-matrix l2cost_prime(matrix* activations, matrix* y_true) {
+void l2cost_prime_into(matrix* activations, matrix* y_true, matrix* out) {
   assert(activations->row_size == y_true->row_size && activations->column_size == y_true->column_size);
+  assert(activations->row_size == out->row_size && activations->column_size == out->column_size);
 
+  simd_sub(activations->array, y_true->array, out->array, activations->row_size * activations->column_size);
+}
+
+matrix l2cost_prime(matrix* activations, matrix* y_true) {
   matrix cost_prime = create_matrix(activations->row_size, activations->column_size);
-  for(uint64_t i = 0; i < activations->row_size * activations->column_size; i++) {
-    cost_prime.array[i] = activations->array[i] - y_true->array[i];
-  }
+  l2cost_prime_into(activations, y_true, &cost_prime);
   return cost_prime;
 }
 
-matrix linear_function(layer* linear_layer, matrix* activations) {
+void linear_function(layer* linear_layer, matrix* activations, matrix* out) {
   assert(linear_layer->weights.column_size == activations->row_size);
   assert(linear_layer->weights.row_size == linear_layer->biases.row_size);
-  return matrix_v_multiply(&linear_layer->weights, activations, &linear_layer->biases, 1.0, 1.0);
+  assert(out->row_size == linear_layer->weights.row_size && out->column_size == activations->column_size);
+
+  matrix_v_multiply_into(&linear_layer->weights, activations, &linear_layer->biases, out, 1.0, 1.0);
+}
+
+/*
+  Fused linear + ReLU: the bias is broadcast into the activations, gemm accumulates W*x onto it,
+  and ReLU runs in place while the output is still hot. No separate z buffer is kept; the
+  activations serve as the ReLU mask in back_propagate.
+*/
+void linear_relu_forward(layer* linear_layer, matrix* activations) {
+  linear_function(linear_layer, activations, &linear_layer->activations);
+  relu_into(&linear_layer->activations, &linear_layer->activations);
 }
 
 layer linear(uint64_t in, uint64_t out, char* activation) {
-  layer linear_layer;
-  linear_layer.neurons = out;
+  layer linear_layer = linear_shape(in, out, activation);
 
   /* Xavier/He-ish uniform init scale (small weights help stability) */
   double limit = 1.0 / sqrt((double)in);
@@ -291,18 +592,26 @@ layer linear(uint64_t in, uint64_t out, char* activation) {
     linear_layer.biases.array[i] = 0.0;
   }
 
-  /* Filled during forward_pass; keep empty to avoid freeing garbage. */
-  linear_layer.zs.row_size = 0;
-  linear_layer.zs.column_size = 0;
-  linear_layer.zs.array = NULL;
+  return linear_layer;
+}
+
+layer linear_shape(uint64_t in, uint64_t out, char* activation) {
+  layer linear_layer;
+  linear_layer.neurons = out;
+  linear_layer.weights = (matrix){.row_size = out, .column_size = in, .array = NULL};
+  linear_layer.biases = (matrix){.row_size = out, .column_size = 1, .array = NULL};
 
-  linear_layer.activations.row_size = 0;
-  linear_layer.activations.column_size = 0;
-  linear_layer.activations.array = NULL;
+  /* Workspace views, assigned by network_reserve(). */
+  memset(&linear_layer.zs, 0, sizeof(matrix));
+  memset(&linear_layer.activations, 0, sizeof(matrix));
+  memset(&linear_layer.deltas, 0, sizeof(matrix));
+  memset(&linear_layer.dW, 0, sizeof(matrix));
+  memset(&linear_layer.db, 0, sizeof(matrix));
 
   linear_layer.z = linear_function;
   linear_layer.a = get_activation(activation);
   linear_layer.a_prime = get_derivative_activation(activation);
+  linear_layer.forward = (linear_layer.a == relu_into) ? linear_relu_forward : NULL;
 
   return linear_layer;
 }
@@ -310,14 +619,16 @@ layer linear(uint64_t in, uint64_t out, char* activation) {
 void free_network_memory(neural_network* network) {
   if(!network) return;
 
-  for(int i = 0; i < network->number_of_layers; i++) {
-    if(network->layers[i].weights.array) free_matrix(&network->layers[i].weights);
-    if(network->layers[i].biases.array) free_matrix(&network->layers[i].biases);
-    if(network->layers[i].zs.array) free_matrix(&network->layers[i].zs);
-    if(network->layers[i].activations.array) free_matrix(&network->layers[i].activations);
-  }
+  if(network->borrowed_parameters) memset(&network->parameters, 0, sizeof(network->parameters));
+  arena_free(&network->parameters);
+  arena_free(&network->gradients);
+  network->borrowed_parameters = 0;
+
+  arena_free(&network->workspace);
+  network->max_batch = 0;
 
   free(network->layers);
   network->layers = NULL;
   network->number_of_layers = 0;
+  network->layer_capacity = 0;
 }
\ No newline at end of file
@@ -5,53 +5,147 @@
 #include <stdlib.h>
 #include "matrix.h"
 
-/* Activation function signature: takes a matrix and returns a newly allocated matrix. */
-typedef matrix (*activation_function)(matrix* activations);
+/* Activation function signature: reads 'in' and writes into 'out' (same shape; may alias 'in'). */
+typedef void (*activation_function)(matrix* in, matrix* out);
 
 void print(matrix m);
 
 typedef struct layer{
   uint64_t neurons;
+  /* Views into the network's parameter block once the layer is added. */
   matrix weights;
   matrix biases;
+  /* Views into the network workspace, (neurons x batch) for the current batch. */
   matrix zs;
   matrix activations;
-  matrix (*z)(struct layer* l, matrix* last_activations);
-  matrix (*a) (matrix* activations);
-  matrix (*a_prime) (matrix* activations);
+  matrix deltas;
+  /*
+    Gradients summed over samples (not averaged), written by compute_gradients() and persistent
+    across steps. Views into the network's gradient block.
+  */
+  matrix dW;
+  matrix db;
+  void (*z)(struct layer* l, matrix* last_activations, matrix* out);
+  void (*a) (matrix* zs, matrix* activations);
+  void (*a_prime) (matrix* zs, matrix* out);
+  /* Optional fused z + a; when set, forward_pass calls it instead and zs aliases activations. */
+  void (*forward)(struct layer* l, matrix* last_activations);
 } layer;
 
-typedef struct {
+struct optimizer;
+struct network_profile;
+
+typedef struct neural_network {
   uint16_t number_of_layers;
+  uint16_t layer_capacity;
   layer* layers;
+
+  /*
+    Every parameter in one aligned block: each layer's weights then biases, in layer order, each
+    padded to a 64-byte boundary (the padding stays zero). 'gradients' holds dW/db in the same
+    layout, so element k of one matches element k of the other, and whole-model operations
+    (update, all-reduce, checkpoint, snapshot) are single passes over parameters.used elements.
+    The gradient block is sized by network_reserve().
+  */
+  matrix_arena parameters;
+  matrix_arena gradients;
+  int borrowed_parameters;  /* the parameter block belongs to someone else; see network_borrow_parameters() */
   double learning_rate;
+  /* Update rule used by apply_update(); NULL means plain SGD. Not owned by the network. */
+  struct optimizer* optimizer;
+  /* Optional per-phase timing (profile.h); NULL records nothing. Not owned by the network. */
+  struct network_profile* profile;
+
+  /* Per-step buffers, sized by network_reserve() and reused by every forward/backward pass. */
+  matrix_arena workspace;
+  uint64_t max_batch;
+  matrix scratch;     /* largest (neurons x batch) activation derivative */
 } neural_network;
 
 activation_function get_activation(char* activation);
 activation_function get_derivative_activation(char* activation);
 
 neural_network create_network();
+
+/*
+  Append 'l', moving its weights and biases into the network's parameter block. A layer from
+  linear_shape() has no storage of its own: its parameters start at zero, or, on a network that
+  borrows its parameters, are whatever the borrowed block holds at that position.
+*/
 void add_layer(neural_network* network, layer l);
 
-/* Forward pass caches z and a per layer in network->layers[i].{zs,activations}. */
+/*
+  A copy of src's layers with its own parameter block, zeroed, and no workspace. Returns 0 on
+  success, nonzero on failure. Free with free_network_memory().
+*/
+int network_clone(neural_network* out, const neural_network* src);
+
+/*
+  Point the weights and biases at 'parameters' (laid out like network->parameters: another
+  network's block, a mapped checkpoint) instead of the network's own block, which is freed.
+  The network never frees or outlives the borrowed storage.
+*/
+void network_borrow_parameters(neural_network* network, nn_real* parameters);
+
+/*
+  Size the workspace for batches of up to max_batch samples. Called automatically by
+  forward_pass() when a larger batch arrives; call it up front to keep training allocation-free.
+*/
+void network_reserve(neural_network* network, uint64_t max_batch);
+
+/* Forward pass caches z and a per layer in network->layers[i].{zs,activations} (workspace views). */
 matrix forward_pass(neural_network* network, matrix* inputs);
 
-/* Backprop assumes y_true is shaped like the network output: (classes x batch). */
+/*
+  Backprop assumes y_true is shaped like the network output: (classes x batch).
+  Equivalent to compute_gradients() followed by apply_update(batch), but fuses the SGD step into
+  the weight-gradient gemm so dW/db are never written.
+*/
 void back_propagate(neural_network* network, matrix* inputs, matrix* y_true);
 
-matrix linear_function(layer* linear_layer, matrix* activations);
+/*
+  Backward pass that leaves the weights untouched and writes the gradients summed over the batch
+  into each layer's dW/db. With accumulate set they are added to the existing dW/db instead, so
+  several micro-batches can be combined into one update.
+*/
+void compute_gradients(neural_network* network, matrix* inputs, matrix* y_true, int accumulate);
+
+/*
+  Update every parameter from the stored gradients, averaged over 'samples', using
+  network->optimizer (plain SGD, W -= lr/samples * dW, when none is set).
+*/
+void apply_update(neural_network* network, uint64_t samples);
+
+/*
+  apply_update() in pieces, for callers that split the parameters between threads: call
+  begin_update() once, then update_range() over disjoint element ranges [lo, hi) of the
+  parameter block.
+*/
+void begin_update(neural_network* network);
+void update_range(neural_network* network, uint64_t lo, uint64_t hi, uint64_t samples);
+
+void linear_function(layer* linear_layer, matrix* activations, matrix* out);
+void linear_relu_forward(layer* linear_layer, matrix* activations);
 layer linear(uint64_t in, uint64_t out, char* activation);
+/* linear() without the weights and biases: shapes and functions only, for add_layer() to place. */
+layer linear_shape(uint64_t in, uint64_t out, char* activation);
 
+/* Value-returning activations allocate their result; the _into variants write into 'out'. */
 matrix relu(matrix* activations);
 matrix softmax(matrix* activations);
+void relu_into(matrix* z, matrix* out);
+void relu_prime_into(matrix* z, matrix* out);
+void softmax_into(matrix* z, matrix* out);
 
 /* For classification with softmax outputs */
 double cross_entropy(matrix* activations, matrix* y_true);
 matrix cross_entropy_prime(matrix* activations, matrix* y_true);
+void cross_entropy_prime_into(matrix* activations, matrix* y_true, matrix* out);
 
 /* L2 cost */
 double l2cost(matrix* activations, matrix* y_true);
 matrix l2cost_prime(matrix* activations, matrix* y_true);
+void l2cost_prime_into(matrix* activations, matrix* y_true, matrix* out);
 
 void free_network_memory(neural_network* network);
 
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "optimizer.h"
+#include "neural_network.h"
+
+#ifdef NN_FLOAT32
+  #define nn_sqrt sqrtf
+#else
+  #define nn_sqrt sqrt
+#endif
+
+const char* optimizer_kind_name(optimizer_kind kind) {
+  switch(kind) {
+    case OPTIMIZER_SGD: return "sgd";
+    case OPTIMIZER_MOMENTUM: return "momentum";
+    case OPTIMIZER_NESTEROV: return "nesterov";
+    case OPTIMIZER_ADAM: return "adam";
+    case OPTIMIZER_ADAMW: return "adamw";
+  }
+  return "unknown";
+}
+
+int optimizer_init(optimizer* opt, char* name, struct neural_network* network) {
+  memset(opt, 0, sizeof(*opt));
+
+  if(strcmp(name, "sgd") == 0) opt->kind = OPTIMIZER_SGD;
+  else if(strcmp(name, "momentum") == 0) opt->kind = OPTIMIZER_MOMENTUM;
+  else if(strcmp(name, "nesterov") == 0) opt->kind = OPTIMIZER_NESTEROV;
+  else if(strcmp(name, "adam") == 0) opt->kind = OPTIMIZER_ADAM;
+  else if(strcmp(name, "adamw") == 0) opt->kind = OPTIMIZER_ADAMW;
+  else {
+    printf("%s is not a valid optimizer.\n", name);
+    return 1;
+  }
+
+  opt->momentum = 0.9;
+  opt->beta1 = 0.9;
+  opt->beta2 = 0.999;
+  opt->epsilon = 1e-8;
+  opt->weight_decay = (opt->kind == OPTIMIZER_ADAMW) ? 0.01 : 0.0;
+
+  opt->parameters = network->parameters.used;
+
+  uint64_t buffers = 0;
+  if(opt->kind == OPTIMIZER_MOMENTUM || opt->kind == OPTIMIZER_NESTEROV) buffers = 1;
+  else if(opt->kind == OPTIMIZER_ADAM || opt->kind == OPTIMIZER_ADAMW) buffers = 2;
+
+  if(buffers) {
+    if(arena_init(&opt->state, buffers * arena_matrix_size(opt->parameters, 1)) != 0) return 3;
+    opt->m = arena_matrix(&opt->state, opt->parameters, 1).array;
+    if(buffers == 2) opt->v = arena_matrix(&opt->state, opt->parameters, 1).array;
+  }
+  return 0;
+}
+
+void optimizer_begin_step(optimizer* opt) {
+  opt->step++;
+}
+
+void optimizer_update(optimizer* opt, double learning_rate, nn_real* param, const nn_real* grad,
+                      uint64_t lo, uint64_t hi, double grad_scale, int decay_weights) {
+  assert(hi <= opt->parameters);
+
+  nn_real* restrict p = param;
+  const nn_real* restrict g = grad;
+  const nn_real lr = (nn_real)learning_rate;
+  const nn_real gs = (nn_real)grad_scale;
+
+  switch(opt->kind) {
+    case OPTIMIZER_SGD: {
+      const nn_real step = lr * gs;
+      for(uint64_t k = lo; k < hi; k++) {
+        p[k] -= step * g[k];
+      }
+      break;
+    }
+
+    case OPTIMIZER_MOMENTUM:
+    case OPTIMIZER_NESTEROV: {
+      /* v = mu*v + g; plain: p -= lr*v, Nesterov: p -= lr*(g + mu*v) */
+      nn_real* restrict v = opt->m;
+      const nn_real mu = (nn_real)opt->momentum;
+      const int nesterov = (opt->kind == OPTIMIZER_NESTEROV);
+      const nn_real direct = nesterov ? 1 : 0;
+      const nn_real coeff = nesterov ? mu : 1;
+      for(uint64_t k = lo; k < hi; k++) {
+        nn_real gk = gs * g[k];
+        nn_real vk = mu * v[k] + gk;
+        v[k] = vk;
+        p[k] -= lr * (direct * gk + coeff * vk);
+      }
+      break;
+    }
+
+    case OPTIMIZER_ADAM:
+    case OPTIMIZER_ADAMW: {
+      /*
+        Bias correction folded into the step size and epsilon:
+          p -= lr * m_hat / (sqrt(v_hat) + eps)  ==  p -= alpha_t * m / (sqrt(v) + eps_t)
+      */
+      nn_real* restrict m = opt->m;
+      nn_real* restrict v = opt->v;
+      const nn_real b1 = (nn_real)opt->beta1;
+      const nn_real b2 = (nn_real)opt->beta2;
+      double correction2 = sqrt(1.0 - pow(opt->beta2, (double)opt->step));
+      const nn_real alpha_t = (nn_real)(learning_rate * correction2 / (1.0 - pow(opt->beta1, (double)opt->step)));
+      const nn_real eps_t = (nn_real)(opt->epsilon * correction2);
+      /* Decoupled weight decay (AdamW) shrinks the weights, not the biases. */
+      const nn_real decay = decay_weights ? (nn_real)(1.0 - learning_rate * opt->weight_decay) : 1;
+
+      for(uint64_t k = lo; k < hi; k++) {
+        nn_real gk = gs * g[k];
+        nn_real mk = b1 * m[k] + (1 - b1) * gk;
+        nn_real vk = b2 * v[k] + (1 - b2) * gk * gk;
+        m[k] = mk;
+        v[k] = vk;
+        p[k] = decay * p[k] - alpha_t * mk / (nn_sqrt(vk) + eps_t);
+      }
+      break;
+    }
+  }
+}
+
+void optimizer_free(optimizer* opt) {
+  arena_free(&opt->state);
+  memset(opt, 0, sizeof(*opt));
+}
@@ -0,0 +1,59 @@
+#ifndef OPTIMIZER_H_
+#define OPTIMIZER_H_
+
+#include <stdint.h>
+#include "matrix.h"
+
+typedef enum {
+  OPTIMIZER_SGD,
+  OPTIMIZER_MOMENTUM,
+  OPTIMIZER_NESTEROV,
+  OPTIMIZER_ADAM,
+  OPTIMIZER_ADAMW
+} optimizer_kind;
+
+/*
+  Per-parameter optimizer state for a whole network. The state is laid out like the network's
+  parameter block: element k of the momentum velocity or of the Adam first/second moments
+  belongs to parameter k, so each is a single aligned block updated in the same pass.
+*/
+typedef struct optimizer {
+  optimizer_kind kind;
+  double momentum;      /* momentum, nesterov */
+  double beta1;         /* adam, adamw */
+  double beta2;
+  double epsilon;
+  double weight_decay;  /* adamw, decoupled; applied to weights only */
+
+  uint64_t step;        /* number of updates so far, for Adam bias correction */
+  uint64_t parameters;  /* length of the network's parameter block, padding included */
+  matrix_arena state;   /* velocity, or m followed by v (each 'parameters' long) */
+  nn_real* m;
+  nn_real* v;
+} optimizer;
+
+struct neural_network;
+
+/*
+  Set up an optimizer by name ("sgd", "momentum", "nesterov", "adam", "adamw") for the layer
+  shapes of 'network', with the usual default hyperparameters. Returns 0 on success, nonzero on failure.
+*/
+int optimizer_init(optimizer* opt, char* name, struct neural_network* network);
+
+/* The name optimizer_init() accepts for 'kind'. */
+const char* optimizer_kind_name(optimizer_kind kind);
+
+/* Advance the step counter; call once per update, before any optimizer_update(). */
+void optimizer_begin_step(optimizer* opt);
+
+/*
+  Fused update of param[lo, hi) from grad * grad_scale, reading and writing the matching slice
+  of the optimizer state in the same pass. param and grad are the network's whole parameter and
+  gradient blocks. decay_weights says whether the range holds weights, which AdamW's decay applies to.
+*/
+void optimizer_update(optimizer* opt, double learning_rate, nn_real* param, const nn_real* grad,
+                      uint64_t lo, uint64_t hi, double grad_scale, int decay_weights);
+
+void optimizer_free(optimizer* opt);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+/*
+  Slot k % 2 holds batch k. The producer builds the next batch only when no finished batch is
+  waiting (produced == consumed); the caller is then working on batch consumed - 1 in the
+  other slot.
+*/
+static void* producer_main(void* arg) {
+  batch_pipeline* p = (batch_pipeline*)arg;
+
+  pthread_mutex_lock(&p->mutex);
+  for(;;) {
+    while(!p->stop && (p->produced >= p->steps || p->produced > p->consumed)) {
+      pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    if(p->stop) break;
+
+    uint64_t step = p->produced;
+    int slot = (int)(step % 2);
+    pthread_mutex_unlock(&p->mutex);
+
+    p->x_view[slot] = p->x[slot];
+    p->y_view[slot] = p->y[slot];
+    p->build(p->context, step, &p->x_view[slot], &p->y_view[slot]);
+
+    pthread_mutex_lock(&p->mutex);
+    p->produced++;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+int pipeline_init(batch_pipeline* pipeline, batch_builder build, void* context, uint64_t x_rows, uint64_t y_rows, uint64_t max_batch) {
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->build = build;
+  pipeline->context = context;
+
+  for(int i = 0; i < 2; i++) {
+    pipeline->x[i] = create_matrix(x_rows, max_batch);
+    pipeline->y[i] = create_matrix(y_rows, max_batch);
+    if(!pipeline->x[i].array || !pipeline->y[i].array) return 1;
+  }
+
+  pthread_mutex_init(&pipeline->mutex, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+  if(pthread_create(&pipeline->thread, NULL, producer_main, pipeline) != 0) return 2;
+  return 0;
+}
+
+void pipeline_start(batch_pipeline* pipeline, uint64_t steps) {
+  pthread_mutex_lock(&pipeline->mutex);
+  /* The previous epoch is fully consumed, so the producer is idle. */
+  pipeline->steps = steps;
+  pipeline->produced = 0;
+  pipeline->consumed = 0;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+}
+
+int pipeline_next(batch_pipeline* pipeline, matrix* x, matrix* y) {
+  pthread_mutex_lock(&pipeline->mutex);
+  if(pipeline->consumed >= pipeline->steps) {
+    pthread_mutex_unlock(&pipeline->mutex);
+    return 1;
+  }
+
+  while(pipeline->produced <= pipeline->consumed) {
+    pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+  }
+
+  int slot = (int)(pipeline->consumed % 2);
+  *x = pipeline->x_view[slot];
+  *y = pipeline->y_view[slot];
+
+  /* Taking batch k hands batch k - 1's buffers back to the producer. */
+  pipeline->consumed++;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+  return 0;
+}
+
+void pipeline_free(batch_pipeline* pipeline) {
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->stop = 1;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+  pthread_join(pipeline->thread, NULL);
+
+  pthread_mutex_destroy(&pipeline->mutex);
+  pthread_cond_destroy(&pipeline->cond);
+  for(int i = 0; i < 2; i++) {
+    free_matrix(&pipeline->x[i]);
+    free_matrix(&pipeline->y[i]);
+  }
+}
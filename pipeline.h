@@ -0,0 +1,55 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "matrix.h"
+
+/*
+  Fill batch 'step' of the current epoch into x and y. They arrive as full-capacity buffers
+  (rows x max_batch); a shorter batch narrows their column_size in place.
+*/
+typedef void (*batch_builder)(void* context, uint64_t step, matrix* x, matrix* y);
+
+/*
+  Double-buffered batch producer. A background thread builds batch k+1 into one buffer pair
+  while the caller trains on batch k from the other, so input preparation overlaps compute.
+*/
+typedef struct {
+  batch_builder build;
+  void* context;
+
+  matrix x[2];
+  matrix y[2];
+  matrix x_view[2];
+  matrix y_view[2];
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint64_t steps;     /* batches in the current epoch */
+  uint64_t produced;  /* batches built so far this epoch */
+  uint64_t consumed;  /* batches handed to the caller so far this epoch */
+  int stop;
+} batch_pipeline;
+
+/* Allocate both buffer pairs and start the producer thread. Returns 0 on success, nonzero on failure. */
+int pipeline_init(batch_pipeline* pipeline, batch_builder build, void* context, uint64_t x_rows, uint64_t y_rows, uint64_t max_batch);
+
+/*
+  Begin an epoch of 'steps' batches. Everything the builder reads (e.g. the shuffled index)
+  must be ready before this call and left alone until the epoch's last batch is taken.
+*/
+void pipeline_start(batch_pipeline* pipeline, uint64_t steps);
+
+/*
+  Block until the next batch is ready and point x/y at it. The batch stays valid until the
+  following pipeline_next() call. Returns 0 on success, nonzero once the epoch is exhausted.
+*/
+int pipeline_next(batch_pipeline* pipeline, matrix* x, matrix* y);
+
+/* Stop the producer thread and free the buffers. */
+void pipeline_free(batch_pipeline* pipeline);
+
+#endif
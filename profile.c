@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "profile.h"
+
+static const char* const PHASE_NAMES[PROFILE_PHASES] = {
+  "forward_gemm",
+  "activation",
+  "output_delta",
+  "backward_gemm",
+  "activation_backward",
+  "weight_gradient",
+  "bias_reduction",
+  "update",
+};
+
+int network_profile_init(network_profile* profile, uint16_t layers) {
+  profile->layers = layers;
+  profile->seconds = calloc((size_t)layers * PROFILE_PHASES, sizeof(double));
+  profile->flops = calloc((size_t)layers * PROFILE_PHASES, sizeof(double));
+  profile->events = NULL;
+  profile->event_count = 0;
+  profile->event_capacity = 0;
+  if(!profile->seconds || !profile->flops) {
+    network_profile_free(profile);
+    return 1;
+  }
+  return 0;
+}
+
+void network_profile_reset(network_profile* profile) {
+  for(uint64_t i = 0; i < (uint64_t)profile->layers * PROFILE_PHASES; i++) {
+    profile->seconds[i] = 0.0;
+    profile->flops[i] = 0.0;
+  }
+  profile->event_count = 0;
+}
+
+static void record(network_profile* profile, const char* name, int32_t layer, profile_phase phase, double start, double end, double flops) {
+  if(profile->event_count >= profile->event_capacity) return;
+  profile_event* e = &profile->events[profile->event_count++];
+  e->name = name;
+  e->layer = layer;
+  e->phase = phase;
+  e->start = start;
+  e->seconds = end - start;
+  e->flops = flops;
+}
+
+void network_profile_add(network_profile* profile, uint16_t layer, profile_phase phase, double start, double end, double flops) {
+  if(layer >= profile->layers) return;
+  profile->seconds[layer * PROFILE_PHASES + phase] += end - start;
+  profile->flops[layer * PROFILE_PHASES + phase] += flops;
+  record(profile, PHASE_NAMES[phase], layer, phase, start, end, flops);
+}
+
+void network_profile_span(network_profile* profile, const char* name, double start, double end) {
+  record(profile, name, -1, PROFILE_PHASES, start, end, 0.0);
+}
+
+double network_profile_seconds(const network_profile* profile, uint16_t layer, profile_phase phase) {
+  return layer < profile->layers ? profile->seconds[layer * PROFILE_PHASES + phase] : 0.0;
+}
+
+double network_profile_flops(const network_profile* profile, uint16_t layer, profile_phase phase) {
+  return layer < profile->layers ? profile->flops[layer * PROFILE_PHASES + phase] : 0.0;
+}
+
+int network_profile_trace(network_profile* profile, uint32_t capacity) {
+  profile_event* events = realloc(profile->events, (size_t)capacity * sizeof(profile_event));
+  if(!events && capacity) return 1;
+  profile->events = events;
+  profile->event_capacity = capacity;
+  if(profile->event_count > capacity) profile->event_count = capacity;
+  return 0;
+}
+
+/*
+  Chrome trace event format: complete ("X") events in microseconds from the earliest event.
+  Layer phases are named "<phase> L<layer>" and carry their layer, FLOPs and GFLOP/s as args;
+  spans enclose them on the same track, so the viewer nests them.
+*/
+int network_profile_write_trace(const network_profile* profile, const char* path) {
+  FILE* out = fopen(path, "w");
+  if(!out) return 1;
+
+  double origin = 0.0;
+  for(uint32_t i = 0; i < profile->event_count; i++) {
+    if(i == 0 || profile->events[i].start < origin) origin = profile->events[i].start;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for(uint32_t i = 0; i < profile->event_count; i++) {
+    const profile_event* e = &profile->events[i];
+    double ts = (e->start - origin) * 1e6, dur = e->seconds * 1e6;
+    if(e->layer >= 0) {
+      double gflops = e->seconds > 0.0 ? e->flops / e->seconds * 1e-9 : 0.0;
+      fprintf(out, "  {\"name\": \"%s L%d\", \"cat\": \"layer\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"args\": {\"layer\": %d, \"flops\": %.0f, \"gflop_per_sec\": %.3f}}",
+              e->name, e->layer, ts, dur, e->layer, e->flops, gflops);
+    } else {
+      fprintf(out, "  {\"name\": \"%s\", \"cat\": \"span\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}",
+              e->name, ts, dur);
+    }
+    fprintf(out, "%s\n", i + 1 < profile->event_count ? "," : "");
+  }
+  fprintf(out, "]}\n");
+  return fclose(out) != 0;
+}
+
+const char* profile_phase_name(profile_phase phase) {
+  return (phase >= 0 && phase < PROFILE_PHASES) ? PHASE_NAMES[phase] : "unknown";
+}
+
+double profile_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+void network_profile_free(network_profile* profile) {
+  free(profile->seconds);
+  free(profile->flops);
+  free(profile->events);
+  profile->seconds = NULL;
+  profile->flops = NULL;
+  profile->events = NULL;
+  profile->event_count = 0;
+  profile->event_capacity = 0;
+  profile->layers = 0;
+}
@@ -0,0 +1,82 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+/*
+  Per-layer time breakdown of training steps. Point neural_network.profile at one and
+  forward_pass(), back_propagate()/compute_gradients() and apply_update() add the wall time of
+  each phase to it; NULL (the default) records nothing and costs one branch per phase.
+
+  While profiled, layers with a fused forward run their z and a hooks separately (the same work)
+  so the two can be told apart. A profile is written by the thread running the network only;
+  the parallel trainer records worker 0, which is the calling thread.
+
+  Each phase also records the FLOPs it performed (gemm phases: 2*M*N*K; the bias row sum: one
+  add per element; 0 for the rest), so achieved GFLOP/s can be read off per layer. With
+  network_profile_trace() every phase is additionally kept as a timeline event, together with
+  any spans the caller adds, for export as a Chrome trace (chrome://tracing, ui.perfetto.dev).
+*/
+typedef enum {
+  PROFILE_FORWARD_GEMM,         /* z = W a + b */
+  PROFILE_ACTIVATION,           /* a = f(z) */
+  PROFILE_OUTPUT_DELTA,         /* loss gradient at the output layer */
+  PROFILE_BACKWARD_GEMM,        /* W^T delta into the previous layer's delta (recorded on this layer) */
+  PROFILE_ACTIVATION_BACKWARD,  /* f'(z) applied to this layer's delta */
+  PROFILE_WEIGHT_GRADIENT,      /* delta a^T into dW, or straight into W for the fused SGD step */
+  PROFILE_BIAS_REDUCTION,       /* row sum of delta into db, or into b */
+  PROFILE_UPDATE,               /* optimizer or SGD update; with several workers also the gradient reduction */
+  PROFILE_PHASES
+} profile_phase;
+
+/* One timeline entry: a layer phase (layer >= 0) or a caller span (layer < 0, 'name' set). */
+typedef struct {
+  const char* name;
+  int32_t layer;
+  profile_phase phase;
+  double start;       /* profile_now() seconds */
+  double seconds;
+  double flops;
+} profile_event;
+
+typedef struct network_profile {
+  uint16_t layers;
+  double* seconds;    /* [layer * PROFILE_PHASES + phase] */
+  double* flops;      /* same indexing */
+
+  /* Timeline, off unless network_profile_trace() was called; recording stops when full. */
+  profile_event* events;
+  uint32_t event_count;
+  uint32_t event_capacity;
+} network_profile;
+
+/* Returns 0 on success, nonzero on failure. */
+int network_profile_init(network_profile* profile, uint16_t layers);
+
+/* Clears the totals and the recorded events. */
+void network_profile_reset(network_profile* profile);
+
+/* Add one run of a phase, [start, end) from profile_now(), that performed 'flops' FLOPs. */
+void network_profile_add(network_profile* profile, uint16_t layer, profile_phase phase, double start, double end, double flops);
+
+/* Record a named timeline span (e.g. a whole training step) that is not a layer phase. Traced profiles only. */
+void network_profile_span(network_profile* profile, const char* name, double start, double end);
+
+double network_profile_seconds(const network_profile* profile, uint16_t layer, profile_phase phase);
+double network_profile_flops(const network_profile* profile, uint16_t layer, profile_phase phase);
+
+/* Start keeping up to 'capacity' timeline events. Returns 0 on success, nonzero on failure. */
+int network_profile_trace(network_profile* profile, uint32_t capacity);
+
+/* Write the recorded events as Chrome trace JSON. Returns 0 on success, nonzero on failure. */
+int network_profile_write_trace(const network_profile* profile, const char* path);
+
+/* Stable snake_case name of a phase, e.g. "forward_gemm". */
+const char* profile_phase_name(profile_phase phase);
+
+/* Monotonic clock in seconds. */
+double profile_now(void);
+
+void network_profile_free(network_profile* profile);
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "quantize.h"
+
+/* Calibration runs the float network over the samples in chunks of this many. */
+#define CALIBRATION_CHUNK 256
+
+/*
+  Largest post-activation value of every hidden layer over the calibration samples, from the
+  float network. max_activation[i] is written for i < number_of_layers - 1.
+*/
+static int calibrate(const neural_network* network, const uint8_t* calibration, uint64_t samples, double* max_activation) {
+  uint64_t inputs = network->layers[0].weights.column_size;
+  for(int i = 0; i < network->number_of_layers; i++) max_activation[i] = 0.0;
+
+  for(uint64_t start = 0; start < samples; start += CALIBRATION_CHUNK) {
+    uint64_t n = (samples - start < CALIBRATION_CHUNK) ? samples - start : CALIBRATION_CHUNK;
+
+    matrix x = create_matrix(inputs, n);
+    if(!x.array) return 1;
+    for(uint64_t c = 0; c < n; c++) {
+      const uint8_t* pixels = calibration + (start + c) * inputs;
+      for(uint64_t p = 0; p < inputs; p++) x.array[p * n + c] = (nn_real)pixels[p] / 255;
+    }
+
+    matrix last = x;
+    for(int i = 0; i < network->number_of_layers; i++) {
+      const layer* l = &network->layers[i];
+      matrix weights = l->weights;
+      matrix biases = l->biases;
+      matrix out = create_matrix(l->neurons, n);
+      if(!out.array) {
+        free_matrix(&last);
+        return 1;
+      }
+
+      matrix_v_multiply_into(&weights, &last, &biases, &out, 1.0, 1.0);
+      l->a(&out, &out);
+      for(uint64_t k = 0; k < out.row_size * out.column_size; k++) {
+        if(out.array[k] > max_activation[i]) max_activation[i] = out.array[k];
+      }
+
+      free_matrix(&last);
+      last = out;
+    }
+    free_matrix(&last);
+  }
+  return 0;
+}
+
+int quantize_network(const neural_network* network, const uint8_t* calibration, uint64_t samples, quantized_network* out) {
+  memset(out, 0, sizeof(*out));
+  uint16_t n = network->number_of_layers;
+  if(n == 0 || samples == 0) return 1;
+
+  for(int i = 0; i < n; i++) {
+    activation_function expected = (i == n - 1) ? softmax_into : relu_into;
+    if(network->layers[i].a != expected) return 2;
+  }
+
+  double* max_activation = malloc(n * sizeof(double));
+  out->layers = calloc(n, sizeof(quantized_layer));
+  if(!max_activation || !out->layers) {
+    free(max_activation);
+    free(out->layers);
+    out->layers = NULL;
+    return 3;
+  }
+  out->number_of_layers = n;
+
+  if(calibrate(network, calibration, samples, max_activation) != 0) {
+    free(max_activation);
+    free_quantized_network(out);
+    return 3;
+  }
+
+  /* Raw pixels are the first layer's quanta: pixel p stands for p / 255. */
+  double input_scale = 1.0 / 255.0;
+
+  for(int i = 0; i < n; i++) {
+    const layer* l = &network->layers[i];
+    quantized_layer* ql = &out->layers[i];
+    ql->inputs = l->weights.column_size;
+    ql->neurons = l->neurons;
+    ql->input_scale = (float)input_scale;
+    if(ql->neurons > out->max_neurons) out->max_neurons = ql->neurons;
+
+    ql->weights = malloc(ql->neurons * ql->inputs);
+    ql->biases = malloc(ql->neurons * sizeof(int32_t));
+    ql->rescale = malloc(ql->neurons * sizeof(float));
+    if(!ql->weights || !ql->biases || !ql->rescale) {
+      free(max_activation);
+      free_quantized_network(out);
+      return 3;
+    }
+
+    int output_layer = (i == n - 1);
+    double output_scale = output_layer ? 1.0 : (max_activation[i] > 0.0 ? max_activation[i] / 255.0 : 1.0);
+
+    for(uint64_t j = 0; j < ql->neurons; j++) {
+      const nn_real* w = l->weights.array + j * ql->inputs;
+
+      double max_abs = 0.0;
+      for(uint64_t k = 0; k < ql->inputs; k++) {
+        if(fabs((double)w[k]) > max_abs) max_abs = fabs((double)w[k]);
+      }
+      double weight_scale = (max_abs > 0.0) ? max_abs / 127.0 : 1.0;
+
+      for(uint64_t k = 0; k < ql->inputs; k++) {
+        ql->weights[k * ql->neurons + j] = (int8_t)lround((double)w[k] / weight_scale);
+      }
+
+      double bias = round((double)l->biases.array[j] / (input_scale * weight_scale));
+      if(bias > INT32_MAX) bias = INT32_MAX;
+      if(bias < INT32_MIN) bias = INT32_MIN;
+      ql->biases[j] = (int32_t)bias;
+      ql->rescale[j] = (float)(input_scale * weight_scale / output_scale);
+    }
+
+    input_scale = output_scale;
+  }
+
+  free(max_activation);
+  return 0;
+}
+
+int quantized_context_init(quantized_context* ctx, const quantized_network* q) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->buffers[0] = malloc(q->max_neurons);
+  ctx->buffers[1] = malloc(q->max_neurons);
+  ctx->accumulators = malloc(q->max_neurons * sizeof(int32_t));
+  if(!ctx->buffers[0] || !ctx->buffers[1] || !ctx->accumulators) {
+    quantized_context_free(ctx);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  acc = bias + W^T a for one layer, with W stored input-major. Each nonzero input adds its weight
+  row to all the accumulators at once; zero inputs, which are most MNIST pixels and roughly half
+  the ReLU outputs, are skipped outright.
+*/
+static void accumulate_layer(const quantized_layer* ql, const uint8_t* a, int32_t* restrict acc) {
+  uint64_t n = ql->neurons;
+  memcpy(acc, ql->biases, n * sizeof(int32_t));
+
+  for(uint64_t k = 0; k < ql->inputs; k++) {
+    if(!a[k]) continue;
+    const int32_t ak = a[k];
+    const int8_t* restrict w = ql->weights + k * n;
+    for(uint64_t j = 0; j < n; j++) acc[j] += ak * (int32_t)w[j];
+  }
+}
+
+uint64_t quantized_predict(const quantized_network* q, quantized_context* ctx, const uint8_t* pixels) {
+  const uint8_t* a = pixels;
+  int32_t* acc = ctx->accumulators;
+
+  for(int i = 0; i < q->number_of_layers - 1; i++) {
+    const quantized_layer* ql = &q->layers[i];
+    uint8_t* out = ctx->buffers[i % 2];
+
+    accumulate_layer(ql, a, acc);
+    for(uint64_t j = 0; j < ql->neurons; j++) {
+      /* Rescale to the next layer's quanta; the clamp at 0 is the ReLU. */
+      float v = (float)acc[j] * ql->rescale[j];
+      out[j] = (v <= 0.0f) ? 0 : (v >= 255.0f) ? 255 : (uint8_t)(v + 0.5f);
+    }
+    a = out;
+  }
+
+  /* Output layer: float logits; softmax would not change the argmax. */
+  const quantized_layer* ql = &q->layers[q->number_of_layers - 1];
+  accumulate_layer(ql, a, acc);
+
+  uint64_t best = 0;
+  float best_logit = (float)acc[0] * ql->rescale[0];
+  for(uint64_t j = 1; j < ql->neurons; j++) {
+    float logit = (float)acc[j] * ql->rescale[j];
+    if(logit > best_logit) {
+      best_logit = logit;
+      best = j;
+    }
+  }
+  return best;
+}
+
+void quantized_context_free(quantized_context* ctx) {
+  free(ctx->buffers[0]);
+  free(ctx->buffers[1]);
+  free(ctx->accumulators);
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void free_quantized_network(quantized_network* q) {
+  for(int i = 0; i < q->number_of_layers && q->layers; i++) {
+    free(q->layers[i].weights);
+    free(q->layers[i].biases);
+    free(q->layers[i].rescale);
+  }
+  free(q->layers);
+  memset(q, 0, sizeof(*q));
+}
@@ -0,0 +1,57 @@
+#ifndef QUANTIZE_H_
+#define QUANTIZE_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+
+/*
+  Post-training int8 quantization of a ReLU MLP with a softmax output, for inference.
+
+  Weights are symmetric int8 with one scale per output neuron (per channel). Activations are
+  uint8 with a zero point of 0, which suits ReLU outputs, and one scale per layer calibrated from
+  sample data. A layer accumulates uint8 x int8 products in int32, starting from a bias that is
+  pre-scaled into accumulator units, and skips zero inputs (most pixels, many ReLU outputs). The
+  result is rescaled to the next layer's uint8 range, with the ReLU folded into the clamp at 0.
+  The input scale is 1/255, so the first layer consumes raw IDX pixels as they are. The output
+  layer's accumulators are rescaled to float logits, and the argmax is taken on those.
+*/
+typedef struct {
+  uint64_t inputs;
+  uint64_t neurons;
+  int8_t* weights;       /* (inputs x neurons): input k's weights to every neuron are contiguous */
+  int32_t* biases;       /* bias / (input_scale * weight_scale[j]) */
+  float* rescale;        /* per neuron: accumulator -> next layer's quanta (or logits on the output layer) */
+  float input_scale;     /* real value of one input quantum */
+} quantized_layer;
+
+typedef struct {
+  uint16_t number_of_layers;
+  quantized_layer* layers;
+  uint64_t max_neurons;
+} quantized_network;
+
+/* Per-thread scratch for quantized_predict(), like inference_context. */
+typedef struct {
+  uint8_t* buffers[2];   /* ping-pong activations, max_neurons each */
+  int32_t* accumulators; /* max_neurons */
+} quantized_context;
+
+/*
+  Quantize 'network', calibrating activation ranges on 'samples' raw uint8 inputs stored back to
+  back (inputs bytes each). Hidden layers must use ReLU and the output layer softmax.
+  Returns 0 on success, nonzero on failure.
+*/
+int quantize_network(const neural_network* network, const uint8_t* calibration, uint64_t samples, quantized_network* out);
+
+/* Returns 0 on success, nonzero on failure. */
+int quantized_context_init(quantized_context* ctx, const quantized_network* q);
+
+/* Predicted class for one sample of raw uint8 pixels. */
+uint64_t quantized_predict(const quantized_network* q, quantized_context* ctx, const uint8_t* pixels);
+
+void quantized_context_free(quantized_context* ctx);
+void free_quantized_network(quantized_network* q);
+
+#endif
@@ -0,0 +1,301 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define SIMD_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__)
+  #define SIMD_NEON 1
+  #include <arm_neon.h>
+#endif
+
+typedef struct {
+  const char* name;
+  void (*relu)(const nn_real* in, nn_real* out, uint64_t n);
+  void (*relu_prime)(const nn_real* in, nn_real* out, uint64_t n);
+  void (*relu_mask)(const nn_real* activations, nn_real* delta, uint64_t n);
+  void (*mul)(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n);
+  void (*sub)(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n);
+  void (*max)(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n);
+  void (*fill)(nn_real* out, nn_real value, uint64_t n);
+  void (*exp_sub_accumulate)(const nn_real* in, const nn_real* shift, nn_real* out, nn_real* sum, uint64_t n);
+} simd_kernels;
+
+/*
+  exp constants. The input is clamped so 2^k stays a normal number; ln2 is split in two so
+  r = x - k*ln2 is exact enough for the polynomial.
+*/
+static const double LOG2E = 1.4426950408889634;
+static const double LN2_HI = 0.693145751953125;
+static const double LN2_LO = 1.4286068203094173e-06;
+static const double EXP_COEFFS[] = {
+  1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+  1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600, 1.0 / 6227020800,
+};
+#ifdef NN_FLOAT32
+  static const double EXP_LO = -87.0;
+  static const double EXP_HI = 88.0;
+  #define EXP_DEGREE 7
+#else
+  static const double EXP_LO = -708.0;
+  static const double EXP_HI = 709.0;
+  #define EXP_DEGREE 13
+#endif
+
+/* Portable fallback: plain loops the compiler can vectorize for the baseline ISA, and libm exp. */
+
+static void relu_generic(const nn_real* in, nn_real* out, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) out[i] = in[i] > 0 ? in[i] : 0;
+}
+
+static void relu_prime_generic(const nn_real* in, nn_real* out, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) out[i] = in[i] > 0 ? 1 : 0;
+}
+
+static void relu_mask_generic(const nn_real* activations, nn_real* delta, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) delta[i] = activations[i] > 0 ? delta[i] : 0;
+}
+
+static void mul_generic(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) out[i] = a[i] * b[i];
+}
+
+static void sub_generic(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) out[i] = a[i] - b[i];
+}
+
+static void max_generic(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) out[i] = a[i] > b[i] ? a[i] : b[i];
+}
+
+static void fill_generic(nn_real* out, nn_real value, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) out[i] = value;
+}
+
+static void exp_sub_accumulate_generic(const nn_real* in, const nn_real* shift, nn_real* out, nn_real* sum, uint64_t n) {
+  for(uint64_t i = 0; i < n; i++) {
+    nn_real e = (nn_real)exp((double)(in[i] - shift[i]));
+    out[i] = e;
+    sum[i] += e;
+  }
+}
+
+static const simd_kernels kernels_generic = {
+  .name = "generic",
+  .relu = relu_generic,
+  .relu_prime = relu_prime_generic,
+  .relu_mask = relu_mask_generic,
+  .mul = mul_generic,
+  .sub = sub_generic,
+  .max = max_generic,
+  .fill = fill_generic,
+  .exp_sub_accumulate = exp_sub_accumulate_generic,
+};
+
+#ifdef SIMD_X86
+
+/* AVX2 + FMA */
+#define KERNEL(name) name##_avx2
+#define SIMD_NAME "avx2"
+#define SIMD_TARGET __attribute__((target("avx2,fma")))
+#ifdef NN_FLOAT32
+  #define VEC __m256
+  #define VLEN 8
+  #define vload _mm256_loadu_ps
+  #define vstore _mm256_storeu_ps
+  #define vset1(x) _mm256_set1_ps((float)(x))
+  #define vadd _mm256_add_ps
+  #define vsub _mm256_sub_ps
+  #define vmul _mm256_mul_ps
+  #define vmax _mm256_max_ps
+  #define vmin _mm256_min_ps
+  #define vfma _mm256_fmadd_ps
+  #define vselect_gt0(x, v) _mm256_and_ps(_mm256_cmp_ps((x), _mm256_setzero_ps(), _CMP_GT_OQ), (v))
+  #define vround(x) _mm256_round_ps((x), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vpow2i(k) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23))
+#else
+  #define VEC __m256d
+  #define VLEN 4
+  #define vload _mm256_loadu_pd
+  #define vstore _mm256_storeu_pd
+  #define vset1(x) _mm256_set1_pd((double)(x))
+  #define vadd _mm256_add_pd
+  #define vsub _mm256_sub_pd
+  #define vmul _mm256_mul_pd
+  #define vmax _mm256_max_pd
+  #define vmin _mm256_min_pd
+  #define vfma _mm256_fmadd_pd
+  #define vselect_gt0(x, v) _mm256_and_pd(_mm256_cmp_pd((x), _mm256_setzero_pd(), _CMP_GT_OQ), (v))
+  #define vround(x) _mm256_round_pd((x), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vpow2i(k) _mm256_castsi256_pd(_mm256_slli_epi64( \
+      _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k)), _mm256_set1_epi64x(1023)), 52))
+#endif
+#include "simd_kernels.inc"
+#undef KERNEL
+#undef SIMD_NAME
+#undef SIMD_TARGET
+#undef VEC
+#undef VLEN
+#undef vload
+#undef vstore
+#undef vset1
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vmax
+#undef vmin
+#undef vfma
+#undef vselect_gt0
+#undef vround
+#undef vpow2i
+
+/* AVX-512F */
+#define KERNEL(name) name##_avx512
+#define SIMD_NAME "avx512"
+#define SIMD_TARGET __attribute__((target("avx512f")))
+#ifdef NN_FLOAT32
+  #define VEC __m512
+  #define VLEN 16
+  #define vload _mm512_loadu_ps
+  #define vstore _mm512_storeu_ps
+  #define vset1(x) _mm512_set1_ps((float)(x))
+  #define vadd _mm512_add_ps
+  #define vsub _mm512_sub_ps
+  #define vmul _mm512_mul_ps
+  #define vmax _mm512_max_ps
+  #define vmin _mm512_min_ps
+  #define vfma _mm512_fmadd_ps
+  #define vselect_gt0(x, v) _mm512_maskz_mov_ps(_mm512_cmp_ps_mask((x), _mm512_setzero_ps(), _CMP_GT_OQ), (v))
+  #define vround(x) _mm512_roundscale_ps((x), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vpow2i(k) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(k), _mm512_set1_epi32(127)), 23))
+#else
+  #define VEC __m512d
+  #define VLEN 8
+  #define vload _mm512_loadu_pd
+  #define vstore _mm512_storeu_pd
+  #define vset1(x) _mm512_set1_pd((double)(x))
+  #define vadd _mm512_add_pd
+  #define vsub _mm512_sub_pd
+  #define vmul _mm512_mul_pd
+  #define vmax _mm512_max_pd
+  #define vmin _mm512_min_pd
+  #define vfma _mm512_fmadd_pd
+  #define vselect_gt0(x, v) _mm512_maskz_mov_pd(_mm512_cmp_pd_mask((x), _mm512_setzero_pd(), _CMP_GT_OQ), (v))
+  #define vround(x) _mm512_roundscale_pd((x), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+  #define vpow2i(k) _mm512_castsi512_pd(_mm512_slli_epi64( \
+      _mm512_add_epi64(_mm512_cvtepi32_epi64(_mm512_cvtpd_epi32(k)), _mm512_set1_epi64(1023)), 52))
+#endif
+#include "simd_kernels.inc"
+
+#endif /* SIMD_X86 */
+
+#ifdef SIMD_NEON
+
+/* NEON is part of the AArch64 baseline, so no target attribute or runtime check is needed. */
+#define KERNEL(name) name##_neon
+#define SIMD_NAME "neon"
+#define SIMD_TARGET
+#ifdef NN_FLOAT32
+  #define VEC float32x4_t
+  #define VLEN 4
+  #define vload vld1q_f32
+  #define vstore vst1q_f32
+  #define vset1(x) vdupq_n_f32((float)(x))
+  #define vadd vaddq_f32
+  #define vsub vsubq_f32
+  #define vmul vmulq_f32
+  #define vmax vmaxq_f32
+  #define vmin vminq_f32
+  #define vfma(a, b, c) vfmaq_f32((c), (a), (b))
+  #define vselect_gt0(x, v) vbslq_f32(vcgtq_f32((x), vdupq_n_f32(0)), (v), vdupq_n_f32(0))
+  #define vround vrndnq_f32
+  #define vpow2i(k) vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(k), vdupq_n_s32(127)), 23))
+#else
+  #define VEC float64x2_t
+  #define VLEN 2
+  #define vload vld1q_f64
+  #define vstore vst1q_f64
+  #define vset1(x) vdupq_n_f64((double)(x))
+  #define vadd vaddq_f64
+  #define vsub vsubq_f64
+  #define vmul vmulq_f64
+  #define vmax vmaxq_f64
+  #define vmin vminq_f64
+  #define vfma(a, b, c) vfmaq_f64((c), (a), (b))
+  #define vselect_gt0(x, v) vbslq_f64(vcgtq_f64((x), vdupq_n_f64(0)), (v), vdupq_n_f64(0))
+  #define vround vrndnq_f64
+  #define vpow2i(k) vreinterpretq_f64_s64(vshlq_n_s64(vaddq_s64(vcvtq_s64_f64(k), vdupq_n_s64(1023)), 52))
+#endif
+#include "simd_kernels.inc"
+
+#endif /* SIMD_NEON */
+
+static const simd_kernels* active;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+/* Pick the widest kernel set the CPU runs, unless NN_SIMD names one (that is also supported). */
+static void select_kernels(void) {
+  const simd_kernels* supported[4];
+  int count = 0;
+  supported[count++] = &kernels_generic;
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) supported[count++] = &kernels_avx2;
+  if(__builtin_cpu_supports("avx512f")) supported[count++] = &kernels_avx512;
+#endif
+#ifdef SIMD_NEON
+  supported[count++] = &kernels_neon;
+#endif
+
+  active = supported[count - 1];
+
+  const char* forced = getenv("NN_SIMD");
+  for(int i = 0; forced && i < count; i++) {
+    if(strcmp(forced, supported[i]->name) == 0) active = supported[i];
+  }
+}
+
+static const simd_kernels* kernels(void) {
+  pthread_once(&select_once, select_kernels);
+  return active;
+}
+
+void simd_relu(const nn_real* in, nn_real* out, uint64_t n) {
+  kernels()->relu(in, out, n);
+}
+
+void simd_relu_prime(const nn_real* in, nn_real* out, uint64_t n) {
+  kernels()->relu_prime(in, out, n);
+}
+
+void simd_relu_mask(const nn_real* activations, nn_real* delta, uint64_t n) {
+  kernels()->relu_mask(activations, delta, n);
+}
+
+void simd_mul(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n) {
+  kernels()->mul(a, b, out, n);
+}
+
+void simd_sub(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n) {
+  kernels()->sub(a, b, out, n);
+}
+
+void simd_max(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n) {
+  kernels()->max(a, b, out, n);
+}
+
+void simd_fill(nn_real* out, nn_real value, uint64_t n) {
+  kernels()->fill(out, value, n);
+}
+
+void simd_exp_sub_accumulate(const nn_real* in, const nn_real* shift, nn_real* out, nn_real* sum, uint64_t n) {
+  kernels()->exp_sub_accumulate(in, shift, out, sum, n);
+}
+
+const char* simd_isa(void) {
+  return kernels()->name;
+}
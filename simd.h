@@ -0,0 +1,47 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <stdint.h>
+
+#include "matrix.h"
+
+/*
+  Vectorized elementwise kernels over contiguous nn_real arrays. Each is compiled once per
+  instruction set (AVX2+FMA and AVX-512F on x86-64, NEON on AArch64, plus a portable fallback),
+  and the best one the CPU supports is picked on first use. Setting NN_SIMD=generic|avx2|avx512|neon
+  in the environment forces a particular set, e.g. to compare them.
+
+  Outputs may alias inputs of the same length.
+*/
+
+/* out = max(in, 0) */
+void simd_relu(const nn_real* in, nn_real* out, uint64_t n);
+
+/* out = in > 0 ? 1 : 0 */
+void simd_relu_prime(const nn_real* in, nn_real* out, uint64_t n);
+
+/* delta = activations > 0 ? delta : 0 (ReLU backward, masked by the forward output) */
+void simd_relu_mask(const nn_real* activations, nn_real* delta, uint64_t n);
+
+/* out = a * b */
+void simd_mul(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n);
+
+/* out = a - b */
+void simd_sub(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n);
+
+/* out = max(a, b) */
+void simd_max(const nn_real* a, const nn_real* b, nn_real* out, uint64_t n);
+
+/* out = value */
+void simd_fill(nn_real* out, nn_real value, uint64_t n);
+
+/*
+  out = exp(in - shift) and sum += out, elementwise. Uses a polynomial exp accurate to a few ulp
+  over the range softmax needs, rather than calling libm per element.
+*/
+void simd_exp_sub_accumulate(const nn_real* in, const nn_real* shift, nn_real* out, nn_real* sum, uint64_t n);
+
+/* Name of the instruction set in use ("generic", "avx2", "avx512" or "neon"). */
+const char* simd_isa(void);
+
+#endif
@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+#include "optimizer.h"
+#include "trainer.h"
+#include "dataset_cache.h"
+#include "batch.h"
+#include "evaluator.h"
+#include "profile.h"
+#include "simd.h"
+
+/* The allocations-per-step report reads the matrix counters, which CMakeLists.txt turns on for this target. */
+#ifndef NN_COUNTERS
+  #error "train_bench needs NN_COUNTERS"
+#endif
+
+/*
+  Training throughput benchmark. Trains MLPs of the given hidden widths on a synthetic,
+  MNIST-shaped dataset (fixed seed, so every run and every commit sees the same data and the
+  same initial weights) and reports, per configuration:
+    - training samples/s and the per-step latency distribution (trainer_step only),
+    - the mean time per step of each phase of each layer (profile.h), plus batch build and
+      whatever the phases do not cover ("other": loss, shard gathers, worker barriers),
+    - the achieved GFLOP/s of each layer's gemms (and, given --peak, the fraction of machine
+      peak), and the matrix allocations per step (which should be zero),
+    - eval throughput through the evaluator (evaluator.h).
+  Batch size, thread count and layer widths are swept as a cross product. --json writes the
+  results in a stable schema for comparing commits; --trace writes the first few timed steps of
+  the first configuration as a Chrome trace.
+
+  --batch-build N skips training and instead times N shuffled batches of each batch size through
+  the tiled batch builders (batch.h) and through a column-scatter reference, the per-sample loop
+  they replaced.
+*/
+
+#define INPUTS 784
+#define CLASSES 10
+#define MAX_HIDDEN 8
+#define MAX_SWEEP 16
+#define SEED 1
+#define TRACE_STEPS 8
+
+typedef struct {
+  uint32_t count;
+  uint32_t sizes[MAX_HIDDEN + 2];   /* inputs, hidden..., classes */
+} layer_sizes;
+
+typedef struct {
+  uint32_t batch;
+  uint32_t threads;
+  layer_sizes layers;
+} bench_config;
+
+typedef struct {
+  double samples_per_second;
+  double step_mean, step_p50, step_p90, step_p99, step_max;   /* microseconds */
+  double batch_build;                                          /* microseconds per batch */
+  double phases[MAX_HIDDEN + 1][PROFILE_PHASES];               /* microseconds per step */
+  double other;                                                /* microseconds per step */
+  double gflops[MAX_HIDDEN + 1][PROFILE_PHASES];               /* achieved, 0 for phases without FLOPs */
+  double layer_gflops[MAX_HIDDEN + 1];                         /* all of a layer's FLOPs over all its phases */
+  double allocations, allocated_bytes;                         /* per step */
+  double eval_samples_per_second;
+  double final_loss;
+} bench_result;
+
+typedef struct {
+  uint32_t steps;
+  uint32_t warmup;
+  char* optimizer_name;
+  double peak;              /* machine peak GFLOP/s, 0 if unknown */
+  const char* trace_path;   /* trace the run when set */
+  const dataset_cache* train;
+  const dataset_cache* test;
+} bench_options;
+
+#ifdef NN_FLOAT32
+  #define ELEMENT_NAME "fp32"
+#else
+  #define ELEMENT_NAME "fp64"
+#endif
+
+#ifndef NN_BLAS_NAME
+  #ifdef NN_BUILTIN_BLAS
+    #define NN_BLAS_NAME "Builtin"
+  #else
+    #define NN_BLAS_NAME "CBLAS"
+  #endif
+#endif
+
+static void die(const char* msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+/* "128-64" -> {INPUTS, 128, 64, CLASSES}. Returns 0 on success. */
+static int parse_widths(const char* text, layer_sizes* out) {
+  out->count = 0;
+  out->sizes[out->count++] = INPUTS;
+  const char* p = text;
+  while(*p) {
+    char* end;
+    unsigned long width = strtoul(p, &end, 10);
+    if(end == p || width == 0 || out->count > MAX_HIDDEN) return 1;
+    out->sizes[out->count++] = (uint32_t)width;
+    if(*end == '-') end++;
+    else if(*end) return 1;
+    p = end;
+  }
+  out->sizes[out->count++] = CLASSES;
+  return out->count < 3;
+}
+
+/* MNIST-shaped random data: about 80% zero pixels, uniform labels. */
+static void synthetic_samples(uint32_t count, idx_u8_images* images, idx_u8_labels* labels) {
+  *images = (idx_u8_images){.count = count, .rows = 28, .cols = 28};
+  *labels = (idx_u8_labels){.count = count};
+  images->data = malloc((size_t)count * INPUTS);
+  labels->data = malloc(count);
+  if(!images->data || !labels->data) die("malloc failed");
+
+  for(uint64_t i = 0; i < (uint64_t)count * INPUTS; i++) images->data[i] = (rand() % 5 == 0) ? (uint8_t)(rand() % 256) : 0;
+  for(uint32_t i = 0; i < count; i++) labels->data[i] = (uint8_t)(rand() % CLASSES);
+}
+
+static void synthetic_dataset(uint32_t count, dataset_cache* out) {
+  idx_u8_images images;
+  idx_u8_labels labels;
+  synthetic_samples(count, &images, &labels);
+  if(dataset_cache_build(&images, &labels, out) != 0) die("Failed to build synthetic dataset");
+  free(images.data);
+  free(labels.data);
+}
+
+static void shuffle_u32(uint32_t* a, uint32_t n) {
+  for(uint32_t i = n - 1; i > 0; i--) {
+    uint32_t j = (uint32_t)(rand() % (i + 1));
+    uint32_t t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+  }
+}
+
+/* Reference batch builder: clear X and Y, then scatter each sample down its column of X. */
+static void scatter_batch(matrix* x, const idx_u8_images* images, const idx_u8_labels* labels, const uint32_t* idx,
+                          uint32_t start, uint32_t bs, matrix* y_onehot) {
+  memset(x->array, 0, x->row_size * x->column_size * sizeof(nn_real));
+  memset(y_onehot->array, 0, y_onehot->row_size * y_onehot->column_size * sizeof(nn_real));
+  for(uint32_t col = 0; col < bs; col++) {
+    uint32_t k = idx[start + col];
+    const uint8_t* img = images->data + (uint64_t)k * INPUTS;
+    for(uint32_t p = 0; p < INPUTS; p++) x->array[(uint64_t)p * bs + col] = (nn_real)(img[p] / 255.0);
+    y_onehot->array[(uint64_t)labels->data[k] * bs + col] = 1.0;
+  }
+}
+
+/* The tiled paths scale by a precomputed 1/255, so allow for rounding against the reference's division. */
+static void check_batch(const matrix* x, const matrix* y, const matrix* reference, const matrix* reference_y) {
+  for(uint64_t i = 0; i < x->row_size * x->column_size; i++) {
+    if(fabs((double)(x->array[i] - reference->array[i])) > 1e-6) die("Tiled batch differs from the scatter reference");
+  }
+  if(memcmp(y->array, reference_y->array, y->row_size * y->column_size * sizeof(nn_real)) != 0) {
+    die("Tiled labels differ from the scatter reference");
+  }
+}
+
+/*
+  Time 'batches' shuffled batches of bs samples through each builder and print us/batch: the
+  scatter reference, the tiled gather from the pre-normalized cache, and the tiled raw path over
+  samples already back to back (streamed data). Both tiled outputs are checked against the reference.
+*/
+static void bench_batch_build(uint32_t bs, uint32_t batches, const idx_u8_images* images, const idx_u8_labels* labels,
+                              const dataset_cache* cache) {
+  uint32_t count = images->count;
+  uint32_t full_batches = count / bs;
+  if(full_batches == 0) die("--samples must be at least the batch size");
+
+  uint32_t* idx = malloc((size_t)count * sizeof(uint32_t));
+  uint8_t* gathered = malloc((size_t)bs * INPUTS);
+  uint8_t* gathered_labels = malloc(bs);
+  if(!idx || !gathered || !gathered_labels) die("malloc failed");
+  for(uint32_t i = 0; i < count; i++) idx[i] = i;
+  shuffle_u32(idx, count);
+
+  matrix x = create_matrix(INPUTS, bs);
+  matrix y = create_matrix(CLASSES, bs);
+  matrix reference = create_matrix(INPUTS, bs);
+  matrix reference_y = create_matrix(CLASSES, bs);
+
+  /* 0: scatter reference, 1: tiled from the cache, 2: tiled from contiguous raw samples */
+  double seconds[3] = {0.0, 0.0, 0.0};
+  for(uint32_t s = 0; s < batches; s++) {
+    uint32_t start = (s % full_batches) * bs;
+    for(uint32_t c = 0; c < bs; c++) {
+      memcpy(gathered + (uint64_t)c * INPUTS, images->data + (uint64_t)idx[start + c] * INPUTS, INPUTS);
+      gathered_labels[c] = labels->data[idx[start + c]];
+    }
+
+    double t0 = profile_now();
+    scatter_batch(&reference, images, labels, idx, start, bs, &reference_y);
+    double t1 = profile_now();
+    build_batch_inputs(&x, cache, idx, start, bs, &y);
+    double t2 = profile_now();
+    check_batch(&x, &y, &reference, &reference_y);
+    double t3 = profile_now();
+    build_batch_inputs_u8(&x, gathered, gathered_labels, bs, &y);
+    double t4 = profile_now();
+    check_batch(&x, &y, &reference, &reference_y);
+    seconds[0] += t1 - t0;
+    seconds[1] += t2 - t1;
+    seconds[2] += t4 - t3;
+  }
+
+  printf("  batch %4u: scatter %8.2f us | tiled cache %8.2f us (%.2fx) | tiled raw %8.2f us (%.2fx)\n", bs,
+         seconds[0] * 1e6 / batches, seconds[1] * 1e6 / batches, seconds[0] / seconds[1], seconds[2] * 1e6 / batches,
+         seconds[0] / seconds[2]);
+
+  free_matrix(&x);
+  free_matrix(&y);
+  free_matrix(&reference);
+  free_matrix(&reference_y);
+  free(gathered_labels);
+  free(gathered);
+  free(idx);
+}
+
+static void run_config(const bench_config* config, const bench_options* options, bench_result* result) {
+  memset(result, 0, sizeof(*result));
+  srand(SEED);
+
+  neural_network net = create_network();
+  uint16_t layers = (uint16_t)(config->layers.count - 1);
+  for(uint16_t i = 0; i < layers; i++) {
+    add_layer(&net, linear(config->layers.sizes[i], config->layers.sizes[i + 1], i + 1 == layers ? "softmax" : "relu"));
+  }
+  optimizer opt;
+  if(optimizer_init(&opt, options->optimizer_name, &net) != 0) die("Failed to set up optimizer");
+  net.learning_rate = 0.01;
+  network_reserve(&net, config->batch);
+  /* Same rule as main: plain SGD keeps the fused update. */
+  if(opt.kind != OPTIMIZER_SGD) net.optimizer = &opt;
+
+  parallel_trainer trainer;
+  if(trainer_init(&trainer, &net, config->threads, 1, config->batch) != 0) die("Failed to start trainer");
+
+  network_profile profile;
+  if(network_profile_init(&profile, layers) != 0) die("malloc failed");
+  /* Per traced step: every phase of every layer plus a handful of spans. */
+  if(options->trace_path && network_profile_trace(&profile, TRACE_STEPS * (layers * PROFILE_PHASES + 8)) != 0) die("malloc failed");
+  net.profile = &profile;
+
+  uint32_t* idx = malloc((size_t)options->train->count * sizeof(uint32_t));
+  double* latencies = malloc((size_t)options->steps * sizeof(double));
+  if(!idx || !latencies) die("malloc failed");
+  for(uint32_t i = 0; i < options->train->count; i++) idx[i] = i;
+  shuffle_u32(idx, options->train->count);
+
+  cached_batches train_batches = {options->train, idx, config->batch};
+  uint32_t full_batches = options->train->count / config->batch;
+  if(full_batches == 0) die("--samples must be at least the batch size");
+
+  matrix x_buf = create_matrix(INPUTS, config->batch);
+  matrix y_buf = create_matrix(CLASSES, config->batch);
+
+  double build_seconds = 0.0, step_seconds = 0.0;
+  matrix_counters before = matrix_counters_read();
+  for(uint32_t s = 0; s < options->warmup + options->steps; s++) {
+    if(s == options->warmup) {
+      network_profile_reset(&profile);
+      before = matrix_counters_read();
+    }
+
+    matrix x = x_buf, y = y_buf;
+    double t0 = profile_now();
+    build_cached_batch(&train_batches, s % full_batches, &x, &y);
+    double t1 = profile_now();
+    result->final_loss = trainer_step(&trainer, &x, &y);
+    double t2 = profile_now();
+    network_profile_span(&profile, "batch_build", t0, t1);
+    network_profile_span(&profile, "train_step", t1, t2);
+
+    if(s >= options->warmup) {
+      build_seconds += t1 - t0;
+      step_seconds += t2 - t1;
+      latencies[s - options->warmup] = (t2 - t1) * 1e6;
+    }
+  }
+  matrix_counters after = matrix_counters_read();
+  net.profile = NULL;
+  if(options->trace_path && network_profile_write_trace(&profile, options->trace_path) != 0) die("Could not write the trace");
+
+  uint32_t steps = options->steps;
+  qsort(latencies, steps, sizeof(double), compare_double);
+  result->samples_per_second = (double)steps * config->batch / step_seconds;
+  result->step_mean = step_seconds * 1e6 / steps;
+  result->step_p50 = latencies[steps / 2];
+  result->step_p90 = latencies[(uint64_t)steps * 90 / 100];
+  result->step_p99 = latencies[(uint64_t)steps * 99 / 100];
+  result->step_max = latencies[steps - 1];
+  result->batch_build = build_seconds * 1e6 / steps;
+
+  result->allocations = (double)(after.allocations - before.allocations) / steps;
+  result->allocated_bytes = (double)(after.allocated_bytes - before.allocated_bytes) / steps;
+
+  double profiled = 0.0;
+  for(uint16_t l = 0; l < layers; l++) {
+    double layer_seconds = 0.0, layer_flops = 0.0;
+    for(int p = 0; p < PROFILE_PHASES; p++) {
+      double seconds = network_profile_seconds(&profile, l, (profile_phase)p);
+      double flops = network_profile_flops(&profile, l, (profile_phase)p);
+      result->phases[l][p] = seconds * 1e6 / steps;
+      result->gflops[l][p] = seconds > 0.0 ? flops / seconds * 1e-9 : 0.0;
+      profiled += result->phases[l][p];
+      layer_seconds += seconds;
+      layer_flops += flops;
+    }
+    result->layer_gflops[l] = layer_seconds > 0.0 ? layer_flops / layer_seconds * 1e-9 : 0.0;
+  }
+  result->other = result->step_mean - profiled;
+
+  /* Eval: the whole synthetic test set through the evaluator, on as many threads as training used. */
+  evaluator eval;
+  if(evaluator_init(&eval, &net, config->threads, config->batch, 1) != 0) die("Failed to start evaluator");
+  eval_dataset test_set = {options->test, NULL, NULL, options->test->count};
+  eval_result eval_metrics;
+  double t0 = profile_now();
+  evaluator_run(&eval, &net, &test_set, &eval_metrics);
+  result->eval_samples_per_second = (double)options->test->count / (profile_now() - t0);
+  evaluator_free(&eval);
+  free_matrix(&x_buf);
+  free_matrix(&y_buf);
+  free(latencies);
+  free(idx);
+  network_profile_free(&profile);
+  trainer_free(&trainer);
+  optimizer_free(&opt);
+  free_network_memory(&net);
+}
+
+static void print_result(const bench_config* config, const bench_options* options, const bench_result* r) {
+  char shape[128];
+  int used = 0;
+  for(uint32_t i = 0; i < config->layers.count && used < (int)sizeof(shape); i++) {
+    used += snprintf(shape + used, sizeof(shape) - (size_t)used, i ? "-%u" : "%u", config->layers.sizes[i]);
+  }
+
+  printf("\n%s  batch %u  threads %u\n", shape, config->batch, config->threads);
+  printf("  %.0f samples/s | step us mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f | eval %.0f samples/s\n",
+         r->samples_per_second, r->step_mean, r->step_p50, r->step_p90, r->step_p99, r->step_max, r->eval_samples_per_second);
+  printf("  batch build %.1f us/batch, other %.1f us/step, %.1f allocations (%.0f bytes)/step\n", r->batch_build, r->other,
+         r->allocations, r->allocated_bytes);
+  printf("  %-22s", "us/step");
+  for(uint32_t l = 0; l + 1 < config->layers.count; l++) printf(" %9s%u", "layer ", l);
+  printf("\n");
+  for(int p = 0; p < PROFILE_PHASES; p++) {
+    printf("  %-22s", profile_phase_name((profile_phase)p));
+    for(uint32_t l = 0; l + 1 < config->layers.count; l++) printf(" %10.1f", r->phases[l][p]);
+    printf("\n");
+  }
+  printf("  %-22s", "layer GFLOP/s");
+  for(uint32_t l = 0; l + 1 < config->layers.count; l++) printf(" %10.2f", r->layer_gflops[l]);
+  printf("\n");
+  if(options->peak > 0.0) {
+    printf("  %-22s", "% of peak");
+    for(uint32_t l = 0; l + 1 < config->layers.count; l++) printf(" %9.1f%%", 100.0 * r->layer_gflops[l] / options->peak);
+    printf("\n");
+  }
+}
+
+static void write_json(FILE* out, const bench_options* options, const bench_config* configs, const bench_result* results, uint32_t runs) {
+  fprintf(out, "{\n  \"benchmark\": \"train_bench\",\n  \"schema\": 2,\n");
+  fprintf(out, "  \"element\": \"%s\",\n  \"blas\": \"%s\",\n  \"simd\": \"%s\",\n", ELEMENT_NAME, NN_BLAS_NAME, simd_isa());
+  fprintf(out, "  \"seed\": %d,\n  \"optimizer\": \"%s\",\n  \"steps\": %u,\n  \"warmup\": %u,\n", SEED, options->optimizer_name,
+          options->steps, options->warmup);
+  fprintf(out, "  \"peak_gflop_per_sec\": %.1f,\n", options->peak);
+  fprintf(out, "  \"train_samples\": %u,\n  \"eval_samples\": %u,\n  \"runs\": [\n", options->train->count, options->test->count);
+
+  for(uint32_t i = 0; i < runs; i++) {
+    const bench_config* c = &configs[i];
+    const bench_result* r = &results[i];
+    uint32_t layers = c->layers.count - 1;
+
+    fprintf(out, "    {\n      \"batch\": %u,\n      \"threads\": %u,\n      \"layers\": [", c->batch, c->threads);
+    for(uint32_t l = 0; l < c->layers.count; l++) fprintf(out, "%s%u", l ? ", " : "", c->layers.sizes[l]);
+    fprintf(out, "],\n      \"samples_per_sec\": %.1f,\n", r->samples_per_second);
+    fprintf(out, "      \"step_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+            r->step_mean, r->step_p50, r->step_p90, r->step_p99, r->step_max);
+    fprintf(out, "      \"batch_build_us\": %.3f,\n      \"eval_samples_per_sec\": %.1f,\n      \"final_loss\": %.6f,\n",
+            r->batch_build, r->eval_samples_per_second, r->final_loss);
+    fprintf(out, "      \"phases_us\": {\n");
+    for(int p = 0; p < PROFILE_PHASES; p++) {
+      fprintf(out, "        \"%s\": [", profile_phase_name((profile_phase)p));
+      for(uint32_t l = 0; l < layers; l++) fprintf(out, "%s%.3f", l ? ", " : "", r->phases[l][p]);
+      fprintf(out, "],\n");
+    }
+    fprintf(out, "        \"other\": %.3f\n      },\n", r->other);
+    fprintf(out, "      \"gflop_per_sec\": {\n");
+    for(int p = 0; p < PROFILE_PHASES; p++) {
+      fprintf(out, "        \"%s\": [", profile_phase_name((profile_phase)p));
+      for(uint32_t l = 0; l < layers; l++) fprintf(out, "%s%.3f", l ? ", " : "", r->gflops[l][p]);
+      fprintf(out, "],\n");
+    }
+    fprintf(out, "        \"layer\": [");
+    for(uint32_t l = 0; l < layers; l++) fprintf(out, "%s%.3f", l ? ", " : "", r->layer_gflops[l]);
+    fprintf(out, "]\n      },\n");
+    fprintf(out, "      \"allocations_per_step\": %.3f,\n      \"allocated_bytes_per_step\": %.1f\n    }%s\n",
+            r->allocations, r->allocated_bytes, i + 1 < runs ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+  uint32_t batches[MAX_SWEEP] = {32, 128, 256};
+  uint32_t batch_count = 3;
+  uint32_t threads[MAX_SWEEP] = {1};
+  uint32_t thread_count = 1;
+  layer_sizes widths[MAX_SWEEP];
+  uint32_t width_count = 0;
+  uint32_t train_samples = 8192, eval_samples = 2048;
+  bench_options options = {.steps = 200, .warmup = 20, .optimizer_name = "sgd"};
+  char* json_path = NULL;
+  char* trace_path = NULL;
+  uint32_t batch_build = 0;
+  int usage = 0, user_batches = 0, user_threads = 0;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      if(!user_batches) batch_count = 0;
+      user_batches = 1;
+      if(batch_count < MAX_SWEEP) batches[batch_count++] = (uint32_t)atoi(argv[++i]);
+      else usage = 1;
+    }
+    else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      if(!user_threads) thread_count = 0;
+      user_threads = 1;
+      if(thread_count < MAX_SWEEP) threads[thread_count++] = (uint32_t)atoi(argv[++i]);
+      else usage = 1;
+    }
+    else if(strcmp(argv[i], "--widths") == 0 && i + 1 < argc) {
+      if(width_count >= MAX_SWEEP || parse_widths(argv[++i], &widths[width_count++]) != 0) usage = 1;
+    }
+    else if(strcmp(argv[i], "--steps") == 0 && i + 1 < argc) options.steps = (uint32_t)atoi(argv[++i]);
+    else if(strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) options.warmup = (uint32_t)atoi(argv[++i]);
+    else if(strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc) options.optimizer_name = argv[++i];
+    else if(strcmp(argv[i], "--samples") == 0 && i + 1 < argc) train_samples = (uint32_t)atoi(argv[++i]);
+    else if(strcmp(argv[i], "--eval-samples") == 0 && i + 1 < argc) eval_samples = (uint32_t)atoi(argv[++i]);
+    else if(strcmp(argv[i], "--json") == 0 && i + 1 < argc) json_path = argv[++i];
+    else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace_path = argv[++i];
+    else if(strcmp(argv[i], "--peak") == 0 && i + 1 < argc) options.peak = atof(argv[++i]);
+    else if(strcmp(argv[i], "--batch-build") == 0 && i + 1 < argc) {
+      batch_build = (uint32_t)atoi(argv[++i]);
+      usage |= batch_build == 0;
+    }
+    else usage = 1;
+  }
+  if(width_count == 0) parse_widths("128-64", &widths[width_count++]);
+  for(uint32_t b = 0; b < batch_count; b++) usage |= batches[b] == 0;
+  for(uint32_t t = 0; t < thread_count; t++) usage |= threads[t] == 0;
+  if(usage || options.steps == 0 || train_samples == 0 || eval_samples == 0) {
+    fprintf(stderr, "Usage: %s [--batch N]... [--threads N]... [--widths W1-W2-...]... [--steps N] [--warmup N]"
+                    " [--optimizer NAME] [--samples N] [--eval-samples N] [--json PATH] [--trace PATH] [--peak GFLOPS]"
+                    " [--batch-build N]\n", argv[0]);
+    return 1;
+  }
+
+  if(batch_build) {
+    srand(SEED);
+    idx_u8_images images;
+    idx_u8_labels labels;
+    dataset_cache cache;
+    synthetic_samples(train_samples, &images, &labels);
+    if(dataset_cache_build(&images, &labels, &cache) != 0) die("Failed to build synthetic dataset");
+    printf("train_bench: batch build, %s, %u batches per size from %u synthetic samples\n", ELEMENT_NAME, batch_build, train_samples);
+    for(uint32_t b = 0; b < batch_count; b++) bench_batch_build(batches[b], batch_build, &images, &labels, &cache);
+    dataset_cache_free(&cache);
+    free(images.data);
+    free(labels.data);
+    return 0;
+  }
+
+  srand(SEED);
+  dataset_cache train, test;
+  synthetic_dataset(train_samples, &train);
+  synthetic_dataset(eval_samples, &test);
+  options.train = &train;
+  options.test = &test;
+
+  uint32_t runs = batch_count * thread_count * width_count;
+  bench_config* configs = calloc(runs, sizeof(bench_config));
+  bench_result* results = calloc(runs, sizeof(bench_result));
+  if(!configs || !results) die("malloc failed");
+
+  printf("train_bench: %s, BLAS %s, SIMD %s, optimizer %s, %u timed steps after %u warmup\n", ELEMENT_NAME, NN_BLAS_NAME,
+         simd_isa(), options.optimizer_name, options.steps, options.warmup);
+
+  uint32_t run = 0;
+  for(uint32_t w = 0; w < width_count; w++) {
+    for(uint32_t t = 0; t < thread_count; t++) {
+      for(uint32_t b = 0; b < batch_count; b++, run++) {
+        configs[run] = (bench_config){.batch = batches[b], .threads = threads[t], .layers = widths[w]};
+        options.trace_path = run == 0 ? trace_path : NULL;
+        run_config(&configs[run], &options, &results[run]);
+        print_result(&configs[run], &options, &results[run]);
+      }
+    }
+  }
+
+  if(json_path) {
+    FILE* out = fopen(json_path, "w");
+    if(!out) die("Could not open the JSON output");
+    write_json(out, &options, configs, results, runs);
+    if(fclose(out) != 0) die("Could not write the JSON output");
+  }
+
+  free(configs);
+  free(results);
+  dataset_cache_free(&train);
+  dataset_cache_free(&test);
+  return 0;
+}
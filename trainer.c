@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "trainer.h"
+#include "profile.h"
+
+static void barrier_init(trainer_barrier* b, uint32_t count) {
+  pthread_mutex_init(&b->mutex, NULL);
+  pthread_cond_init(&b->cond, NULL);
+  b->count = count;
+  b->waiting = 0;
+  b->phase = 0;
+}
+
+static void barrier_wait(trainer_barrier* b) {
+  pthread_mutex_lock(&b->mutex);
+  uint64_t phase = b->phase;
+  if(++b->waiting == b->count) {
+    b->waiting = 0;
+    b->phase++;
+    pthread_cond_broadcast(&b->cond);
+  } else {
+    while(phase == b->phase) {
+      pthread_cond_wait(&b->cond, &b->mutex);
+    }
+  }
+  pthread_mutex_unlock(&b->mutex);
+}
+
+static void barrier_destroy(trainer_barrier* b) {
+  pthread_mutex_destroy(&b->mutex);
+  pthread_cond_destroy(&b->cond);
+}
+
+/* Copy columns [start, start + dst->column_size) of src into the packed matrix dst. */
+static void gather_columns(const matrix* src, uint64_t start, matrix* dst) {
+  assert(src->row_size == dst->row_size && start + dst->column_size <= src->column_size);
+  for(uint64_t r = 0; r < src->row_size; r++) {
+    memcpy(dst->array + r * dst->column_size, src->array + r * src->column_size + start, dst->column_size * sizeof(nn_real));
+  }
+}
+
+/* Forward and backward over this worker's shard of the current batch. */
+static void worker_gradients(trainer_worker* w) {
+  parallel_trainer* t = w->trainer;
+  if(t->micro_step == 0) w->has_gradients = 0;
+  w->loss = 0.0;
+  if(t->flush) return;
+
+  uint64_t batch = t->inputs->column_size;
+  uint64_t per = batch / t->threads;
+  uint64_t extra = batch % t->threads;
+  uint64_t start = w->id * per + (w->id < extra ? w->id : extra);
+
+  w->shard_size = per + (w->id < extra ? 1 : 0);
+  if(!w->shard_size) return;
+
+  /* Worker 0 runs on the calling thread, so it is the one that feeds the network's profile. */
+  if(w->id == 0) w->replica.profile = t->network->profile;
+
+  matrix x = {.row_size = w->x.row_size, .column_size = w->shard_size, .array = w->x.array};
+  matrix y = {.row_size = w->y.row_size, .column_size = w->shard_size, .array = w->y.array};
+  gather_columns(t->inputs, start, &x);
+  gather_columns(t->y_true, start, &y);
+
+  matrix out = forward_pass(&w->replica, &x);
+  w->loss = cross_entropy(&out, &y) * (double)w->shard_size;
+  compute_gradients(&w->replica, &x, &y, w->has_gradients);
+  w->has_gradients = 1;
+}
+
+/*
+  Sum [lo, hi) of the gradient block over all workers into the shared network's gradients, then
+  update that slice of the parameters.
+*/
+static void reduce_range(parallel_trainer* t, uint64_t lo, uint64_t hi) {
+  if(lo >= hi) return;
+  nn_real* grad = t->network->gradients.base;
+
+  int first = 1;
+  for(uint32_t r = 0; r < t->threads; r++) {
+    if(!t->workers[r].has_gradients) continue;
+    const nn_real* g = t->workers[r].replica.gradients.base;
+    if(first) {
+      memcpy(grad + lo, g + lo, (hi - lo) * sizeof(nn_real));
+      first = 0;
+    } else {
+      for(uint64_t k = lo; k < hi; k++) {
+        grad[k] += g[k];
+      }
+    }
+  }
+
+  if(!first) update_range(t->network, lo, hi, t->pending_samples);
+}
+
+/* Reduce this worker's slice of the gradient block and update that slice of the shared weights. */
+static void worker_reduce(trainer_worker* w) {
+  parallel_trainer* t = w->trainer;
+  if(!t->apply) return;
+
+  /* Slices are whole cache lines, so no two workers write the same line. */
+  const neural_network* network = t->network;
+  uint64_t n = network->parameters.used;
+  uint64_t chunk = arena_matrix_size((n + t->threads - 1) / t->threads, 1);
+  uint64_t lo = (uint64_t)w->id * chunk < n ? (uint64_t)w->id * chunk : n;
+  uint64_t hi = lo + chunk < n ? lo + chunk : n;
+
+  network_profile* profile = (w->id == 0) ? network->profile : NULL;
+  if(!profile) {
+    reduce_range(t, lo, hi);
+    return;
+  }
+
+  /* Profiling attributes the update to layers, so the slice is cut where each layer's parameters end. */
+  for(int i = 0; i < network->number_of_layers && lo < hi; i++) {
+    const layer* l = &network->layers[i];
+    uint64_t layer_end = (uint64_t)(l->biases.array - network->parameters.base) + arena_matrix_size(l->biases.row_size, 1);
+    if(lo >= layer_end) continue;
+    uint64_t end = hi < layer_end ? hi : layer_end;
+    double start = profile_now();
+    reduce_range(t, lo, end);
+    network_profile_add(profile, (uint16_t)i, PROFILE_UPDATE, start, profile_now(), 0.0);
+    lo = end;
+  }
+}
+
+static void* worker_main(void* arg) {
+  trainer_worker* w = (trainer_worker*)arg;
+  parallel_trainer* t = w->trainer;
+
+  for(;;) {
+    barrier_wait(&t->barrier);
+    if(t->stop) break;
+    worker_gradients(w);
+    barrier_wait(&t->barrier);
+    worker_reduce(w);
+    barrier_wait(&t->barrier);
+  }
+  return NULL;
+}
+
+/* A network sharing master's parameter block but owning its own workspace and gradient block. */
+static void replica_init(neural_network* replica, neural_network* master, uint64_t max_batch) {
+  if(network_clone(replica, master) != 0) {
+    printf("Failed to allocate replica layers\n");
+    exit(EXIT_FAILURE);
+  }
+  network_borrow_parameters(replica, master->parameters.base);
+  network_reserve(replica, max_batch);
+}
+
+static void replica_free(neural_network* replica) {
+  free_network_memory(replica);
+}
+
+int trainer_init(parallel_trainer* trainer, neural_network* network, uint32_t threads, uint32_t accumulation_steps, uint64_t max_batch) {
+  memset(trainer, 0, sizeof(*trainer));
+  if(threads == 0 || accumulation_steps == 0 || network->number_of_layers == 0) return 1;
+
+  trainer->network = network;
+  trainer->threads = threads;
+  trainer->accumulation_steps = accumulation_steps;
+
+  /* The shared network's dW/db hold the reduced gradients. */
+  network_reserve(network, max_batch);
+
+  /* A single worker trains the network in place; no replicas or threads needed. */
+  if(threads == 1) return 0;
+
+  trainer->workers = calloc(threads, sizeof(trainer_worker));
+  if(!trainer->workers) return 2;
+
+  uint64_t max_shard = (max_batch + threads - 1) / threads;
+  uint64_t inputs = network->layers[0].weights.column_size;
+  uint64_t outputs = network->layers[network->number_of_layers - 1].neurons;
+
+  for(uint32_t i = 0; i < threads; i++) {
+    trainer_worker* w = &trainer->workers[i];
+    w->trainer = trainer;
+    w->id = i;
+    replica_init(&w->replica, network, max_shard);
+    w->x = create_matrix(inputs, max_shard);
+    w->y = create_matrix(outputs, max_shard);
+  }
+
+  barrier_init(&trainer->barrier, threads);
+  for(uint32_t i = 1; i < threads; i++) {
+    if(pthread_create(&trainer->workers[i].thread, NULL, worker_main, &trainer->workers[i]) != 0) {
+      printf("Failed to start trainer worker %u\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return 0;
+}
+
+/*
+  Run one job (a batch, or a flush) through all workers, taking worker 0's share on this thread.
+  A traced profile gets worker 0's part as spans, including the waits for the other workers.
+*/
+static void run_workers(parallel_trainer* trainer) {
+  network_profile* profile = trainer->network->profile;
+  barrier_wait(&trainer->barrier);
+  double t0 = profile ? profile_now() : 0.0;
+  worker_gradients(&trainer->workers[0]);
+  double t1 = profile ? profile_now() : 0.0;
+  barrier_wait(&trainer->barrier);
+  double t2 = profile ? profile_now() : 0.0;
+  worker_reduce(&trainer->workers[0]);
+  double t3 = profile ? profile_now() : 0.0;
+  barrier_wait(&trainer->barrier);
+  if(profile) {
+    network_profile_span(profile, "worker_gradients", t0, t1);
+    network_profile_span(profile, "wait_gradients", t1, t2);
+    network_profile_span(profile, "reduce_update", t2, t3);
+    network_profile_span(profile, "wait_update", t3, profile_now());
+  }
+}
+
+double trainer_step(parallel_trainer* trainer, matrix* inputs, matrix* y_true) {
+  int last_micro_step = (trainer->micro_step + 1 == trainer->accumulation_steps);
+  double loss = 0.0;
+
+  trainer->pending_samples += inputs->column_size;
+
+  if(trainer->threads == 1) {
+    matrix out = forward_pass(trainer->network, inputs);
+    loss = cross_entropy(&out, y_true);
+    if(trainer->accumulation_steps == 1 && !trainer->network->optimizer) {
+      back_propagate(trainer->network, inputs, y_true);
+    } else {
+      compute_gradients(trainer->network, inputs, y_true, trainer->micro_step > 0);
+      if(last_micro_step) apply_update(trainer->network, trainer->pending_samples);
+    }
+  } else {
+    assert(inputs->column_size <= trainer->workers[0].x.column_size * trainer->threads);
+
+    trainer->inputs = inputs;
+    trainer->y_true = y_true;
+    trainer->apply = last_micro_step;
+    if(trainer->apply) begin_update(trainer->network);
+    run_workers(trainer);
+
+    for(uint32_t i = 0; i < trainer->threads; i++) {
+      loss += trainer->workers[i].loss;
+    }
+    loss /= (double)inputs->column_size;
+  }
+
+  if(last_micro_step) {
+    trainer->micro_step = 0;
+    trainer->pending_samples = 0;
+  } else {
+    trainer->micro_step++;
+  }
+  return loss;
+}
+
+void trainer_flush(parallel_trainer* trainer) {
+  if(trainer->micro_step == 0) return;
+
+  if(trainer->threads == 1) {
+    apply_update(trainer->network, trainer->pending_samples);
+  } else {
+    trainer->flush = 1;
+    trainer->apply = 1;
+    begin_update(trainer->network);
+    run_workers(trainer);
+    trainer->flush = 0;
+  }
+
+  trainer->micro_step = 0;
+  trainer->pending_samples = 0;
+}
+
+void trainer_free(parallel_trainer* trainer) {
+  if(trainer->workers) {
+    trainer->stop = 1;
+    barrier_wait(&trainer->barrier);
+    for(uint32_t i = 1; i < trainer->threads; i++) {
+      pthread_join(trainer->workers[i].thread, NULL);
+    }
+    barrier_destroy(&trainer->barrier);
+
+    for(uint32_t i = 0; i < trainer->threads; i++) {
+      replica_free(&trainer->workers[i].replica);
+      free_matrix(&trainer->workers[i].x);
+      free_matrix(&trainer->workers[i].y);
+    }
+    free(trainer->workers);
+  }
+  memset(trainer, 0, sizeof(*trainer));
+}
+
+/*
+  param[k] -= step * grad[k] with relaxed atomic loads and stores, so concurrent Hogwild updates
+  never tear each other's values. The gemms' plain reads of the same weights are not covered;
+  see the benign-race note on hogwild_trainer.
+*/
+static void hogwild_update(nn_real* param, const nn_real* grad, uint64_t n, nn_real step) {
+  for(uint64_t k = 0; k < n; k++) {
+    nn_real value;
+    __atomic_load(&param[k], &value, __ATOMIC_RELAXED);
+    value -= step * grad[k];
+    __atomic_store(&param[k], &value, __ATOMIC_RELAXED);
+  }
+}
+
+/* Claim and train on batches until the epoch runs out. */
+static void hogwild_work(hogwild_worker* w) {
+  hogwild_trainer* t = w->trainer;
+  neural_network* replica = &w->replica;
+  w->loss = 0.0;
+
+  for(;;) {
+    uint64_t step = __atomic_fetch_add(&t->next_step, 1, __ATOMIC_RELAXED);
+    if(step >= t->steps) break;
+
+    matrix x = w->x, y = w->y;
+    t->build(t->context, step, &x, &y);
+    matrix out = forward_pass(replica, &x);
+    w->loss += cross_entropy(&out, &y);
+    compute_gradients(replica, &x, &y, 0);
+
+    nn_real lr = (nn_real)(t->network->learning_rate / (double)x.column_size);
+    hogwild_update(replica->parameters.base, replica->gradients.base, replica->parameters.used, lr);
+  }
+}
+
+static void* hogwild_main(void* arg) {
+  hogwild_worker* w = (hogwild_worker*)arg;
+  hogwild_trainer* t = w->trainer;
+
+  for(;;) {
+    barrier_wait(&t->barrier);
+    if(t->stop) break;
+    hogwild_work(w);
+    barrier_wait(&t->barrier);
+  }
+  return NULL;
+}
+
+int hogwild_init(hogwild_trainer* trainer, neural_network* network, uint32_t threads, uint64_t max_batch) {
+  memset(trainer, 0, sizeof(*trainer));
+  if(threads == 0 || network->number_of_layers == 0 || network->optimizer) return 1;
+
+  trainer->network = network;
+  trainer->threads = threads;
+  trainer->workers = calloc(threads, sizeof(hogwild_worker));
+  if(!trainer->workers) return 2;
+
+  uint64_t inputs = network->layers[0].weights.column_size;
+  uint64_t outputs = network->layers[network->number_of_layers - 1].neurons;
+  for(uint32_t i = 0; i < threads; i++) {
+    hogwild_worker* w = &trainer->workers[i];
+    w->trainer = trainer;
+    w->id = i;
+    replica_init(&w->replica, network, max_batch);
+    w->x = create_matrix(inputs, max_batch);
+    w->y = create_matrix(outputs, max_batch);
+  }
+
+  barrier_init(&trainer->barrier, threads);
+  for(uint32_t i = 1; i < threads; i++) {
+    if(pthread_create(&trainer->workers[i].thread, NULL, hogwild_main, &trainer->workers[i]) != 0) {
+      printf("Failed to start Hogwild worker %u\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return 0;
+}
+
+double hogwild_epoch(hogwild_trainer* trainer, batch_builder build, void* context, uint64_t steps) {
+  trainer->build = build;
+  trainer->context = context;
+  trainer->steps = steps;
+  trainer->next_step = 0;
+
+  barrier_wait(&trainer->barrier);
+  hogwild_work(&trainer->workers[0]);
+  barrier_wait(&trainer->barrier);
+
+  double loss = 0.0;
+  for(uint32_t i = 0; i < trainer->threads; i++) loss += trainer->workers[i].loss;
+  return steps ? loss / (double)steps : 0.0;
+}
+
+void hogwild_free(hogwild_trainer* trainer) {
+  if(!trainer->workers) return;
+
+  trainer->stop = 1;
+  barrier_wait(&trainer->barrier);
+  for(uint32_t i = 1; i < trainer->threads; i++) pthread_join(trainer->workers[i].thread, NULL);
+  barrier_destroy(&trainer->barrier);
+
+  for(uint32_t i = 0; i < trainer->threads; i++) {
+    replica_free(&trainer->workers[i].replica);
+    free_matrix(&trainer->workers[i].x);
+    free_matrix(&trainer->workers[i].y);
+  }
+  free(trainer->workers);
+  trainer->workers = NULL;
+}
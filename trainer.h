@@ -0,0 +1,136 @@
+#ifndef TRAINER_H_
+#define TRAINER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "matrix.h"
+#include "neural_network.h"
+#include "pipeline.h"
+
+/* Reusable counting barrier (pthread_barrier_t is not available everywhere). */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint32_t count;
+  uint32_t waiting;
+  uint64_t phase;
+} trainer_barrier;
+
+typedef struct trainer_worker {
+  struct parallel_trainer* trainer;
+  uint32_t id;
+  pthread_t thread;
+  /* Private network whose layers alias the shared weights but own their workspace and gradients. */
+  neural_network replica;
+  /* This worker's column shard of the current batch. */
+  matrix x;
+  matrix y;
+  uint64_t shard_size;
+  /* Set once the replica's dW/db hold gradients for the current accumulation window. */
+  int has_gradients;
+  double loss;
+} trainer_worker;
+
+/*
+  Synchronous data-parallel SGD. Each step splits the batch's columns into one shard per worker.
+  Every worker runs forward_pass/compute_gradients on its shard against the shared weights.
+  Once all shards are done, each worker sums one cache-aligned slice of the flat gradient block
+  over the workers into the shared network's gradients and applies the update
+  (network->optimizer, or SGD) to that slice, so the weights see exactly one step per batch.
+  The calling thread acts as worker 0.
+
+  With accumulation_steps > 1, gradients from that many consecutive batches are summed in the
+  workers' persistent dW/db before a single update, simulating a larger batch without the
+  activation memory for it.
+*/
+typedef struct parallel_trainer {
+  neural_network* network;
+  uint32_t threads;
+  trainer_worker* workers;
+  trainer_barrier barrier;
+  uint32_t accumulation_steps;
+  uint32_t micro_step;
+  uint64_t pending_samples;
+
+  /* Current job, published before the start barrier. */
+  matrix* inputs;
+  matrix* y_true;
+  int apply;  /* reduce and update after this job */
+  int flush;  /* no new batch, just apply pending gradients */
+  int stop;
+} parallel_trainer;
+
+/*
+  Start 'threads' workers (threads - 1 new pthreads) for batches of up to max_batch samples,
+  applying one update every accumulation_steps batches. The network must be fully built.
+  Returns 0 on success, nonzero on failure.
+*/
+int trainer_init(parallel_trainer* trainer, neural_network* network, uint32_t threads, uint32_t accumulation_steps, uint64_t max_batch);
+
+/*
+  Feed one batch: inputs (features x batch), y_true (classes x batch). Updates the weights when
+  the accumulation window is complete. Returns the batch's mean cross-entropy.
+*/
+double trainer_step(parallel_trainer* trainer, matrix* inputs, matrix* y_true);
+
+/* Apply any gradients left over from an incomplete accumulation window (e.g. at epoch end). */
+void trainer_flush(parallel_trainer* trainer);
+
+/* Join the workers and release their buffers. Does not free the network. */
+void trainer_free(parallel_trainer* trainer);
+
+typedef struct hogwild_worker {
+  struct hogwild_trainer* trainer;
+  uint32_t id;
+  pthread_t thread;
+  neural_network replica;   /* shares the weights, owns its workspace and gradients */
+  matrix x;                 /* this worker's own batch buffers */
+  matrix y;
+  double loss;              /* sum of this worker's batch losses this epoch */
+} hogwild_worker;
+
+/*
+  Hogwild-style lock-free asynchronous SGD. Every worker claims whole batches, builds them
+  itself, runs forward_pass/compute_gradients against the shared weights, and applies its SGD
+  step straight to them with no locks and no barrier between batches. Workers therefore read
+  weights that other workers are part-way through updating, and updates can overwrite each
+  other; the bet is that with small, dense-but-cheap steps this costs less convergence than the
+  synchronization it saves.
+
+  The update side uses relaxed atomic loads and stores per element, so two updates never mix
+  into a torn value (concurrent updates to one element can still be lost). The forward and
+  backward gemms read the shared weights with plain, non-atomic loads while other workers
+  store to them. In C11 terms that is a data race (ThreadSanitizer reports it), and the mode
+  relies on it being benign: aligned float/double stores and loads are single instructions on
+  the supported targets, so a reader sees either the old or the new value of an element.
+
+  Plain SGD only: optimizer state would be raced on the same way, and momentum/Adam do not
+  tolerate it as well. The batch builder must accept concurrent calls for different steps
+  (build_cached_batch does; sequential stream readers do not). The calling thread acts as
+  worker 0.
+*/
+typedef struct hogwild_trainer {
+  neural_network* network;
+  uint32_t threads;
+  hogwild_worker* workers;
+  trainer_barrier barrier;
+
+  /* Current epoch, published before the start barrier. */
+  batch_builder build;
+  void* context;
+  uint64_t steps;
+  uint64_t next_step;       /* claimed with an atomic add */
+  int stop;
+} hogwild_trainer;
+
+/* Start 'threads' workers (threads - 1 new pthreads) for batches of up to max_batch samples. Returns 0 on success, nonzero on failure. */
+int hogwild_init(hogwild_trainer* trainer, neural_network* network, uint32_t threads, uint64_t max_batch);
+
+/* Train on batches 0 .. steps - 1 of 'build', in whatever order the workers claim them. Returns the mean batch loss. */
+double hogwild_epoch(hogwild_trainer* trainer, batch_builder build, void* context, uint64_t steps);
+
+/* Join the workers and release their buffers. Does not free the network. */
+void hogwild_free(hogwild_trainer* trainer);
+
+#endif